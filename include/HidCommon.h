@@ -25,6 +25,7 @@
 #define REPORTID_UMAPP_CONF  0x09
 #define REPORTID_PEN 0x0A
 #define REPORTID_PENHQA 0x0B
+#define REPORTID_KEYPAD 0x0C
 
 #define BUTTON_SWITCH 0x57
 #define SURFACE_SWITCH 0x58
@@ -32,6 +33,7 @@
 #define USAGE_PAGE 0x05
 #define USAGE_PAGE_1 0x06
 #define USAGE      0x09
+#define USAGE_2    0x0a
 #define USAGE_MINIMUM 0x19
 #define USAGE_MAXIMUM 0x29
 #define LOGICAL_MINIMUM 0x15
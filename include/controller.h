@@ -9,7 +9,7 @@
 #define RESHUB_USE_HELPER_ROUTINES
 #include <reshub.h>
 #include "trace.h"
-#include "spb.h"
+#include "spbtarget.h"
 
 //
 // Memory tags
@@ -75,6 +75,22 @@ typedef struct _PEN_REPORT {
     USHORT      ScanTime;
 } PEN_REPORT, * PPEN_REPORT;
 
+//
+// Types for the 0D capacitive buttons
+//
+#define KEYPAD_BUTTON_COUNT 3
+
+#pragma pack(push)
+#pragma pack(1)
+typedef struct _KEYPAD_REPORT {
+    UCHAR       ReportID;
+    UCHAR       Back      : 1;
+    UCHAR       Home      : 1;
+    UCHAR       Search    : 1;
+    UCHAR       Padding   : 5;
+} KEYPAD_REPORT, * PKEYPAD_REPORT;
+#pragma pack(pop)
+
 //
 // General types
 //
@@ -82,6 +98,7 @@ typedef union _DEV_REPORT
 {
     PEN_REPORT PenReport;
     PTP_REPORT PtpReport;
+    KEYPAD_REPORT KeypadReport;
 } DEV_REPORT, * PDEV_REPORT;
 
 NTSTATUS 
@@ -124,13 +141,83 @@ TchRegistryGetControllerSettings(
     IN VOID *ControllerContext,
     IN WDFDEVICE FxDevice
     );
+
+NTSTATUS
+TchRegistryQueryDiscoveryCache(
+    IN WDFDEVICE FxDevice,
+    OUT WDFMEMORY *Memory
+    );
+
+NTSTATUS
+TchRegistrySetDiscoveryCache(
+    IN WDFDEVICE FxDevice,
+    IN PVOID Buffer,
+    IN ULONG Length
+    );
    
 NTSTATUS
-TchServiceInterrupts(
+TchCaptureInterrupts(
+    IN VOID *ControllerContext,
+    IN SPB_CONTEXT *SpbContext,
+    IN ULONG64 Timestamp
+    );
+
+BOOLEAN
+TchUpdateInterruptMode(
+    IN VOID *ControllerContext,
+    IN SPB_CONTEXT *SpbContext,
+    OUT ULONG *PollInterval
+    );
+
+BOOLEAN
+TchMaskInterrupts(
+    IN VOID *ControllerContext,
+    IN SPB_CONTEXT *SpbContext
+    );
+
+BOOLEAN
+TchUnmaskInterrupts(
+    IN VOID *ControllerContext,
+    IN SPB_CONTEXT *SpbContext
+    );
+
+BOOLEAN
+TchPollFrame(
     IN VOID *ControllerContext,
     IN SPB_CONTEXT *SpbContext,
+    OUT BOOLEAN *FrameCaptured,
+    OUT ULONG *PollInterval
+    );
+
+BOOLEAN
+TchUpdateDozePolicy(
+    IN VOID *ControllerContext,
+    IN SPB_CONTEXT *SpbContext,
+    OUT ULONG *IdleTimeout
+    );
+
+VOID
+TchDozeIdle(
+    IN VOID *ControllerContext,
+    IN SPB_CONTEXT *SpbContext
+    );
+
+NTSTATUS
+TchServiceInterrupts(
+    IN VOID *ControllerContext,
     IN PDEV_REPORT HidReport,
     IN UCHAR InputMode,
     OUT BOOLEAN *ServicingComplete
 );
 
+BOOLEAN
+TchGetHeldReportDelay(
+    IN VOID *ControllerContext,
+    OUT ULONG64 *Delay
+);
+
+NTSTATUS
+TchTestDiscoveryCache(
+    VOID
+);
+
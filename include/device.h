@@ -27,6 +27,22 @@ EVT_WDF_DEVICE_D0_EXIT OnD0Exit;
 
 EVT_WDF_INTERRUPT_ISR OnInterruptIsr;
 
+EVT_WDF_WORKITEM OnProcessingWorkItem;
+
+EVT_WDF_TIMER OnRateTimer;
+
+EVT_WDF_TIMER OnPollTimer;
+
+EVT_WDF_WORKITEM OnPollWorkItem;
+
+EVT_WDF_TIMER OnDozeTimer;
+
+EVT_WDF_WORKITEM OnDozeWorkItem;
+
+EVT_WDF_TIMER OnStormTimer;
+
+EVT_WDF_WORKITEM OnStormWorkItem;
+
 EVT_WDF_DEVICE_PREPARE_HARDWARE OnPrepareHardware;
 
 EVT_WDF_DEVICE_RELEASE_HARDWARE OnReleaseHardware;
\ No newline at end of file
@@ -323,6 +323,23 @@ TchReadReport(
 		FEATURE, 0x02, \
 	END_COLLECTION /* End Collection */
 
+#define SYNAPTICS_KEYPAD_TLC \
+	USAGE_PAGE, 0x0c, /* Usage Page: Consumer */ \
+	USAGE, 0x01, /* Usage: Consumer Control */ \
+	BEGIN_COLLECTION, 0x01, /* Begin Collection: Application */ \
+		REPORT_ID, REPORTID_KEYPAD, /* Report ID: Keypad */ \
+		LOGICAL_MINIMUM, 0x00, /* Logical Minimum: 0 */ \
+		LOGICAL_MAXIMUM, 0x01, /* Logical Maximum: 1 */ \
+		REPORT_SIZE, 0x01, /* Report Size: 0x01 */ \
+		REPORT_COUNT, 0x03, /* Report Count: 0x03 */ \
+		USAGE_2, 0x24, 0x02, /* Usage: AC Back (button 0) */ \
+		USAGE_2, 0x23, 0x02, /* Usage: AC Home (button 1) */ \
+		USAGE_2, 0x21, 0x02, /* Usage: AC Search (button 2) */ \
+		INPUT, 0x02, /* Input: (Data, Var, Abs) */ \
+		REPORT_COUNT, 0x05, /* Report Count: 0x05 */ \
+		INPUT, 0x03, /* Input: (Const, Var, Abs) */ \
+	END_COLLECTION /* End Collection */
+
 #define SYNAPTICS_CONFIGURATION_TLC \
 	USAGE_PAGE, 0x0d, /* Usage Page: Digitizer */ \
 	USAGE, 0x0e, /* Usage: Configuration */ \
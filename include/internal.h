@@ -5,6 +5,24 @@
 
 #include "controller.h"
 
+//
+// Frame processing budget, a pass yields to a new work item once it has
+// produced this many reports or run for this long
+//
+#define TOUCH_PROCESSING_MAX_REPORTS    32
+#define TOUCH_PROCESSING_BUDGET_US      4000
+
+//
+// An interrupt storm is declared when this many interrupts capture no
+// frame within the window. The interrupts are then masked for a backoff,
+// doubling on each further empty interrupt, until a frame is captured or
+// a window passes without empty interrupts
+//
+#define TOUCH_STORM_WINDOW_MS           100
+#define TOUCH_STORM_THRESHOLD           20
+#define TOUCH_STORM_MIN_BACKOFF_MS      1
+#define TOUCH_STORM_MAX_BACKOFF_MS      32
+
 //
 // Device context
 //
@@ -28,6 +46,65 @@ typedef struct _DEVICE_EXTENSION
     //
     WDFINTERRUPT InterruptObject;
     BOOLEAN ServiceInterruptsAfterD0Entry;
+
+    //
+    // Turns the frames captured by the ISR into HID reports
+    //
+    WDFWORKITEM ProcessingWorkItem;
+    ULONG ProcessingBudgetExhausted;
+
+    //
+    // Keeps a single instance of the work item processing, a pass
+    // requested while it runs is made by the running instance
+    //
+    volatile LONG ProcessingActive;
+    volatile LONG ProcessingPending;
+
+    //
+    // Runs processing again when a frame held back by the report rate
+    // limiter is due
+    //
+    WDFTIMER RateTimer;
+
+    //
+    // Frame polling under sustained touch data
+    //
+    WDFTIMER PollTimer;
+    WDFWORKITEM PollWorkItem;
+
+    //
+    // Returns to the idle doze profile once touch stopped for a while
+    //
+    WDFTIMER DozeTimer;
+    WDFWORKITEM DozeWorkItem;
+
+    //
+    // Interrupt storm detection, times are in 100ns units
+    //
+    ULONG64 StormWindowStart;
+    ULONG64 LastEmptyInterrupt;
+    ULONG EmptyInterrupts;
+    ULONG EmptyInterruptsTotal;
+    ULONG StormBackoff;
+    ULONG StormCount;
+
+    //
+    // Unmasks the interrupts once the storm backoff expired
+    //
+    WDFTIMER StormTimer;
+    WDFWORKITEM StormWorkItem;
+    ULONG64 MaxIsrTime;
+
+    //
+    // Resume timeline, from D0 entry to the first completed report. Times
+    // are in 100ns units
+    //
+    ULONG64 ResumeStart;
+    ULONG64 ResumeWakeTime;
+    BOOLEAN ResumeReportPending;
+    ULONG Resumes;
+    ULONG64 LastResumeLatency;
+    ULONG64 MaxResumeLatency;
     
     //
     // Spb (I2C) related members used for the lifetime of the device
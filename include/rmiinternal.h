@@ -48,6 +48,7 @@
 
 #define RMI4_FIRST_FUNCTION_ADDRESS       0xE9
 #define RMI4_PAGE_SELECT_ADDRESS          0xFF
+#define RMI4_INVALID_PAGE                 (-1)
 
 #define RMI4_F01_RMI_DEVICE_CONTROL       0x01
 #define RMI4_F12_2D_TOUCHPAD_SENSOR		  0x12
@@ -132,6 +133,19 @@ typedef struct _RMI4_F01_QUERY_REGISTERS
     BYTE Reserved31;
 } RMI4_F01_QUERY_REGISTERS;
 
+//
+// Query bytes read from the chip, identifying product and firmware
+//
+#define RMI4_F01_IDENTITY_SIZE \
+    FIELD_OFFSET(RMI4_F01_QUERY_REGISTERS, ProductID10)
+
+//
+// Interrupt sources are numbered in PDT order, each function owning as
+// many consecutive bits of the F01 interrupt status and enable registers
+// as its descriptor reports. The driver handles up to 32 sources
+//
+#define RMI4_MAX_INTERRUPT_REGISTERS      4
+
 typedef struct _RMI4_F01_CTRL_REGISTERS
 {
     union
@@ -146,12 +160,21 @@ typedef struct _RMI4_F01_CTRL_REGISTERS
             BYTE Configured  :1;
         };
     } DeviceControl;
-    BYTE InterruptEnable;
+
+    //
+    // Only the first RMI4_INTERRUPT_MAP.Registers bytes exist on the
+    // chip, the doze registers directly follow them
+    //
+    BYTE InterruptEnable[RMI4_MAX_INTERRUPT_REGISTERS];
     BYTE DozeInterval;
     BYTE DozeThreshold;
     BYTE DozeHoldoff;
 } RMI4_F01_CTRL_REGISTERS;
 
+#define RMI4_F01_DOZE_REGISTERS_SIZE \
+    (sizeof(RMI4_F01_CTRL_REGISTERS) - \
+        FIELD_OFFSET(RMI4_F01_CTRL_REGISTERS, DozeInterval))
+
 #define RMI4_F01_DEVICE_CONTROL_SLEEP_MODE_OPERATING  0
 #define RMI4_F01_DEVICE_CONTROL_SLEEP_MODE_SLEEPING   1
 
@@ -185,11 +208,31 @@ typedef struct _RMI4_F01_DATA_REGISTERS
             BYTE Unconfigured : 1;
         };
     } DeviceStatus;
-    BYTE InterruptStatus[1];
+    BYTE InterruptStatus[RMI4_MAX_INTERRUPT_REGISTERS];
 } RMI4_F01_DATA_REGISTERS;
 
-#define RMI4_INTERRUPT_BIT_2D_TOUCH               0x04
-#define RMI4_INTERRUPT_BIT_0D_CAP_BUTTON          0x20
+//
+// Bytes of the F01 data registers present on a chip with the given
+// number of interrupt registers
+//
+#define RMI4_F01_DATA_SIZE(Registers) \
+    (FIELD_OFFSET(RMI4_F01_DATA_REGISTERS, InterruptStatus) + (Registers))
+
+typedef struct _RMI4_INTERRUPT_MAP
+{
+    ULONG SourceCount;
+    ULONG Registers;
+    ULONG FunctionMask[RMI4_MAX_FUNCTIONS];
+
+    //
+    // Sources of the functions the driver services. The F01 device
+    // status source is handled with every status read
+    //
+    ULONG DeviceStatus;
+    ULONG Touch;
+    ULONG Buttons;
+    ULONG Serviced;
+} RMI4_INTERRUPT_MAP;
 
 #define RMI4_F01_DATA_STATUS_NO_ERROR             0
 #define RMI4_F01_DATA_STATUS_RESET_OCCURRED       1
@@ -340,13 +383,40 @@ typedef enum _RMI4_F12_OBJECT_TYPE {
 #define F12_DATA1_BYTES_PER_OBJ			8
 #define RMI_REG_DESC_PRESENSE_BITS	(32 * BITS_PER_BYTE)
 #define RMI_REG_DESC_SUBPACKET_BITS	(37 * BITS_PER_BYTE)
+#define RMI_REG_DESC_PRESENCE_MAX_SIZE	35
+#define RMI_REG_DESC_QUERY_REGISTERS	3
+#define RMI_REG_DESC_BULK_READ_SIZE	DEFAULT_SPB_BUFFER_SIZE
+#define RMI_F12_REGISTER_DESCRIPTORS	3
+
+//
+// F12_2D_Ctrl20 holds the X and Y motion suppression (subpacket 0),
+// followed by the report flags byte
+//
+#define RMI_F12_CTRL20_SUPPRESSION_SIZE     2
 
 #define RMI_F12_REPORTING_MODE_CONTINUOUS   0
 #define RMI_F12_REPORTING_MODE_REDUCED      1
-#define RMI_F12_REPORTING_MODE_MASK         7
+#define RMI_F12_REPORTING_MODE_MASK         3
+#define RMI_F12_ENABLE_DRIBBLE              BIT(2)
 
 #define F12_2D_CTRL20   20
 
+//
+// F12 control registers the driver programs are shadowed in memory, so
+// that changing them is a write without reading the chip back first
+//
+#define RMI4_F12_SHADOWED_CONTROLS      1
+#define RMI4_F12_CONTROL_SHADOW_SIZE    16
+
+typedef struct _RMI4_F12_CONTROL_SHADOW
+{
+	USHORT Register;
+	BOOLEAN Valid;
+	UCHAR Offset;
+	UCHAR Size;
+	BYTE Data[RMI4_F12_CONTROL_SHADOW_SIZE];
+} RMI4_F12_CONTROL_SHADOW, *PRMI4_F12_CONTROL_SHADOW;
+
 /* describes a single packet register */
 typedef struct _RMI_REGISTER_DESC_ITEM {
 	USHORT Register;
@@ -475,6 +545,17 @@ typedef struct _RMI4_CONFIGURATION
     RMI4_F01_CTRL_REGISTERS_LOGICAL DeviceSettings;
     RMI4_F11_CTRL_REGISTERS_LOGICAL TouchSettings;
     UINT32 PepRemovesVoltageInD3;
+    UINT32 PollingThreshold;
+    UINT32 PollingIdleFrames;
+    UINT32 ReportingGovernorFrames;
+    UINT32 ReportingGovernorMotion;
+    UINT32 AdaptiveDoze;
+    UINT32 PredictionHorizon;
+    UINT32 PredictionMinCutoff;
+    UINT32 PredictionBeta;
+    UINT32 ReportDeadband;
+    UINT32 ReportHeartbeat;
+    UINT32 MaxReportRate;
 } RMI4_CONFIGURATION;
 
 typedef struct _RMI4_FINGER_INFO
@@ -489,8 +570,15 @@ typedef struct _RMI4_FINGER_CACHE
     RMI4_FINGER_INFO FingerSlot[RMI4_MAX_TOUCHES];
     UINT32 FingerSlotValid;
     UINT32 FingerSlotDirty;
+    UINT32 FingerSlotNew;
     int FingerDownOrder[RMI4_MAX_TOUCHES];
     int FingerDownCount;
+
+    //
+    // Order the contacts of the frame are reported in, contacts going
+    // down or lifting come first
+    //
+    int FingerReportOrder[RMI4_MAX_TOUCHES];
     ULONG64 ScanTime;
 } RMI4_FINGER_CACHE;
 
@@ -504,11 +592,380 @@ typedef struct _RMI4_PEN_CACHE
     ULONG64 ScanTime;
 } RMI4_PEN_CACHE;
 
+//
+// Discovery state (packet register lists and scratch space) is carved out
+// of a single per-device arena, reset whenever discovery runs again.
+//
+#define RMI4_DISCOVERY_ARENA_SIZE         (64 * sizeof(RMI_REGISTER_DESC_ITEM))
+
+typedef struct _RMI4_ARENA
+{
+    PUCHAR Base;
+    SIZE_T Size;
+    SIZE_T Used;
+    SIZE_T Requested;
+} RMI4_ARENA;
+
+//
+// Register accesses an interrupt service cycle may need. The plan lists
+// them grouped by register page as far as their required order allows,
+// and a cycle walks it starting from the currently selected page so
+// consecutive cycles share page selections. The F01 status read always
+// precedes the F12 data read.
+//
+// The status read clears the interrupt status, the touch data read is
+// only sent once it is known, so no frame is acknowledged unread.
+//
+typedef enum _RMI4_SERVICE_ACCESS
+{
+    RmiServiceAccessStatus,
+    RmiServiceAccessTouchData,
+    RmiServiceAccessMax
+} RMI4_SERVICE_ACCESS;
+
+typedef struct _RMI4_SERVICE_PLAN
+{
+    int Count;
+    RMI4_SERVICE_ACCESS Access[RmiServiceAccessMax];
+    int Page[RmiServiceAccessMax];
+} RMI4_SERVICE_PLAN;
+
+//
+// Layout discovered from the controller, persisted across starts along
+// with the service plan ordered for it. It is only valid for the
+// firmware identified by the F01 query registers and is followed by the
+// packet register items of every F12 descriptor.
+//
+#define RMI4_DISCOVERY_CACHE_SIGNATURE    (ULONG)'cDmR'
+#define RMI4_DISCOVERY_CACHE_VERSION      3
+
+typedef struct _RMI4_DISCOVERY_CACHE_DESCRIPTOR
+{
+    ULONG StructSize;
+    ULONG PresenceMap[BITS_TO_LONGS(RMI_REG_DESC_PRESENSE_BITS)];
+    UINT8 NumRegisters;
+} RMI4_DISCOVERY_CACHE_DESCRIPTOR;
+
+typedef struct _RMI4_DISCOVERY_CACHE
+{
+    ULONG Signature;
+    ULONG Version;
+    ULONG Size;
+
+    RMI4_F01_QUERY_REGISTERS F01QueryRegisters;
+
+    int FunctionCount;
+    RMI4_FUNCTION_DESCRIPTOR Descriptors[RMI4_MAX_FUNCTIONS];
+    int FunctionOnPage[RMI4_MAX_FUNCTIONS];
+
+    BOOLEAN HasDribble;
+    ULONG PacketSize;
+    USHORT Data1Offset;
+    BYTE MaxFingers;
+    RMI4_DISCOVERY_CACHE_DESCRIPTOR RegDesc[RMI_F12_REGISTER_DESCRIPTORS];
+
+    RMI4_SERVICE_PLAN ServicePlan;
+} RMI4_DISCOVERY_CACHE;
+
+//
+// Register writes, including the page selects they need, queued to be
+// sent to the controller as one SPB sequence
+//
+typedef struct _RMI4_WRITE_BATCH
+{
+    SPB_SEQUENCE Sequence;
+    int Page;
+    ULONG PageSelects;
+} RMI4_WRITE_BATCH;
+
+//
+// F12 data frames. The front buffer holds the last frame read while the
+// next one is transferred into the back buffer
+//
+#define RMI4_F12_FRAME_BUFFERS 2
+
+typedef struct _RMI4_F12_FRAMES
+{
+    PUCHAR Buffer[RMI4_F12_FRAME_BUFFERS];
+    ULONG Size;
+    ULONG Front;
+    BOOLEAN InFlight;
+    SPB_ASYNC_READ Read;
+
+    //
+    // F01 status fetched in front of the frame by the same read
+    //
+    RMI4_F01_DATA_REGISTERS Status;
+    BOOLEAN StatusInFlight;
+    BOOLEAN StatusValid;
+
+    //
+    // Frames read asynchronously and synchronously, and along with the
+    // status
+    //
+    ULONG AsyncReads;
+    ULONG SyncReads;
+    ULONG StatusReads;
+} RMI4_F12_FRAMES;
+
+//
+// Frames captured by the interrupt service routine, waiting for the
+// processing stage to turn them into HID reports. The capture stage is
+// the only producer and the processing stage the only consumer, so
+// neither takes a lock to access the ring.
+//
+#define RMI4_FRAME_RING_SIZE 8
+
+typedef struct _RMI4_FRAME_RING_ENTRY
+{
+    ULONG64 Timestamp;
+    ULONG InterruptStatus;
+    BYTE Buttons;
+    PUCHAR Data;
+} RMI4_FRAME_RING_ENTRY;
+
+typedef struct _RMI4_FRAME_RING
+{
+    RMI4_FRAME_RING_ENTRY Entries[RMI4_FRAME_RING_SIZE];
+    volatile ULONG Head;
+    volatile ULONG Tail;
+    ULONG Overruns;
+} RMI4_FRAME_RING;
+
+//
+// Under sustained touch data the 2D attention interrupt is masked and
+// frames are polled once per measured scan period. Interrupts are
+// restored once the sensor reports no objects for a while. Periods are
+// in 100ns units
+//
+#define RMI4_POLL_MIN_PERIOD (4 * 10000)
+#define RMI4_POLL_MAX_PERIOD (20 * 10000)
+
+//
+// Software PLL tracking the scan period and phase of the controller from
+// interrupt timestamps. It locks once enough frames arrive within an
+// eighth of a period of their prediction. Polls are scheduled a guard
+// time after the predicted frame, ahead by the measured dispatch latency
+//
+#define RMI4_PLL_LOCK_FRAMES 8
+#define RMI4_PLL_MAX_STALE_POLLS 3
+#define RMI4_PLL_GUARD (2 * 1000)
+
+typedef struct _RMI4_SCAN_PLL
+{
+    ULONG64 Period;
+    ULONG64 NextFrame;
+    ULONG64 LastFrame;
+    ULONG64 ArmedTime;
+    ULONG64 DispatchLatency;
+    ULONG InLock;
+    BOOLEAN Locked;
+    ULONG StalePolls;
+
+    //
+    // Lock losses and polls that found no new frame
+    //
+    ULONG Unlocks;
+    ULONG TotalStalePolls;
+} RMI4_SCAN_PLL;
+
+typedef struct _RMI4_POLLING_STATE
+{
+    BOOLEAN Active;
+    ULONG ConsecutiveFrames;
+    ULONG IdleFrames;
+    RMI4_SCAN_PLL Pll;
+
+    //
+    // Frames and time spent capturing them in each mode
+    //
+    ULONG Switches;
+    ULONG InterruptFrames;
+    ULONG PolledFrames;
+    ULONG64 InterruptCaptureTime;
+    ULONG64 PolledCaptureTime;
+} RMI4_POLLING_STATE;
+
+//
+// Sample times of the reported frames, taken at interrupt entry or when
+// the frame was polled. Intervals above RMI4_SCAN_MAX_INTERVAL start a
+// new touch session and are not counted. Times are in 100ns units
+//
+#define RMI4_SCAN_MAX_INTERVAL (2 * RMI4_POLL_MAX_PERIOD)
+
+//
+// HID scan times are 16-bit counters in 100us units. They are derived
+// from the full interrupt time of the frame each time, so the interval
+// between two reports computed modulo 2^16 is exact across wraparound
+//
+#define RMI4_HID_SCAN_TIME(Time) ((USHORT) (((Time) / 1000) & 0xFFFF))
+
+typedef struct _RMI4_SCAN_TIMING
+{
+    ULONG64 LastFrame;
+    ULONG64 MinInterval;
+    ULONG64 MaxInterval;
+    ULONG64 AverageInterval;
+    ULONG Intervals;
+
+    //
+    // Longest time a frame waited between its sample and processing
+    //
+    ULONG64 MaxLatency;
+} RMI4_SCAN_TIMING;
+
+//
+// Reporting mode governor. Resting contacts are reported in reduced mode
+// after ReportingGovernorFrames still frames, motion above twice the
+// ReportingGovernorMotion threshold (in sensor units) or a change in the
+// contacts restores continuous reporting
+//
+typedef struct _RMI4_REPORTING_GOVERNOR
+{
+    //
+    // Motion tracking of the processing stage, guarded by ProcessingLock
+    //
+    RMI4_F11_DATA_POSITION Last[RMI4_MAX_TOUCHES];
+    UINT32 LastValid;
+    ULONG StillFrames;
+
+    //
+    // Mode asked for by the processing stage, programmed by the capture
+    // stage under ControllerLock
+    //
+    volatile UCHAR DesiredMode;
+    UCHAR Mode;
+    ULONG Switches;
+} RMI4_REPORTING_GOVERNOR;
+
+//
+// Doze policy. The configured doze settings are the idle profile, touch
+// sessions switch to an interactive profile until the sensor went
+// untouched for four times the learned gap between sessions, within the
+// bounds below. Times are in 100ns units
+//
+#define RMI4_DOZE_INTERVAL_UNIT      (10 * 10000ULL)
+#define RMI4_DOZE_HOLDOFF_UNIT       (500 * 10000ULL)
+#define RMI4_DOZE_MAX_HOLDOFF        RMI4_SECONDS_TO_HALF_SECONDS(10)
+#define RMI4_DOZE_MIN_IDLE_TIMEOUT   (30 * 1000 * 10000ULL)
+#define RMI4_DOZE_MAX_IDLE_TIMEOUT   (10 * 60 * 1000 * 10000ULL)
+
+typedef struct _RMI4_DOZE_POLICY
+{
+    BOOLEAN Interactive;
+    BOOLEAN SessionActive;
+    ULONG64 SessionStart;
+    ULONG64 LastActivity;
+    ULONG64 AverageGap;
+
+    //
+    // Set by the capture stage for every touch frame
+    //
+    BOOLEAN FramePending;
+    BOOLEAN FrameObjects;
+
+    //
+    // Evaluation of the policy: sessions, those that started on a dozing
+    // controller and their summed worst case first-touch latency, and
+    // the estimated time scanned at full rate
+    //
+    ULONG Sessions;
+    ULONG DozedStarts;
+    ULONG64 FirstTouchLatency;
+    ULONG64 ActiveTime;
+    ULONG Switches;
+} RMI4_DOZE_POLICY;
+
+//
+// Contact prediction. Positions are filtered in Q8 sensor units and
+// extrapolated by PredictionHorizon milliseconds, zero disables the
+// stage. The position cutoff is PredictionMinCutoff plus PredictionBeta
+// per sensor unit per second of speed, in mHz. Filter intervals are in
+// 100us units, a contact unseen for longer than RMI4_PREDICT_MAX_INTERVAL
+// restarts its filter
+//
+#define RMI4_PREDICT_TAU_SCALE          1591549ULL
+#define RMI4_PREDICT_VELOCITY_CUTOFF    1000ULL
+#define RMI4_PREDICT_MAX_INTERVAL       1000ULL
+
+typedef struct _RMI4_CONTACT_FILTER
+{
+    BOOLEAN Valid;
+    LONG64 X;
+    LONG64 Y;
+    LONG64 VelocityX;
+    LONG64 VelocityY;
+    ULONG64 LastTime;
+
+    //
+    // Outstanding prediction, scored by the first sample at or after
+    // PendingTime, and the unpredicted position it is compared with
+    //
+    BOOLEAN PendingValid;
+    LONG PendingX;
+    LONG PendingY;
+    LONG BaseX;
+    LONG BaseY;
+    ULONG64 PendingTime;
+} RMI4_CONTACT_FILTER;
+
+typedef struct _RMI4_PREDICTION_STATE
+{
+    RMI4_CONTACT_FILTER Contact[RMI4_MAX_TOUCHES];
+
+    //
+    // Evaluation of the horizon: summed distance in sensor units between
+    // the predicted positions and the samples reached at their target
+    // time, and the same for the filtered positions left unpredicted
+    //
+    ULONG64 ErrorSum;
+    ULONG64 LagSum;
+    ULONG Samples;
+} RMI4_PREDICTION_STATE;
+
+//
+// Unchanged frame suppression. A touch frame is reported only if a
+// contact arrived, lifted or moved by more than ReportDeadband sensor
+// units since the last report, or ReportHeartbeat milliseconds went by
+// without one. A zero heartbeat, the default, reports every frame
+//
+typedef struct _RMI4_REPORT_SUPPRESSION
+{
+    RMI4_FINGER_INFO Reported[RMI4_MAX_TOUCHES];
+    UINT32 ReportedValid;
+    ULONG64 LastReport;
+    ULONG Frames;
+    ULONG Suppressed;
+} RMI4_REPORT_SUPPRESSION;
+
+//
+// Report rate limiter. Touch frames closer than 1 / MaxReportRate to the
+// last report are coalesced in the finger cache, frames where contacts
+// arrive or lift always go out. The cache is reported once the slot of
+// a held frame opens unless a newer frame is reported first. Times are
+// in 100ns units, a zero rate reports every frame
+//
+#define RMI4_RATE_PERIOD(Rate) (10000000ULL / (Rate))
+
+typedef struct _RMI4_RATE_LIMITER
+{
+    BOOLEAN Held;
+    UINT32 ReportedValid;
+    ULONG64 LastReport;
+    ULONG Coalesced;
+    ULONG Released;
+} RMI4_RATE_LIMITER;
+
 typedef struct _RMI4_CONTROLLER_CONTEXT
 {
     WDFDEVICE FxDevice;    
     WDFWAITLOCK ControllerLock;
 
+    //
+    // Serializes the processing stage and guards the touch state below
+    //
+    WDFWAITLOCK ProcessingLock;
+
     //
     // Controller state
     //
@@ -516,8 +973,16 @@ typedef struct _RMI4_CONTROLLER_CONTEXT
     RMI4_FUNCTION_DESCRIPTOR Descriptors[RMI4_MAX_FUNCTIONS];
     int FunctionOnPage[RMI4_MAX_FUNCTIONS];
     int CurrentPage;
+    RMI4_SERVICE_PLAN ServicePlan;
+    ULONG PageSelectWrites;
 
+    //
+    // Interrupts and button state of the frame being processed, guarded
+    // by ProcessingLock
+    //
     ULONG InterruptStatus;
+    BYTE Buttons;
+    BYTE ButtonsReported;
     BOOLEAN HasButtons;
     BOOLEAN ResetOccurred;
     BOOLEAN InvalidConfiguration;
@@ -526,6 +991,21 @@ typedef struct _RMI4_CONTROLLER_CONTEXT
     BYTE UnknownStatusMessage;
     RMI4_F01_QUERY_REGISTERS F01QueryRegisters;
 
+    //
+    // Last values written to the F01 control registers
+    //
+    RMI4_INTERRUPT_MAP Interrupts;
+    RMI4_F01_CTRL_REGISTERS F01ControlShadow;
+    BOOLEAN F01ControlShadowValid;
+
+    //
+    // Configuration recovery after the controller lost its settings,
+    // times are in 100ns units
+    //
+    ULONG RecoveryCount;
+    ULONG64 LastRecoveryTime;
+    ULONG64 MaxRecoveryTime;
+
     //
     // Power state
     //
@@ -537,6 +1017,26 @@ typedef struct _RMI4_CONTROLLER_CONTEXT
     TOUCH_SCREEN_PROPERTIES Props;
     RMI4_CONFIGURATION Config;
 
+    //
+    // Captured frames, and the one currently being reported
+    //
+    RMI4_FRAME_RING Ring;
+    RMI4_F11_DATA_REGISTERS FrameData;
+    ULONG64 FrameTime;
+    RMI4_SCAN_TIMING Timing;
+    RMI4_POLLING_STATE Polling;
+
+    //
+    // Interrupt sources masked during an interrupt storm
+    //
+    ULONG StormMask;
+
+    RMI4_REPORTING_GOVERNOR Governor;
+    RMI4_DOZE_POLICY Doze;
+    RMI4_PREDICTION_STATE Prediction;
+    RMI4_REPORT_SUPPRESSION Suppression;
+    RMI4_RATE_LIMITER RateLimiter;
+
     //
     // Current touch state
     //
@@ -548,15 +1048,25 @@ typedef struct _RMI4_CONTROLLER_CONTEXT
     int PensTotal;
     RMI4_PEN_CACHE PenCache;
 
+    //
+    // Reports still due for the frame being reported, a frame yields its
+    // finger reports first and then its pen reports
+    //
+    BOOLEAN TouchReportDue;
+    BOOLEAN PenReportDue;
+
 	//
 	// RMI4 F12 state
 	//
 
 	BOOLEAN HasDribble;
+	RMI4_ARENA Arena;
 	RMI_REGISTER_DESCRIPTOR QueryRegDesc;
 	RMI_REGISTER_DESCRIPTOR ControlRegDesc;
 	RMI_REGISTER_DESCRIPTOR DataRegDesc;
 	size_t PacketSize;
+	RMI4_F12_CONTROL_SHADOW F12ControlShadow[RMI4_F12_SHADOWED_CONTROLS];
+	RMI4_F12_FRAMES Frames;
 
 	USHORT Data1Offset;
 	BYTE MaxFingers;
@@ -571,6 +1081,180 @@ RmiCheckInterrupts(
     IN ULONG* InterruptStatus
     );
 
+VOID
+RmiBuildInterruptMap(
+    IN RMI4_CONTROLLER_CONTEXT* ControllerContext
+    );
+
+ULONG
+RmiUnpackInterruptMask(
+    IN BYTE* Registers,
+    IN ULONG Count
+    );
+
+VOID
+RmiPackInterruptMask(
+    IN ULONG Mask,
+    OUT BYTE* Registers,
+    IN ULONG Count
+    );
+
+NTSTATUS
+RmiReadF01Control(
+    IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+    IN SPB_CONTEXT *SpbContext,
+    OUT RMI4_F01_CTRL_REGISTERS* Control
+    );
+
+NTSTATUS
+RmiBatchAddF01Control(
+    IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+    IN RMI4_WRITE_BATCH* Batch,
+    IN RMI4_F01_CTRL_REGISTERS* Control
+    );
+
+NTSTATUS
+RmiHandleInterruptStatus(
+    IN RMI4_CONTROLLER_CONTEXT *ControllerContext,
+    IN SPB_CONTEXT *SpbContext,
+    IN RMI4_F01_DATA_REGISTERS *Data,
+    OUT ULONG* InterruptStatus
+    );
+
+NTSTATUS
+RmiAllocateFrames(
+    IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+    IN SPB_CONTEXT *SpbContext
+    );
+
+VOID
+RmiFreeFrames(
+    IN RMI4_CONTROLLER_CONTEXT* ControllerContext
+    );
+
+NTSTATUS
+RmiStartFrameRead(
+    IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+    IN SPB_CONTEXT *SpbContext,
+    IN BOOLEAN WithStatus
+    );
+
+NTSTATUS
+RmiFinishFrameRead(
+    IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+    IN SPB_CONTEXT *SpbContext
+    );
+
+NTSTATUS
+RmiReadFrameAndStatus(
+    IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+    IN SPB_CONTEXT *SpbContext,
+    OUT ULONG* InterruptStatus
+    );
+
+RMI4_FRAME_RING_ENTRY*
+RmiRingReserve(
+    IN RMI4_FRAME_RING* Ring
+    );
+
+VOID
+RmiRingCommit(
+    IN RMI4_FRAME_RING* Ring
+    );
+
+RMI4_FRAME_RING_ENTRY*
+RmiRingFront(
+    IN RMI4_FRAME_RING* Ring
+    );
+
+VOID
+RmiRingPop(
+    IN RMI4_FRAME_RING* Ring
+    );
+
+NTSTATUS
+RmiQueueFrame(
+    IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+    IN ULONG64 Timestamp,
+    IN ULONG InterruptStatus,
+    IN BYTE Buttons
+    );
+
+NTSTATUS
+RmiReadButtons(
+    IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+    IN SPB_CONTEXT *SpbContext,
+    OUT BYTE* Buttons
+    );
+
+BOOLEAN
+RmiFrameHasObjects(
+    IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+    IN PUCHAR Frame
+    );
+
+VOID
+RmiPllUpdate(
+    IN RMI4_SCAN_PLL* Pll,
+    IN ULONG64 Timestamp
+    );
+
+ULONG
+RmiPllSchedulePoll(
+    IN RMI4_SCAN_PLL* Pll,
+    IN ULONG64 Now
+    );
+
+VOID
+RmiTrackCapturedFrame(
+    IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+    IN ULONG64 Timestamp,
+    IN BOOLEAN Captured
+    );
+
+NTSTATUS
+RmiSetInterruptEnable(
+    IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+    IN SPB_CONTEXT *SpbContext,
+    IN ULONG InterruptEnable
+    );
+
+VOID
+RmiResetDozePolicy(
+    IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+    IN SPB_CONTEXT *SpbContext
+    );
+
+NTSTATUS
+RmiUnmaskInterrupts(
+    IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+    IN SPB_CONTEXT *SpbContext
+    );
+
+VOID
+RmiStopPolling(
+    IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+    IN SPB_CONTEXT *SpbContext
+    );
+
+VOID
+RmiGovernReportingMode(
+    IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+    IN RMI4_F11_DATA_REGISTERS* Data
+    );
+
+VOID
+RmiPredictContacts(
+    IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+    IN RMI4_FINGER_CACHE* Cache
+    );
+
+VOID
+RmiApplyReportingMode(
+    IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+    IN SPB_CONTEXT *SpbContext
+    );
+
 NTSTATUS
 RmiSetReportingMode(
     IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
@@ -579,6 +1263,87 @@ RmiSetReportingMode(
     OUT OPTIONAL UCHAR *OldMode
     );
 
+VOID
+RmiBatchInitialize(
+    IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+    OUT RMI4_WRITE_BATCH* Batch
+    );
+
+NTSTATUS
+RmiBatchAddWrite(
+    IN RMI4_WRITE_BATCH* Batch,
+    IN int Page,
+    IN UCHAR Address,
+    IN PVOID Data,
+    IN ULONG Length
+    );
+
+NTSTATUS
+RmiBatchExecute(
+    IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+    IN SPB_CONTEXT* SpbContext,
+    IN RMI4_WRITE_BATCH* Batch
+    );
+
+VOID
+RmiBuildServicePlan(
+    IN RMI4_CONTROLLER_CONTEXT* ControllerContext
+    );
+
+BOOLEAN
+RmiServicePlanMatchesLayout(
+    IN RMI4_SERVICE_PLAN* Plan,
+    IN RMI4_FUNCTION_DESCRIPTOR* Descriptors,
+    IN int* FunctionOnPage,
+    IN int FunctionCount
+    );
+
+int
+RmiGetServiceOrder(
+    IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+    IN ULONG AccessMask,
+    OUT RMI4_SERVICE_ACCESS* Order
+    );
+
+NTSTATUS
+RmiReadF12ControlShadows(
+    IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+    IN SPB_CONTEXT *SpbContext
+    );
+
+PRMI4_F12_CONTROL_SHADOW
+RmiGetF12ControlShadow(
+    IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+    IN USHORT Register
+    );
+
+NTSTATUS
+RmiBatchAddF12ControlShadow(
+    IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+    IN RMI4_WRITE_BATCH* Batch,
+    IN PRMI4_F12_CONTROL_SHADOW Shadow
+    );
+
+NTSTATUS
+RmiWriteF12ControlShadow(
+    IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+    IN SPB_CONTEXT *SpbContext,
+    IN PRMI4_F12_CONTROL_SHADOW Shadow
+    );
+
+VOID
+RmiApplyF12Tuning(
+    IN RMI4_CONTROLLER_CONTEXT* ControllerContext
+    );
+
+NTSTATUS
+RmiQueueReportingMode(
+    IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+    IN RMI4_WRITE_BATCH* Batch,
+    IN UCHAR NewMode,
+    OUT OPTIONAL UCHAR *OldMode
+    );
+
 int
 RmiGetFunctionIndex(
     IN RMI4_FUNCTION_DESCRIPTOR* FunctionDescriptors,
@@ -594,10 +1359,70 @@ RmiChangePage(
     );
 
 NTSTATUS
-RmiReadRegisterDescriptor(
+RmiDiscoverF12Registers(
+    IN RMI4_CONTROLLER_CONTEXT *ControllerContext,
+    IN SPB_CONTEXT *SpbContext
+    );
+
+VOID
+RmiGetF12RegisterDescriptors(
+    IN RMI4_CONTROLLER_CONTEXT *ControllerContext,
+    OUT PRMI_REGISTER_DESCRIPTOR *Rdescs
+    );
+
+NTSTATUS
+RmiCheckDiscoveryCache(
+    IN RMI4_DISCOVERY_CACHE *Cache,
+    IN ULONG Length
+    );
+
+NTSTATUS
+RmiCheckDiscoveryCacheIdentity(
+    IN RMI4_DISCOVERY_CACHE *Cache,
+    IN RMI4_FUNCTION_DESCRIPTOR *FirstDescriptor,
+    IN RMI4_F01_QUERY_REGISTERS *Query
+    );
+
+NTSTATUS
+RmiLoadDiscoveryCache(
+    IN RMI4_CONTROLLER_CONTEXT *ControllerContext,
+    IN SPB_CONTEXT *SpbContext
+    );
+
+NTSTATUS
+RmiSaveDiscoveryCache(
+    IN RMI4_CONTROLLER_CONTEXT *ControllerContext
+    );
+
+VOID
+RmiArenaReset(
+    IN RMI4_ARENA *Arena
+    );
+
+NTSTATUS
+RmiArenaReserve(
+    IN RMI4_ARENA *Arena,
+    IN SIZE_T Size
+    );
+
+PVOID
+RmiArenaAllocate(
+    IN RMI4_ARENA *Arena,
+    IN SIZE_T Size
+    );
+
+VOID
+RmiArenaFree(
+    IN RMI4_ARENA *Arena
+    );
+
+NTSTATUS
+RmiReadRegisterDescriptors(
 	IN SPB_CONTEXT *Context,
+	IN RMI4_ARENA *Arena,
 	IN UCHAR Address,
-	IN PRMI_REGISTER_DESCRIPTOR Rdesc
+	IN PRMI_REGISTER_DESCRIPTOR *Rdescs,
+	IN int Count
 	);
 
 size_t
@@ -610,6 +1435,14 @@ const PRMI_REGISTER_DESC_ITEM RmiGetRegisterDescItem(
 	USHORT reg
 );
 
+NTSTATUS
+RmiGetF12DataLayout(
+	IN PRMI_REGISTER_DESCRIPTOR DataRegDesc,
+	OUT size_t* PacketSize,
+	OUT USHORT* Data1Offset,
+	OUT BYTE* MaxFingers
+);
+
 UINT8 RmiGetRegisterIndex(
 	PRMI_REGISTER_DESCRIPTOR Rdesc,
 	USHORT reg
@@ -0,0 +1,167 @@
+/*++
+    Copyright (c) Microsoft Corporation. All Rights Reserved. 
+    Sample code. Dealpoint ID #843729.
+
+    Module Name: 
+
+        spbtarget.h
+
+    Abstract:
+
+        This module contains the touch driver I2C helper definitions.
+
+    Environment:
+ 
+        Kernel Mode
+
+    Revision History:
+
+--*/
+
+#pragma once
+
+#include <wdm.h>
+#include <wdf.h>
+
+#define DEFAULT_SPB_BUFFER_SIZE 64
+
+//
+// SPB (I2C) context
+//
+
+typedef struct _SPB_CONTEXT
+{
+    WDFIOTARGET SpbIoTarget;
+    LARGE_INTEGER I2cResHubId;
+    WDFMEMORY WriteMemory;
+    WDFMEMORY ReadMemory;
+    WDFWAITLOCK SpbLock;
+} SPB_CONTEXT;
+
+//
+// A sequence queues several register writes that are sent to the
+// controller as a single SPB request
+//
+
+#define SPB_SEQUENCE_MAX_TRANSFERS  8
+#define SPB_SEQUENCE_BUFFER_SIZE    128
+
+typedef struct _SPB_SEQUENCE_TRANSFER
+{
+    ULONG Offset;
+    ULONG Length;
+} SPB_SEQUENCE_TRANSFER;
+
+typedef struct _SPB_SEQUENCE
+{
+    ULONG TransferCount;
+    ULONG BufferUsed;
+    SPB_SEQUENCE_TRANSFER Transfers[SPB_SEQUENCE_MAX_TRANSFERS];
+    UCHAR Buffer[SPB_SEQUENCE_BUFFER_SIZE];
+} SPB_SEQUENCE;
+
+//
+// An asynchronous register read. The queued writes, ending with the
+// address pointer, and the data phase go out as one SPB sequence so
+// that no other transfer can slip in between them. An optional leading
+// read of another register block can be placed after the first
+// LeadWrites writes, so that two blocks are fetched by one request
+//
+
+typedef struct _SPB_ASYNC_READ
+{
+    WDFREQUEST Request;
+    WDFMEMORY TransferList;
+    KEVENT Completed;
+    BOOLEAN Pending;
+    BOOLEAN Unsupported;
+    NTSTATUS Status;
+    ULONG Length;
+    SPB_SEQUENCE Writes;
+    ULONG LeadWrites;
+    PVOID LeadData;
+    ULONG LeadLength;
+} SPB_ASYNC_READ;
+
+NTSTATUS
+SpbAsyncReadInitialize(
+    IN SPB_CONTEXT *SpbContext,
+    OUT SPB_ASYNC_READ *Read
+    );
+
+VOID
+SpbAsyncReadDeinitialize(
+    IN SPB_ASYNC_READ *Read
+    );
+
+VOID
+SpbAsyncReadReset(
+    IN SPB_ASYNC_READ *Read
+    );
+
+NTSTATUS
+SpbAsyncReadAddLead(
+    IN SPB_ASYNC_READ *Read,
+    OUT PVOID Data,
+    IN ULONG Length
+    );
+
+NTSTATUS
+SpbAsyncReadStart(
+    IN SPB_CONTEXT *SpbContext,
+    IN SPB_ASYNC_READ *Read,
+    OUT PVOID Data,
+    IN ULONG Length
+    );
+
+NTSTATUS
+SpbAsyncReadWait(
+    IN SPB_ASYNC_READ *Read
+    );
+
+NTSTATUS 
+SpbReadDataSynchronously(
+    _In_ SPB_CONTEXT *SpbContext,
+    _In_ UCHAR Address,
+    _In_reads_bytes_(Length) PVOID Data,
+    _In_ ULONG Length
+    );
+
+VOID
+SpbSequenceInitialize(
+    OUT SPB_SEQUENCE *Sequence
+    );
+
+NTSTATUS
+SpbSequenceAddWrite(
+    IN SPB_SEQUENCE *Sequence,
+    IN UCHAR Address,
+    IN PVOID Data,
+    IN ULONG Length
+    );
+
+NTSTATUS
+SpbSequenceExecute(
+    IN SPB_CONTEXT *SpbContext,
+    IN SPB_SEQUENCE *Sequence
+    );
+
+VOID
+SpbTargetDeinitialize(
+    IN WDFDEVICE FxDevice,
+    IN SPB_CONTEXT *SpbContext
+    );
+
+NTSTATUS
+SpbTargetInitialize(
+    IN WDFDEVICE FxDevice,
+    IN SPB_CONTEXT *SpbContext
+    );
+
+NTSTATUS
+SpbWriteDataSynchronously(
+    IN SPB_CONTEXT *SpbContext,
+    IN UCHAR Address,
+    IN PVOID Data,
+    IN ULONG Length
+    );
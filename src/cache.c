@@ -0,0 +1,600 @@
+/*++
+    Copyright (c) Microsoft Corporation. All Rights Reserved.
+    Sample code. Dealpoint ID #843729.
+
+    Module Name:
+
+        cache.c
+
+    Abstract:
+
+        Persists the RMI function table and F12 register layout
+        discovered from the controller, along with the service plan
+        ordered for them, so that subsequent starts on the same
+        firmware can skip discovery.
+
+    Environment:
+
+        Kernel mode
+
+    Revision History:
+
+--*/
+
+#include <compat.h>
+#include <rmiinternal.h>
+#include <spbtarget.h>
+#include <cache.tmh>
+
+VOID
+RmiGetF12RegisterDescriptors(
+    IN RMI4_CONTROLLER_CONTEXT *ControllerContext,
+    OUT PRMI_REGISTER_DESCRIPTOR *Rdescs
+    )
+/*++
+
+  Routine Description:
+
+    Returns the F12 register descriptors in the order they are stored
+    on the chip and in the discovery cache.
+
+  Arguments:
+
+    ControllerContext - A pointer to the current touch controller context
+    Rdescs - Receives RMI_F12_REGISTER_DESCRIPTORS descriptor pointers
+
+  Return Value:
+
+    None
+
+--*/
+{
+    Rdescs[0] = &ControllerContext->QueryRegDesc;
+    Rdescs[1] = &ControllerContext->ControlRegDesc;
+    Rdescs[2] = &ControllerContext->DataRegDesc;
+}
+
+NTSTATUS
+RmiSaveDiscoveryCache(
+    IN RMI4_CONTROLLER_CONTEXT *ControllerContext
+    )
+/*++
+
+  Routine Description:
+
+    Serializes the discovered function table, F12 register descriptors
+    and F01 product information into a versioned blob and stores it in
+    the registry.
+
+  Arguments:
+
+    ControllerContext - A pointer to the current touch controller context
+
+  Return Value:
+
+    NTSTATUS indicating success or failure
+
+--*/
+{
+    RMI4_DISCOVERY_CACHE* cache;
+    PRMI_REGISTER_DESCRIPTOR rdescs[RMI_F12_REGISTER_DESCRIPTORS];
+    PRMI_REGISTER_DESC_ITEM items;
+    ULONG itemsSize;
+    ULONG size;
+    NTSTATUS status;
+    int i;
+
+    RmiGetF12RegisterDescriptors(ControllerContext, rdescs);
+
+    size = sizeof(RMI4_DISCOVERY_CACHE);
+    for (i = 0; i < RMI_F12_REGISTER_DESCRIPTORS; i++)
+    {
+        size += rdescs[i]->NumRegisters * sizeof(RMI_REGISTER_DESC_ITEM);
+    }
+
+    cache = ExAllocatePoolWithTag(
+        NonPagedPoolNx,
+        size,
+        TOUCH_POOL_TAG);
+
+    if (cache == NULL)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto exit;
+    }
+
+    RtlZeroMemory(cache, size);
+
+    cache->Signature = RMI4_DISCOVERY_CACHE_SIGNATURE;
+    cache->Version = RMI4_DISCOVERY_CACHE_VERSION;
+    cache->Size = size;
+
+    cache->F01QueryRegisters = ControllerContext->F01QueryRegisters;
+    cache->FunctionCount = ControllerContext->FunctionCount;
+
+    RtlCopyMemory(
+        cache->Descriptors,
+        ControllerContext->Descriptors,
+        sizeof(cache->Descriptors));
+
+    RtlCopyMemory(
+        cache->FunctionOnPage,
+        ControllerContext->FunctionOnPage,
+        sizeof(cache->FunctionOnPage));
+
+    cache->HasDribble = ControllerContext->HasDribble;
+    cache->PacketSize = (ULONG) ControllerContext->PacketSize;
+    cache->Data1Offset = ControllerContext->Data1Offset;
+    cache->MaxFingers = ControllerContext->MaxFingers;
+    cache->ServicePlan = ControllerContext->ServicePlan;
+
+    items = (PRMI_REGISTER_DESC_ITEM) (cache + 1);
+
+    for (i = 0; i < RMI_F12_REGISTER_DESCRIPTORS; i++)
+    {
+        cache->RegDesc[i].StructSize = rdescs[i]->StructSize;
+        cache->RegDesc[i].NumRegisters = rdescs[i]->NumRegisters;
+
+        RtlCopyMemory(
+            cache->RegDesc[i].PresenceMap,
+            rdescs[i]->PresenceMap,
+            sizeof(cache->RegDesc[i].PresenceMap));
+
+        itemsSize = rdescs[i]->NumRegisters * sizeof(RMI_REGISTER_DESC_ITEM);
+        if (itemsSize != 0)
+        {
+            RtlCopyMemory(items, rdescs[i]->Registers, itemsSize);
+        }
+        items += rdescs[i]->NumRegisters;
+    }
+
+    status = TchRegistrySetDiscoveryCache(
+        ControllerContext->FxDevice,
+        cache,
+        size);
+
+    ExFreePoolWithTag(cache, TOUCH_POOL_TAG);
+
+    if (!NT_SUCCESS(status))
+    {
+        goto exit;
+    }
+
+    Trace(
+        TRACE_LEVEL_INFORMATION,
+        TRACE_INIT,
+        "Stored %d byte discovery cache",
+        size);
+
+exit:
+
+    return status;
+}
+
+NTSTATUS
+RmiCheckDiscoveryCache(
+    IN RMI4_DISCOVERY_CACHE *Cache,
+    IN ULONG Length
+    )
+/*++
+
+  Routine Description:
+
+    Checks that a discovery cache blob is well formed, without touching
+    the controller. The F12 data packet layout is derived again from the
+    stored data register descriptor with the limits discovery applies,
+    and must match the stored one, since the frames are walked with it.
+
+  Arguments:
+
+    Cache - The blob read from the registry
+    Length - Size of the blob in bytes
+
+  Return Value:
+
+    NTSTATUS indicating success or failure
+
+--*/
+{
+    RMI_REGISTER_DESCRIPTOR dataDesc;
+    PRMI_REGISTER_DESC_ITEM items;
+    size_t packetSize;
+    USHORT data1Offset;
+    BYTE maxFingers;
+    ULONG size;
+    NTSTATUS status;
+    int i;
+
+    status = STATUS_REVISION_MISMATCH;
+
+    if (Length < sizeof(RMI4_DISCOVERY_CACHE) ||
+        Cache->Signature != RMI4_DISCOVERY_CACHE_SIGNATURE ||
+        Cache->Version != RMI4_DISCOVERY_CACHE_VERSION ||
+        Cache->Size != Length ||
+        Cache->FunctionCount <= 0 ||
+        Cache->FunctionCount > RMI4_MAX_FUNCTIONS ||
+        Cache->FunctionOnPage[0] != 0)
+    {
+        goto exit;
+    }
+
+    //
+    // Functions are discovered page by page
+    //
+    for (i = 1; i < Cache->FunctionCount; i++)
+    {
+        if (Cache->FunctionOnPage[i] < Cache->FunctionOnPage[i - 1] ||
+            Cache->FunctionOnPage[i] > MAXUCHAR)
+        {
+            goto exit;
+        }
+    }
+
+    size = sizeof(RMI4_DISCOVERY_CACHE);
+    for (i = 0; i < RMI_F12_REGISTER_DESCRIPTORS; i++)
+    {
+        size += Cache->RegDesc[i].NumRegisters * sizeof(RMI_REGISTER_DESC_ITEM);
+    }
+
+    if (size != Length)
+    {
+        goto exit;
+    }
+
+    //
+    // The data register descriptor is stored last
+    //
+    items = (PRMI_REGISTER_DESC_ITEM) (Cache + 1);
+    for (i = 0; i < RMI_F12_REGISTER_DESCRIPTORS - 1; i++)
+    {
+        items += Cache->RegDesc[i].NumRegisters;
+    }
+
+    RtlZeroMemory(&dataDesc, sizeof(dataDesc));
+    dataDesc.NumRegisters = Cache->RegDesc[i].NumRegisters;
+    dataDesc.Registers = items;
+
+    if (!NT_SUCCESS(RmiGetF12DataLayout(
+            &dataDesc,
+            &packetSize,
+            &data1Offset,
+            &maxFingers)) ||
+        packetSize != Cache->PacketSize ||
+        data1Offset != Cache->Data1Offset ||
+        maxFingers != Cache->MaxFingers)
+    {
+        goto exit;
+    }
+
+    //
+    // The service plan must still fit the stored layout
+    //
+    if (!RmiServicePlanMatchesLayout(
+            &Cache->ServicePlan,
+            Cache->Descriptors,
+            Cache->FunctionOnPage,
+            Cache->FunctionCount))
+    {
+        goto exit;
+    }
+
+    status = STATUS_SUCCESS;
+
+exit:
+
+    return status;
+}
+
+NTSTATUS
+RmiCheckDiscoveryCacheIdentity(
+    IN RMI4_DISCOVERY_CACHE *Cache,
+    IN RMI4_FUNCTION_DESCRIPTOR *FirstDescriptor,
+    IN RMI4_F01_QUERY_REGISTERS *Query
+    )
+/*++
+
+  Routine Description:
+
+    Checks that a well formed discovery cache blob was stored for the
+    attached controller.
+
+  Arguments:
+
+    Cache - The blob read from the registry
+    FirstDescriptor - The first function descriptor of page 0 read from
+        the controller
+    Query - The F01 query registers read from the controller, only the
+        product and firmware identity is compared
+
+  Return Value:
+
+    NTSTATUS indicating success or failure
+
+--*/
+{
+    if (RtlCompareMemory(
+            FirstDescriptor,
+            &Cache->Descriptors[0],
+            sizeof(RMI4_FUNCTION_DESCRIPTOR)) != sizeof(RMI4_FUNCTION_DESCRIPTOR))
+    {
+        return STATUS_REVISION_MISMATCH;
+    }
+
+    if (RtlCompareMemory(
+            Query,
+            &Cache->F01QueryRegisters,
+            RMI4_F01_IDENTITY_SIZE) != RMI4_F01_IDENTITY_SIZE)
+    {
+        Trace(
+            TRACE_LEVEL_INFORMATION,
+            TRACE_INIT,
+            "Controller identity changed, discovery cache is stale");
+
+        return STATUS_REVISION_MISMATCH;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+RmiValidateDiscoveryCache(
+    IN RMI4_CONTROLLER_CONTEXT *ControllerContext,
+    IN SPB_CONTEXT *SpbContext,
+    IN RMI4_DISCOVERY_CACHE *Cache,
+    IN ULONG Length
+    )
+/*++
+
+  Routine Description:
+
+    Checks that a discovery cache blob is well formed and still
+    describes the attached controller. The chip is consulted with two
+    reads: the first function descriptor of page 0, and the F01 query
+    registers holding the product and firmware identity.
+
+  Arguments:
+
+    ControllerContext - A pointer to the current touch controller context
+    SpbContext - A pointer to the current i2c context
+    Cache - The blob read from the registry
+    Length - Size of the blob in bytes
+
+  Return Value:
+
+    NTSTATUS indicating success or failure
+
+--*/
+{
+    RMI4_FUNCTION_DESCRIPTOR descriptor;
+    RMI4_F01_QUERY_REGISTERS query;
+    NTSTATUS status;
+    int index;
+
+    status = RmiCheckDiscoveryCache(Cache, Length);
+
+    if (!NT_SUCCESS(status))
+    {
+        goto exit;
+    }
+
+    //
+    // The first descriptor must still sit at the fixed address
+    //
+    status = RmiChangePage(
+        ControllerContext,
+        SpbContext,
+        0);
+
+    if (!NT_SUCCESS(status))
+    {
+        goto exit;
+    }
+
+    status = SpbReadDataSynchronously(
+        SpbContext,
+        RMI4_FIRST_FUNCTION_ADDRESS,
+        &descriptor,
+        sizeof(RMI4_FUNCTION_DESCRIPTOR));
+
+    if (!NT_SUCCESS(status))
+    {
+        goto exit;
+    }
+
+    //
+    // And the firmware must be the one the layout was discovered on
+    //
+    index = RmiGetFunctionIndex(
+        Cache->Descriptors,
+        Cache->FunctionCount,
+        RMI4_F01_RMI_DEVICE_CONTROL);
+
+    if (index == Cache->FunctionCount)
+    {
+        status = STATUS_REVISION_MISMATCH;
+        goto exit;
+    }
+
+    status = RmiChangePage(
+        ControllerContext,
+        SpbContext,
+        Cache->FunctionOnPage[index]);
+
+    if (!NT_SUCCESS(status))
+    {
+        goto exit;
+    }
+
+    RtlZeroMemory(&query, sizeof(query));
+
+    status = SpbReadDataSynchronously(
+        SpbContext,
+        Cache->Descriptors[index].QueryBase,
+        &query,
+        RMI4_F01_IDENTITY_SIZE);
+
+    if (!NT_SUCCESS(status))
+    {
+        goto exit;
+    }
+
+    status = RmiCheckDiscoveryCacheIdentity(
+        Cache,
+        &descriptor,
+        &query);
+
+exit:
+
+    return status;
+}
+
+NTSTATUS
+RmiLoadDiscoveryCache(
+    IN RMI4_CONTROLLER_CONTEXT *ControllerContext,
+    IN SPB_CONTEXT *SpbContext
+    )
+/*++
+
+  Routine Description:
+
+    Populates the controller context from the discovery cache stored in
+    the registry, after validating it against the attached controller.
+    On failure the context is left for full discovery to populate.
+
+  Arguments:
+
+    ControllerContext - A pointer to the current touch controller context
+    SpbContext - A pointer to the current i2c context
+
+  Return Value:
+
+    NTSTATUS indicating success or failure
+
+--*/
+{
+    RMI4_DISCOVERY_CACHE* cache;
+    PRMI_REGISTER_DESCRIPTOR rdescs[RMI_F12_REGISTER_DESCRIPTORS];
+    PRMI_REGISTER_DESC_ITEM items;
+    WDFMEMORY memory;
+    SIZE_T length;
+    SIZE_T arenaSize;
+    ULONG itemsSize;
+    NTSTATUS status;
+    int i;
+
+    memory = NULL;
+
+    status = TchRegistryQueryDiscoveryCache(
+        ControllerContext->FxDevice,
+        &memory);
+
+    if (!NT_SUCCESS(status))
+    {
+        goto exit;
+    }
+
+    cache = WdfMemoryGetBuffer(memory, &length);
+
+    status = RmiValidateDiscoveryCache(
+        ControllerContext,
+        SpbContext,
+        cache,
+        (ULONG) length);
+
+    if (!NT_SUCCESS(status))
+    {
+        Trace(
+            TRACE_LEVEL_INFORMATION,
+            TRACE_INIT,
+            "Discovery cache rejected - %!STATUS!",
+            status);
+
+        goto exit;
+    }
+
+    RmiGetF12RegisterDescriptors(ControllerContext, rdescs);
+
+    //
+    // Size the arena from the stored layout before carving it up
+    //
+    arenaSize = 0;
+    for (i = 0; i < RMI_F12_REGISTER_DESCRIPTORS; i++)
+    {
+        arenaSize += ALIGN_UP_BY(
+            cache->RegDesc[i].NumRegisters * sizeof(RMI_REGISTER_DESC_ITEM),
+            MEMORY_ALLOCATION_ALIGNMENT);
+    }
+
+    RmiArenaReset(&ControllerContext->Arena);
+
+    status = RmiArenaReserve(
+        &ControllerContext->Arena,
+        arenaSize);
+
+    if (!NT_SUCCESS(status))
+    {
+        goto exit;
+    }
+
+    items = (PRMI_REGISTER_DESC_ITEM) (cache + 1);
+
+    for (i = 0; i < RMI_F12_REGISTER_DESCRIPTORS; i++)
+    {
+        itemsSize = cache->RegDesc[i].NumRegisters * sizeof(RMI_REGISTER_DESC_ITEM);
+
+        rdescs[i]->Registers = RmiArenaAllocate(
+            &ControllerContext->Arena,
+            itemsSize);
+
+        if (rdescs[i]->Registers == NULL)
+        {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto exit;
+        }
+
+        RtlCopyMemory(rdescs[i]->Registers, items, itemsSize);
+        items += cache->RegDesc[i].NumRegisters;
+
+        rdescs[i]->StructSize = cache->RegDesc[i].StructSize;
+        rdescs[i]->NumRegisters = cache->RegDesc[i].NumRegisters;
+
+        RtlCopyMemory(
+            rdescs[i]->PresenceMap,
+            cache->RegDesc[i].PresenceMap,
+            sizeof(rdescs[i]->PresenceMap));
+    }
+
+    ControllerContext->F01QueryRegisters = cache->F01QueryRegisters;
+    ControllerContext->FunctionCount = cache->FunctionCount;
+
+    RtlCopyMemory(
+        ControllerContext->Descriptors,
+        cache->Descriptors,
+        sizeof(ControllerContext->Descriptors));
+
+    RtlCopyMemory(
+        ControllerContext->FunctionOnPage,
+        cache->FunctionOnPage,
+        sizeof(ControllerContext->FunctionOnPage));
+
+    ControllerContext->HasDribble = cache->HasDribble;
+    ControllerContext->PacketSize = cache->PacketSize;
+    ControllerContext->Data1Offset = cache->Data1Offset;
+    ControllerContext->MaxFingers = cache->MaxFingers;
+    ControllerContext->ServicePlan = cache->ServicePlan;
+
+    Trace(
+        TRACE_LEVEL_INFORMATION,
+        TRACE_INIT,
+        "Restored %d RMI functions from discovery cache",
+        ControllerContext->FunctionCount);
+
+exit:
+
+    if (memory != NULL)
+    {
+        WdfObjectDelete(memory);
+    }
+
+    return status;
+}
@@ -0,0 +1,347 @@
+/*++
+    Copyright (c) Microsoft Corporation. All Rights Reserved.
+    Sample code. Dealpoint ID #843729.
+
+    Module Name:
+
+        cachetest.c
+
+    Abstract:
+
+        Self test of the discovery cache checks. The blob is read back
+        from the registry and drives how the F12 frames are walked, so
+        malformed blobs must be refused before anything is restored.
+        Run from DriverEntry on checked builds.
+
+    Environment:
+
+        Kernel mode
+
+    Revision History:
+
+--*/
+
+#include <compat.h>
+#include <rmiinternal.h>
+#include <cachetest.tmh>
+
+//
+// Query, control and the two data packet registers
+//
+#define RMI4_CACHE_TEST_ITEMS       4
+#define RMI4_CACHE_TEST_F01_QUERY   0x20
+#define RMI4_CACHE_TEST_F12_QUERY   0x30
+#define RMI4_CACHE_TEST_FINGERS     10
+
+typedef struct _RMI4_CACHE_TEST_BLOB
+{
+    RMI4_DISCOVERY_CACHE Cache;
+    RMI_REGISTER_DESC_ITEM Items[RMI4_CACHE_TEST_ITEMS];
+} RMI4_CACHE_TEST_BLOB;
+
+VOID
+RmiBuildTestDiscoveryCache(
+    OUT RMI4_CACHE_TEST_BLOB *Blob
+    )
+/*++
+
+  Routine Description:
+
+    Builds a well formed discovery cache blob for a controller with F01
+    and F12 on page 0 reporting up to ten fingers.
+
+  Arguments:
+
+    Blob - Receives the blob
+
+  Return Value:
+
+    None
+
+--*/
+{
+    RMI4_DISCOVERY_CACHE* cache;
+    int i;
+
+    RtlZeroMemory(Blob, sizeof(RMI4_CACHE_TEST_BLOB));
+    cache = &Blob->Cache;
+
+    cache->Signature = RMI4_DISCOVERY_CACHE_SIGNATURE;
+    cache->Version = RMI4_DISCOVERY_CACHE_VERSION;
+    cache->Size = sizeof(RMI4_CACHE_TEST_BLOB);
+
+    cache->F01QueryRegisters.ManufacturerID = 1;
+    cache->F01QueryRegisters.ProductID1 = 'S';
+    cache->F01QueryRegisters.ProductID2 = '3';
+
+    cache->FunctionCount = 2;
+    cache->Descriptors[0].Number = RMI4_F01_RMI_DEVICE_CONTROL;
+    cache->Descriptors[0].QueryBase = RMI4_CACHE_TEST_F01_QUERY;
+    cache->Descriptors[1].Number = RMI4_F12_2D_TOUCHPAD_SENSOR;
+    cache->Descriptors[1].QueryBase = RMI4_CACHE_TEST_F12_QUERY;
+
+    for (i = 0; i < RMI_F12_REGISTER_DESCRIPTORS; i++)
+    {
+        cache->RegDesc[i].NumRegisters = 1;
+    }
+
+    //
+    // Data0 ahead of the finger objects of data1
+    //
+    cache->RegDesc[RMI_F12_REGISTER_DESCRIPTORS - 1].NumRegisters = 2;
+    Blob->Items[2].Register = 0;
+    Blob->Items[2].RegisterSize = 1;
+    Blob->Items[3].Register = 1;
+    Blob->Items[3].RegisterSize =
+        RMI4_CACHE_TEST_FINGERS * F12_DATA1_BYTES_PER_OBJ;
+    Blob->Items[3].NumSubPackets = RMI4_CACHE_TEST_FINGERS;
+
+    cache->PacketSize = 1 + RMI4_CACHE_TEST_FINGERS * F12_DATA1_BYTES_PER_OBJ;
+    cache->Data1Offset = 1;
+    cache->MaxFingers = RMI4_CACHE_TEST_FINGERS;
+
+    cache->ServicePlan.Count = RmiServiceAccessMax;
+    cache->ServicePlan.Access[0] = RmiServiceAccessStatus;
+    cache->ServicePlan.Access[1] = RmiServiceAccessTouchData;
+}
+
+BOOLEAN
+RmiExpectDiscoveryCache(
+    IN RMI4_CACHE_TEST_BLOB *Blob,
+    IN ULONG Length,
+    IN BOOLEAN Accepted,
+    IN PCSTR Case
+    )
+/*++
+
+  Routine Description:
+
+    Runs the discovery cache checks on a blob and compares the outcome
+    with the expected one.
+
+  Arguments:
+
+    Blob - The blob
+    Length - Size of the blob in bytes
+    Accepted - TRUE if the blob is expected to be accepted
+    Case - Name of the test case
+
+  Return Value:
+
+    TRUE if the outcome is the expected one
+
+--*/
+{
+    NTSTATUS status;
+
+    status = RmiCheckDiscoveryCache(&Blob->Cache, Length);
+
+    if (NT_SUCCESS(status) != Accepted)
+    {
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_INIT,
+            "Discovery cache test '%s' failed - %!STATUS!",
+            Case,
+            status);
+
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+NTSTATUS
+TchTestDiscoveryCache(
+    VOID
+    )
+/*++
+
+  Routine Description:
+
+    Checks that well formed discovery cache blobs are accepted and that
+    truncated, outdated, foreign or out of range ones are refused.
+
+  Arguments:
+
+    None
+
+  Return Value:
+
+    STATUS_SUCCESS if every case passed
+
+--*/
+{
+    RMI4_CACHE_TEST_BLOB blob;
+    RMI4_FUNCTION_DESCRIPTOR descriptor;
+    RMI4_F01_QUERY_REGISTERS query;
+    ULONG length;
+    BOOLEAN passed;
+    int i;
+
+    passed = TRUE;
+    length = sizeof(RMI4_CACHE_TEST_BLOB);
+
+    RmiBuildTestDiscoveryCache(&blob);
+    passed &= RmiExpectDiscoveryCache(&blob, length, TRUE, "well formed");
+
+    //
+    // Truncated blobs
+    //
+    passed &= RmiExpectDiscoveryCache(
+        &blob, sizeof(RMI4_DISCOVERY_CACHE) / 2, FALSE, "truncated header");
+
+    blob.Cache.Size = length - sizeof(RMI_REGISTER_DESC_ITEM);
+    passed &= RmiExpectDiscoveryCache(
+        &blob, blob.Cache.Size, FALSE, "truncated items");
+
+    RmiBuildTestDiscoveryCache(&blob);
+    blob.Cache.RegDesc[0].NumRegisters++;
+    passed &= RmiExpectDiscoveryCache(&blob, length, FALSE, "item count");
+
+    //
+    // Blobs of another format
+    //
+    RmiBuildTestDiscoveryCache(&blob);
+    blob.Cache.Version++;
+    passed &= RmiExpectDiscoveryCache(&blob, length, FALSE, "wrong version");
+
+    RmiBuildTestDiscoveryCache(&blob);
+    blob.Cache.Signature = 0;
+    passed &= RmiExpectDiscoveryCache(&blob, length, FALSE, "wrong signature");
+
+    //
+    // Function table
+    //
+    RmiBuildTestDiscoveryCache(&blob);
+    for (i = 2; i < RMI4_MAX_FUNCTIONS; i++)
+    {
+        blob.Cache.Descriptors[i].Number = RMI4_F54_TEST_REPORTING;
+        blob.Cache.FunctionOnPage[i] = 1;
+    }
+    blob.Cache.FunctionCount = RMI4_MAX_FUNCTIONS;
+    passed &= RmiExpectDiscoveryCache(&blob, length, TRUE, "full function table");
+
+    blob.Cache.FunctionCount = RMI4_MAX_FUNCTIONS + 1;
+    passed &= RmiExpectDiscoveryCache(&blob, length, FALSE, "function count");
+
+    blob.Cache.FunctionCount = 0;
+    passed &= RmiExpectDiscoveryCache(&blob, length, FALSE, "no functions");
+
+    RmiBuildTestDiscoveryCache(&blob);
+    blob.Cache.FunctionOnPage[1] = -1;
+    passed &= RmiExpectDiscoveryCache(&blob, length, FALSE, "function page");
+
+    RmiBuildTestDiscoveryCache(&blob);
+    blob.Cache.FunctionOnPage[1] = 1;
+    passed &= RmiExpectDiscoveryCache(&blob, length, FALSE, "service plan page");
+
+    RmiBuildTestDiscoveryCache(&blob);
+    blob.Cache.ServicePlan.Access[0] = RmiServiceAccessTouchData;
+    blob.Cache.ServicePlan.Access[1] = RmiServiceAccessStatus;
+    passed &= RmiExpectDiscoveryCache(&blob, length, FALSE, "service plan order");
+
+    //
+    // F12 data packet layout
+    //
+    RmiBuildTestDiscoveryCache(&blob);
+    blob.Cache.PacketSize++;
+    passed &= RmiExpectDiscoveryCache(&blob, length, FALSE, "packet size");
+
+    RmiBuildTestDiscoveryCache(&blob);
+    blob.Cache.Data1Offset = (USHORT) blob.Cache.PacketSize;
+    passed &= RmiExpectDiscoveryCache(&blob, length, FALSE, "finger offset");
+
+    RmiBuildTestDiscoveryCache(&blob);
+    blob.Cache.MaxFingers = RMI4_MAX_TOUCHES + 1;
+    passed &= RmiExpectDiscoveryCache(&blob, length, FALSE, "finger count");
+
+    RmiBuildTestDiscoveryCache(&blob);
+    blob.Items[3].RegisterSize = 5 * F12_DATA1_BYTES_PER_OBJ;
+    blob.Cache.PacketSize = 1 + 5 * F12_DATA1_BYTES_PER_OBJ;
+    passed &= RmiExpectDiscoveryCache(&blob, length, FALSE, "fingers past packet");
+
+    blob.Cache.MaxFingers = 5;
+    passed &= RmiExpectDiscoveryCache(&blob, length, TRUE, "fingers in packet");
+
+    RmiBuildTestDiscoveryCache(&blob);
+    blob.Items[3].NumSubPackets = 2 * RMI4_MAX_TOUCHES;
+    blob.Items[3].RegisterSize = 2 * RMI4_MAX_TOUCHES * F12_DATA1_BYTES_PER_OBJ;
+    blob.Cache.PacketSize = 1 + blob.Items[3].RegisterSize;
+    blob.Cache.MaxFingers = 2 * RMI4_MAX_TOUCHES;
+    passed &= RmiExpectDiscoveryCache(&blob, length, FALSE, "fingers past driver");
+
+    blob.Cache.MaxFingers = RMI4_MAX_TOUCHES;
+    passed &= RmiExpectDiscoveryCache(&blob, length, TRUE, "fingers in driver");
+
+    RmiBuildTestDiscoveryCache(&blob);
+    blob.Items[3].RegisterSize = MAXULONG;
+    blob.Cache.PacketSize = 0;
+    passed &= RmiExpectDiscoveryCache(&blob, length, FALSE, "item size");
+
+    RmiBuildTestDiscoveryCache(&blob);
+    blob.Items[2].RegisterSize = 0;
+    blob.Items[3].RegisterSize = 0;
+    blob.Items[3].NumSubPackets = 0;
+    blob.Cache.PacketSize = 0;
+    blob.Cache.Data1Offset = 0;
+    blob.Cache.MaxFingers = 0;
+    passed &= RmiExpectDiscoveryCache(&blob, length, FALSE, "empty packet");
+
+    RmiBuildTestDiscoveryCache(&blob);
+    blob.Items[3].Register = 2;
+    passed &= RmiExpectDiscoveryCache(&blob, length, FALSE, "no finger register");
+
+    //
+    // Controller identity
+    //
+    RmiBuildTestDiscoveryCache(&blob);
+    descriptor = blob.Cache.Descriptors[0];
+    query = blob.Cache.F01QueryRegisters;
+
+    if (!NT_SUCCESS(RmiCheckDiscoveryCacheIdentity(
+            &blob.Cache, &descriptor, &query)))
+    {
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_INIT,
+            "Discovery cache test 'same firmware' failed");
+
+        passed = FALSE;
+    }
+
+    query.ProductID2++;
+
+    if (NT_SUCCESS(RmiCheckDiscoveryCacheIdentity(
+            &blob.Cache, &descriptor, &query)))
+    {
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_INIT,
+            "Discovery cache test 'other firmware' failed");
+
+        passed = FALSE;
+    }
+
+    query = blob.Cache.F01QueryRegisters;
+    descriptor.QueryBase++;
+
+    if (NT_SUCCESS(RmiCheckDiscoveryCacheIdentity(
+            &blob.Cache, &descriptor, &query)))
+    {
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_INIT,
+            "Discovery cache test 'other function table' failed");
+
+        passed = FALSE;
+    }
+
+    Trace(
+        TRACE_LEVEL_INFORMATION,
+        TRACE_INIT,
+        "Discovery cache self test %s",
+        passed ? "passed" : "failed");
+
+    return passed ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL;
+}
@@ -5,7 +5,7 @@
 #include <internal.h>
 #include <controller.h>
 #include <device.h>
-#include <spb.h>
+#include <spbtarget.h>
 #include <idle.h>
 #include <device.tmh>
 
@@ -13,6 +13,131 @@
   #pragma alloc_text(PAGE, OnD0Exit)
 #endif
 
+ULONG
+TchUpdateStormState(
+    IN PDEVICE_EXTENSION DevContext,
+    IN BOOLEAN FrameCaptured
+    )
+/*++
+ 
+  Routine Description:
+
+    Tracks the rate of interrupts that capture no frame, such as those
+    raised by a flaky bus or status bits the driver does not service,
+    and decides how long the ISR should back off.
+
+  Arguments:
+
+    DevContext - the device context
+    FrameCaptured - whether the interrupt captured a frame
+
+  Return Value:
+
+    The time in milliseconds the interrupts should stay masked, zero
+    outside of an interrupt storm
+
+--*/
+{
+    ULONG64 now;
+    ULONG64 window;
+
+    now = KeQueryInterruptTime();
+    window = TOUCH_STORM_WINDOW_MS * 10000ULL;
+
+    //
+    // A captured frame, or a full window without empty interrupts, ends
+    // the storm
+    //
+    if (FrameCaptured ||
+        now - DevContext->LastEmptyInterrupt > window)
+    {
+        if (DevContext->StormBackoff != 0)
+        {
+            Trace(
+                TRACE_LEVEL_INFORMATION,
+                TRACE_INTERRUPT,
+                "Interrupt storm ended, %d empty interrupts so far",
+                DevContext->EmptyInterruptsTotal);
+        }
+
+        DevContext->StormBackoff = 0;
+        DevContext->EmptyInterrupts = 0;
+        DevContext->StormWindowStart = now;
+
+        if (FrameCaptured)
+        {
+            goto exit;
+        }
+    }
+
+    DevContext->LastEmptyInterrupt = now;
+    DevContext->EmptyInterruptsTotal++;
+
+    if (now - DevContext->StormWindowStart > window)
+    {
+        DevContext->StormWindowStart = now;
+        DevContext->EmptyInterrupts = 0;
+    }
+
+    DevContext->EmptyInterrupts++;
+
+    if (DevContext->StormBackoff != 0)
+    {
+        DevContext->StormBackoff = min(
+            DevContext->StormBackoff * 2,
+            TOUCH_STORM_MAX_BACKOFF_MS);
+    }
+    else if (DevContext->EmptyInterrupts >= TOUCH_STORM_THRESHOLD)
+    {
+        DevContext->StormBackoff = TOUCH_STORM_MIN_BACKOFF_MS;
+        DevContext->StormCount++;
+
+        Trace(
+            TRACE_LEVEL_WARNING,
+            TRACE_INTERRUPT,
+            "Interrupt storm detected (%d so far), backing off",
+            DevContext->StormCount);
+    }
+
+exit:
+
+    return DevContext->StormBackoff;
+}
+
+VOID
+TchArmDozeTimer(
+    IN PDEVICE_EXTENSION DevContext
+    )
+/*++
+ 
+  Routine Description:
+
+    Feeds a captured frame to the doze policy, and arms the idle timer
+    when a touch session ended.
+
+  Arguments:
+
+    DevContext - the device context
+
+  Return Value:
+
+    None
+
+--*/
+{
+    ULONG idleTimeout;
+
+    if (TchUpdateDozePolicy(
+        DevContext->TouchContext,
+        &DevContext->I2CContext,
+        &idleTimeout))
+    {
+        WdfTimerStart(
+            DevContext->DozeTimer,
+            WDF_REL_TIMEOUT_IN_MS(idleTimeout));
+    }
+}
+
 BOOLEAN
 OnInterruptIsr(
     IN WDFINTERRUPT Interrupt,
@@ -23,8 +148,8 @@ OnInterruptIsr(
   Routine Description:
 
     This routine responds to interrupts generated by the
-    controller. If one is recognized, it queues a DPC for 
-    processing. 
+    controller. If one is recognized, the touch data is captured
+    and a work item is queued for processing it.
 
     This is a PASSIVE_LEVEL ISR. ACPI should specify
     level-triggered interrupts when using Synaptics 3202.
@@ -42,20 +167,16 @@ OnInterruptIsr(
 --*/
 {
     PDEVICE_EXTENSION devContext;
-    NTSTATUS status;
-    WDFREQUEST request;
-    BOOLEAN servicingComplete;
-    DEV_REPORT hidReportFromDriver;
-    PDEV_REPORT hidReportRequestBuffer;
-    size_t hidReportRequestBufferLength;
+    ULONG64 startTime;
+    ULONG64 elapsed;
+    BOOLEAN captured;
+    ULONG pollInterval;
+    ULONG backoff;
 
     UNREFERENCED_PARAMETER(MessageID);
 
-    status = STATUS_SUCCESS;
-    servicingComplete = FALSE;
     devContext = GetDeviceContext(WdfInterruptGetDevice(Interrupt));
-    request = NULL;
-
+    startTime = KeQueryInterruptTime();
 
     //
     // If we're in diagnostic mode, let the diagnostic application handle
@@ -66,20 +187,191 @@ OnInterruptIsr(
         goto exit;
     }
 
-    
     //
-    // Service the device interrupt
+    // Capture the device interrupt. Success indicates a frame was queued
+    // for the processing work item, which completes the HIDClass requests
+    // so that a slow consumer does not hold the interrupt line. The entry
+    // time of the ISR is the sample time of the frame.
+    //
+    captured = NT_SUCCESS(TchCaptureInterrupts(
+        devContext->TouchContext,
+        &devContext->I2CContext,
+        startTime));
+
+    if (captured)
+    {
+        WdfWorkItemEnqueue(devContext->ProcessingWorkItem);
+
+        //
+        // Under sustained touch data the touch interrupt is masked and
+        // frames are polled at the report rate instead
+        //
+        if (TchUpdateInterruptMode(
+            devContext->TouchContext,
+            &devContext->I2CContext,
+            &pollInterval))
+        {
+            WdfTimerStart(
+                devContext->PollTimer,
+                WDF_REL_TIMEOUT_IN_US(pollInterval));
+        }
+
+        TchArmDozeTimer(devContext);
+    }
+
+    //
+    // A level-triggered line that keeps firing without producing frames
+    // would otherwise monopolize the ISR thread. Its sources are masked
+    // at the controller for the backoff, the storm timer unmasks them
+    //
+    backoff = TchUpdateStormState(devContext, captured);
+
+    if (backoff != 0 &&
+        TchMaskInterrupts(
+            devContext->TouchContext,
+            &devContext->I2CContext))
+    {
+        WdfTimerStart(
+            devContext->StormTimer,
+            WDF_REL_TIMEOUT_IN_MS(backoff));
+    }
+
+    elapsed = KeQueryInterruptTime() - startTime;
+
+    if (elapsed > devContext->MaxIsrTime)
+    {
+        devContext->MaxIsrTime = elapsed;
+
+        Trace(
+            TRACE_LEVEL_VERBOSE,
+            TRACE_INTERRUPT,
+            "New longest ISR pass - %lluus",
+            elapsed / 10);
+    }
+
+exit:
+    return TRUE;
+}
+
+VOID
+TchTrackResumeLatency(
+    IN PDEVICE_EXTENSION DevContext
+    )
+/*++
+ 
+  Routine Description:
+
+    Closes the resume timeline once the first report after D0 entry
+    was completed.
+
+  Arguments:
+
+    DevContext - the device context
+
+  Return Value:
+
+    None
+
+--*/
+{
+    ULONG64 latency;
+
+    latency = KeQueryInterruptTime() - DevContext->ResumeStart;
+
+    DevContext->ResumeReportPending = FALSE;
+    DevContext->LastResumeLatency = latency;
+
+    if (latency > DevContext->MaxResumeLatency)
+    {
+        DevContext->MaxResumeLatency = latency;
+    }
+
+    Trace(
+        TRACE_LEVEL_INFORMATION,
+        TRACE_POWER,
+        "First report %lluus after D0 entry, controller woke in %lluus",
+        latency / 10,
+        DevContext->ResumeWakeTime / 10);
+}
+
+BOOLEAN
+TchReportCapturedFrames(
+    IN PDEVICE_EXTENSION DevContext
+    )
+/*++
+ 
+  Routine Description:
+
+    This routine turns the frames captured by the ISR into HID reports
+    and completes pending HIDClass read requests with them. Only one
+    instance runs at a time, so the reports are completed in frame order.
+
+  Arguments:
+
+    DevContext - a pointer to the device context
+
+  Return Value:
+
+    FALSE if the processing budget ran out before all frames were
+    reported, TRUE otherwise
+
+--*/
+{
+    PDEVICE_EXTENSION devContext;
+    NTSTATUS status;
+    WDFREQUEST request;
+    BOOLEAN servicingComplete;
+    DEV_REPORT hidReportFromDriver;
+    PDEV_REPORT hidReportRequestBuffer;
+    size_t hidReportRequestBufferLength;
+    ULONG64 startTime;
+    ULONG64 heldDelay;
+    ULONG iterations;
+    BOOLEAN exhausted;
+
+    status = STATUS_SUCCESS;
+    servicingComplete = FALSE;
+    exhausted = FALSE;
+    devContext = DevContext;
+    request = NULL;
+    startTime = KeQueryInterruptTime();
+    iterations = 0;
+
+    //
+    // Process captured frames
     //
     while (servicingComplete == FALSE)
     {
         //
-        // Service touch interrupts. Success indicates we have a report
-        // to complete to Hid. ServicingComplete indicates another report
-        // is required to continue servicing this interrupt.
+        // Bound the pass, the rest of the frames are left to a new run
+        // of the work item, letting go of the worker thread
+        //
+        if (iterations == TOUCH_PROCESSING_MAX_REPORTS ||
+            KeQueryInterruptTime() - startTime >
+                TOUCH_PROCESSING_BUDGET_US * 10ULL)
+        {
+            devContext->ProcessingBudgetExhausted++;
+
+            Trace(
+                TRACE_LEVEL_WARNING,
+                TRACE_REPORTING,
+                "Processing budget exhausted after %d reports (%d times)",
+                iterations,
+                devContext->ProcessingBudgetExhausted);
+
+            exhausted = TRUE;
+            break;
+        }
+
+        iterations++;
+
+        //
+        // Success indicates we have a report to complete to Hid.
+        // ServicingComplete indicates another report is required to
+        // continue processing the captured frames.
         //
         if (!NT_SUCCESS(TchServiceInterrupts(
             devContext->TouchContext,
-            &devContext->I2CContext,
             &hidReportFromDriver,
             devContext->InputMode,
             &servicingComplete)))
@@ -105,8 +397,6 @@ OnInterruptIsr(
                 "No request pending from HIDClass, ignoring report - %!STATUS!",
                 status);
 
-
-
             continue;
         }
 
@@ -155,10 +445,310 @@ OnInterruptIsr(
         }
 
         WdfRequestComplete(request, status);
+
+        if (NT_SUCCESS(status) && devContext->ResumeReportPending)
+        {
+            TchTrackResumeLatency(devContext);
+        }
     }
 
-exit:
-    return TRUE;
+    //
+    // Come back when a frame held back by the report rate limiter is due
+    //
+    if (TchGetHeldReportDelay(devContext->TouchContext, &heldDelay))
+    {
+        WdfTimerStart(
+            devContext->RateTimer,
+            WDF_REL_TIMEOUT_IN_US(max(heldDelay, 1)));
+    }
+
+    return !exhausted;
+}
+
+VOID
+OnProcessingWorkItem(
+    IN WDFWORKITEM WorkItem
+    )
+/*++
+ 
+  Routine Description:
+
+    This routine runs the processing of the captured frames. The work
+    item may be queued again while it runs, in which case the running
+    instance is asked to make another pass instead of a second instance
+    competing with it for the HIDClass requests.
+
+  Arguments:
+
+    WorkItem - a handle to the processing work item
+
+  Return Value:
+
+    None
+
+--*/
+{
+    PDEVICE_EXTENSION devContext;
+    BOOLEAN yield;
+
+    devContext = GetDeviceContext(WdfWorkItemGetParentObject(WorkItem));
+    yield = FALSE;
+
+    //
+    // The pass is requested before ownership is attempted, an owner
+    // releasing it concurrently sees the request and takes it back
+    //
+    InterlockedExchange(&devContext->ProcessingPending, 1);
+
+    while (devContext->ProcessingPending != 0)
+    {
+        if (InterlockedCompareExchange(
+            &devContext->ProcessingActive, 1, 0) != 0)
+        {
+            break;
+        }
+
+        while (!yield &&
+            InterlockedExchange(&devContext->ProcessingPending, 0) != 0)
+        {
+            yield = !TchReportCapturedFrames(devContext);
+        }
+
+        InterlockedExchange(&devContext->ProcessingActive, 0);
+
+        //
+        // The frames left by an exhausted budget go to a new run
+        //
+        if (yield)
+        {
+            InterlockedExchange(&devContext->ProcessingPending, 1);
+            WdfWorkItemEnqueue(WorkItem);
+            break;
+        }
+    }
+}
+
+VOID
+OnRateTimer(
+    IN WDFTIMER Timer
+    )
+/*++
+ 
+  Routine Description:
+
+    This routine fires when a frame held back by the report rate limiter
+    is due, and queues the processing work item to report it.
+
+  Arguments:
+
+    Timer - a handle to the rate timer
+
+  Return Value:
+
+    None
+
+--*/
+{
+    PDEVICE_EXTENSION devContext;
+
+    devContext = GetDeviceContext(WdfTimerGetParentObject(Timer));
+
+    WdfWorkItemEnqueue(devContext->ProcessingWorkItem);
+}
+
+VOID
+OnPollTimer(
+    IN WDFTIMER Timer
+    )
+/*++
+ 
+  Routine Description:
+
+    This routine fires once per report period while frames are polled,
+    and queues the work item reading the next frame.
+
+  Arguments:
+
+    Timer - a handle to the poll timer
+
+  Return Value:
+
+    None
+
+--*/
+{
+    PDEVICE_EXTENSION devContext;
+
+    devContext = GetDeviceContext(WdfTimerGetParentObject(Timer));
+
+    WdfWorkItemEnqueue(devContext->PollWorkItem);
+}
+
+VOID
+OnPollWorkItem(
+    IN WDFWORKITEM WorkItem
+    )
+/*++
+ 
+  Routine Description:
+
+    This routine reads a frame while the touch interrupt is masked,
+    hands it to the processing work item and re-arms the poll timer
+    until the controller goes back to interrupt mode.
+
+  Arguments:
+
+    WorkItem - a handle to the poll work item
+
+  Return Value:
+
+    None
+
+--*/
+{
+    PDEVICE_EXTENSION devContext;
+    BOOLEAN captured;
+    ULONG pollInterval;
+
+    devContext = GetDeviceContext(WdfWorkItemGetParentObject(WorkItem));
+
+    if (TchPollFrame(
+        devContext->TouchContext,
+        &devContext->I2CContext,
+        &captured,
+        &pollInterval))
+    {
+        WdfTimerStart(
+            devContext->PollTimer,
+            WDF_REL_TIMEOUT_IN_US(pollInterval));
+    }
+
+    if (captured)
+    {
+        WdfWorkItemEnqueue(devContext->ProcessingWorkItem);
+
+        TchArmDozeTimer(devContext);
+    }
+}
+
+VOID
+OnDozeTimer(
+    IN WDFTIMER Timer
+    )
+/*++
+ 
+  Routine Description:
+
+    This routine fires once touch stopped for the idle timeout, and
+    queues the work item bringing back the idle doze profile.
+
+  Arguments:
+
+    Timer - a handle to the doze timer
+
+  Return Value:
+
+    None
+
+--*/
+{
+    PDEVICE_EXTENSION devContext;
+
+    devContext = GetDeviceContext(WdfTimerGetParentObject(Timer));
+
+    WdfWorkItemEnqueue(devContext->DozeWorkItem);
+}
+
+VOID
+OnDozeWorkItem(
+    IN WDFWORKITEM WorkItem
+    )
+/*++
+ 
+  Routine Description:
+
+    This routine brings back the idle doze profile.
+
+  Arguments:
+
+    WorkItem - a handle to the doze work item
+
+  Return Value:
+
+    None
+
+--*/
+{
+    PDEVICE_EXTENSION devContext;
+
+    devContext = GetDeviceContext(WdfWorkItemGetParentObject(WorkItem));
+
+    TchDozeIdle(
+        devContext->TouchContext,
+        &devContext->I2CContext);
+}
+
+VOID
+OnStormTimer(
+    IN WDFTIMER Timer
+    )
+/*++
+ 
+  Routine Description:
+
+    This routine fires once the storm backoff expired, and queues the
+    work item unmasking the interrupts.
+
+  Arguments:
+
+    Timer - a handle to the storm timer
+
+  Return Value:
+
+    None
+
+--*/
+{
+    PDEVICE_EXTENSION devContext;
+
+    devContext = GetDeviceContext(WdfTimerGetParentObject(Timer));
+
+    WdfWorkItemEnqueue(devContext->StormWorkItem);
+}
+
+VOID
+OnStormWorkItem(
+    IN WDFWORKITEM WorkItem
+    )
+/*++
+ 
+  Routine Description:
+
+    This routine unmasks the interrupts masked during a storm, retrying
+    after the longest backoff if the controller could not be reached.
+
+  Arguments:
+
+    WorkItem - a handle to the storm work item
+
+  Return Value:
+
+    None
+
+--*/
+{
+    PDEVICE_EXTENSION devContext;
+
+    devContext = GetDeviceContext(WdfWorkItemGetParentObject(WorkItem));
+
+    if (TchUnmaskInterrupts(
+        devContext->TouchContext,
+        &devContext->I2CContext))
+    {
+        WdfTimerStart(
+            devContext->StormTimer,
+            WDF_REL_TIMEOUT_IN_MS(TOUCH_STORM_MAX_BACKOFF_MS));
+    }
 }
 
 NTSTATUS
@@ -189,9 +779,15 @@ Return Value:
     devContext = GetDeviceContext(Device);
 
     UNREFERENCED_PARAMETER(PreviousState);
+
+    devContext->ResumeStart = KeQueryInterruptTime();
     
     status = TchWakeDevice(devContext->TouchContext, &devContext->I2CContext);
 
+    devContext->ResumeWakeTime = KeQueryInterruptTime() - devContext->ResumeStart;
+    devContext->ResumeReportPending = TRUE;
+    devContext->Resumes++;
+
     if (!NT_SUCCESS(status))
     {
         Trace(
@@ -258,6 +854,19 @@ Return Value:
             "Error exiting D0 - %!STATUS!", 
             status);
     }
+
+    //
+    // Standby left polling mode, the interactive doze profile and any
+    // storm masking, and dropped any held frame. Make sure no poll, doze
+    // change, unmask or held report is still pending
+    //
+    WdfTimerStop(devContext->PollTimer, TRUE);
+    WdfWorkItemFlush(devContext->PollWorkItem);
+    WdfTimerStop(devContext->DozeTimer, TRUE);
+    WdfWorkItemFlush(devContext->DozeWorkItem);
+    WdfTimerStop(devContext->RateTimer, TRUE);
+    WdfTimerStop(devContext->StormTimer, TRUE);
+    WdfWorkItemFlush(devContext->StormWorkItem);
     
     return status;
 }
@@ -437,6 +1046,37 @@ OnReleaseHardware(
 
     devContext = GetDeviceContext(FxDevice);
 
+    //
+    // Let polling and frame processing finish before the touch context
+    // goes away
+    //
+    WdfTimerStop(devContext->PollTimer, TRUE);
+    WdfWorkItemFlush(devContext->PollWorkItem);
+    WdfTimerStop(devContext->DozeTimer, TRUE);
+    WdfWorkItemFlush(devContext->DozeWorkItem);
+    WdfTimerStop(devContext->RateTimer, TRUE);
+    WdfTimerStop(devContext->StormTimer, TRUE);
+    WdfWorkItemFlush(devContext->StormWorkItem);
+    WdfWorkItemFlush(devContext->ProcessingWorkItem);
+
+    Trace(
+        TRACE_LEVEL_INFORMATION,
+        TRACE_PNP,
+        "Interrupts - %d storms, %d empty, longest ISR %lluus, "
+        "processing budget exhausted %d times",
+        devContext->StormCount,
+        devContext->EmptyInterruptsTotal,
+        devContext->MaxIsrTime / 10,
+        devContext->ProcessingBudgetExhausted);
+
+    Trace(
+        TRACE_LEVEL_INFORMATION,
+        TRACE_PNP,
+        "Resumes - %d, last first report after %lluus, longest %lluus",
+        devContext->Resumes,
+        devContext->LastResumeLatency / 10,
+        devContext->MaxResumeLatency / 10);
+
     status = TchStopDevice(devContext->TouchContext, &devContext->I2CContext);
 
     if (!NT_SUCCESS(status))
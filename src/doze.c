@@ -0,0 +1,403 @@
+/*++
+    Copyright (c) Microsoft Corporation. All Rights Reserved.
+    Sample code. Dealpoint ID #843729.
+
+    Module Name:
+
+        doze.c
+
+    Abstract:
+
+        Adapts the F01 doze settings to how the touch screen is used.
+        The configured doze settings apply while the sensor sits
+        untouched, touch sessions switch to a profile waking faster and
+        staying awake through the usual gap between sessions, until a
+        learned idle timeout passes without touch.
+
+    Environment:
+
+        Kernel mode
+
+    Revision History:
+
+--*/
+
+#include <compat.h>
+#include <controller.h>
+#include <rmiinternal.h>
+#include <spbtarget.h>
+#include <doze.tmh>
+
+NTSTATUS
+RmiSetDozeParameters(
+    IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+    IN SPB_CONTEXT *SpbContext,
+    IN BYTE DozeInterval,
+    IN BYTE DozeThreshold,
+    IN BYTE DozeHoldoff
+    )
+/*++
+
+  Routine Description:
+
+    Programs the F01 doze registers through the control shadow. Only
+    the doze registers are written, the shadow is restored on failure.
+    Called with the controller lock held.
+
+  Arguments:
+
+    ControllerContext - Touch controller context
+    SpbContext - A pointer to the current i2c context
+    DozeInterval - Doze interval in 10ms units
+    DozeThreshold - Wake threshold while dozing
+    DozeHoldoff - Time without touch before dozing in 500ms units
+
+  Return Value:
+
+    NTSTATUS indicating success or failure
+
+--*/
+{
+    RMI4_F01_CTRL_REGISTERS* controlF01;
+    RMI4_WRITE_BATCH batch;
+    BYTE oldDoze[RMI4_F01_DOZE_REGISTERS_SIZE];
+    int index;
+    NTSTATUS status;
+
+    controlF01 = &ControllerContext->F01ControlShadow;
+
+    index = RmiGetFunctionIndex(
+        ControllerContext->Descriptors,
+        ControllerContext->FunctionCount,
+        RMI4_F01_RMI_DEVICE_CONTROL);
+
+    if (index == ControllerContext->FunctionCount ||
+        !ControllerContext->F01ControlShadowValid)
+    {
+        status = STATUS_INVALID_DEVICE_STATE;
+        goto exit;
+    }
+
+    RtlCopyMemory(oldDoze, &controlF01->DozeInterval, sizeof(oldDoze));
+
+    controlF01->DozeInterval = DozeInterval;
+    controlF01->DozeThreshold = DozeThreshold;
+    controlF01->DozeHoldoff = DozeHoldoff;
+
+    RmiBatchInitialize(ControllerContext, &batch);
+
+    status = RmiBatchAddWrite(
+        &batch,
+        ControllerContext->FunctionOnPage[index],
+        (UCHAR) (ControllerContext->Descriptors[index].ControlBase +
+            FIELD_OFFSET(RMI4_F01_CTRL_REGISTERS, InterruptEnable) +
+            ControllerContext->Interrupts.Registers),
+        &controlF01->DozeInterval,
+        RMI4_F01_DOZE_REGISTERS_SIZE);
+
+    if (NT_SUCCESS(status))
+    {
+        status = RmiBatchExecute(
+            ControllerContext,
+            SpbContext,
+            &batch);
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        RtlCopyMemory(&controlF01->DozeInterval, oldDoze, sizeof(oldDoze));
+    }
+
+exit:
+
+    return status;
+}
+
+VOID
+RmiApplyDozeProfile(
+    IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+    IN SPB_CONTEXT *SpbContext,
+    IN BOOLEAN Interactive
+    )
+/*++
+
+  Routine Description:
+
+    Switches to the idle or the interactive doze profile. The idle
+    profile is the configured one. The interactive profile halves the
+    doze interval, lowers the wake threshold by a quarter and holds off
+    dozing for twice the learned gap between touch sessions. Nothing is
+    written when the controller already runs the profile. Called with
+    the controller lock held.
+
+  Arguments:
+
+    ControllerContext - Touch controller context
+    SpbContext - A pointer to the current i2c context
+    Interactive - TRUE for the interactive profile
+
+  Return Value:
+
+    None.
+
+--*/
+{
+    RMI4_F01_CTRL_REGISTERS_LOGICAL* settings;
+    RMI4_F01_CTRL_REGISTERS* controlF01;
+    RMI4_DOZE_POLICY* doze;
+    BYTE interval;
+    BYTE threshold;
+    BYTE holdoff;
+    NTSTATUS status;
+
+    settings = &ControllerContext->Config.DeviceSettings;
+    controlF01 = &ControllerContext->F01ControlShadow;
+    doze = &ControllerContext->Doze;
+
+    interval = (BYTE) settings->DozeInterval;
+    threshold = (BYTE) settings->DozeThreshold;
+    holdoff = (BYTE) settings->DozeHoldoff;
+
+    if (Interactive)
+    {
+        interval = (BYTE) max(interval / 2, 1);
+        threshold = (BYTE) max(threshold - threshold / 4, 1);
+        holdoff = (BYTE) min(
+            max(doze->AverageGap * 2 / RMI4_DOZE_HOLDOFF_UNIT, holdoff),
+            RMI4_DOZE_MAX_HOLDOFF);
+    }
+
+    if (controlF01->DozeInterval == interval &&
+        controlF01->DozeThreshold == threshold &&
+        controlF01->DozeHoldoff == holdoff)
+    {
+        doze->Interactive = Interactive;
+        goto exit;
+    }
+
+    status = RmiSetDozeParameters(
+        ControllerContext,
+        SpbContext,
+        interval,
+        threshold,
+        holdoff);
+
+    if (!NT_SUCCESS(status))
+    {
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_POWER,
+            "Could not write doze settings - %!STATUS!",
+            status);
+
+        goto exit;
+    }
+
+    Trace(
+        TRACE_LEVEL_VERBOSE,
+        TRACE_POWER,
+        "Doze profile %s - interval %d, threshold %d, holdoff %d",
+        Interactive ? "interactive" : "idle",
+        interval,
+        threshold,
+        holdoff);
+
+    doze->Interactive = Interactive;
+    doze->Switches++;
+
+exit:
+
+    return;
+}
+
+BOOLEAN
+TchUpdateDozePolicy(
+    IN VOID *ControllerContext,
+    IN SPB_CONTEXT *SpbContext,
+    OUT ULONG *IdleTimeout
+    )
+/*++
+
+  Routine Description:
+
+    Called after a frame was captured. Tracks touch sessions, learns the
+    gap between them and switches to the interactive doze profile when
+    a session starts. When a session ends the caller is asked to arm
+    the idle timer, which brings back the idle profile.
+
+    The worst case first-touch latency (the doze interval in effect when
+    a session starts on a dozing controller) and the time the sensor
+    scans at full rate are accounted for evaluating the policy.
+
+  Arguments:
+
+    ControllerContext - Touch controller context
+    SpbContext - A pointer to the current i2c context
+    IdleTimeout - Receives the idle timeout in milliseconds
+
+  Return Value:
+
+    TRUE if the caller must arm the idle timer
+
+--*/
+{
+    RMI4_CONTROLLER_CONTEXT* controller;
+    RMI4_DOZE_POLICY* doze;
+    BOOLEAN armTimer = FALSE;
+    ULONG64 holdoffTime;
+    ULONG64 timeout;
+    ULONG64 now;
+    ULONG64 gap;
+
+    controller = (RMI4_CONTROLLER_CONTEXT*) ControllerContext;
+    doze = &controller->Doze;
+
+    WdfWaitLockAcquire(controller->ControllerLock, NULL);
+
+    if (!doze->FramePending)
+    {
+        goto exit;
+    }
+
+    doze->FramePending = FALSE;
+
+    if (controller->Config.AdaptiveDoze == 0 ||
+        !controller->F01QueryRegisters.ProductProperties.HasAdjDoze ||
+        !controller->F01ControlShadowValid)
+    {
+        goto exit;
+    }
+
+    now = KeQueryInterruptTime();
+
+    if (doze->FrameObjects && !doze->SessionActive)
+    {
+        doze->SessionActive = TRUE;
+        doze->SessionStart = now;
+        doze->Sessions++;
+
+        if (doze->LastActivity != 0)
+        {
+            gap = now - doze->LastActivity;
+            holdoffTime = controller->F01ControlShadow.DozeHoldoff *
+                RMI4_DOZE_HOLDOFF_UNIT;
+
+            //
+            // The sensor scans at full rate for the holdoff after a
+            // session, then dozes until the next touch is noticed
+            //
+            doze->ActiveTime += min(gap, holdoffTime);
+
+            if (gap > holdoffTime)
+            {
+                doze->DozedStarts++;
+                doze->FirstTouchLatency +=
+                    controller->F01ControlShadow.DozeInterval *
+                    RMI4_DOZE_INTERVAL_UNIT;
+            }
+
+            //
+            // Only gaps within a burst of interaction shape the profile
+            //
+            if (gap < RMI4_DOZE_MAX_IDLE_TIMEOUT)
+            {
+                doze->AverageGap = (doze->AverageGap == 0) ? gap :
+                    (doze->AverageGap * 7 + gap) / 8;
+            }
+        }
+
+        RmiApplyDozeProfile(controller, SpbContext, TRUE);
+    }
+    else if (!doze->FrameObjects && doze->SessionActive)
+    {
+        doze->SessionActive = FALSE;
+        doze->LastActivity = now;
+        doze->ActiveTime += now - doze->SessionStart;
+
+        if (doze->Interactive)
+        {
+            timeout = min(
+                max(doze->AverageGap * 4, RMI4_DOZE_MIN_IDLE_TIMEOUT),
+                RMI4_DOZE_MAX_IDLE_TIMEOUT);
+
+            *IdleTimeout = (ULONG) (timeout / 10000);
+            armTimer = TRUE;
+        }
+    }
+
+exit:
+
+    WdfWaitLockRelease(controller->ControllerLock);
+
+    return armTimer;
+}
+
+VOID
+TchDozeIdle(
+    IN VOID *ControllerContext,
+    IN SPB_CONTEXT *SpbContext
+    )
+/*++
+
+  Routine Description:
+
+    Called when the idle timer expires, brings back the idle doze
+    profile unless a touch session started in the meantime.
+
+  Arguments:
+
+    ControllerContext - Touch controller context
+    SpbContext - A pointer to the current i2c context
+
+  Return Value:
+
+    None.
+
+--*/
+{
+    RMI4_CONTROLLER_CONTEXT* controller;
+
+    controller = (RMI4_CONTROLLER_CONTEXT*) ControllerContext;
+
+    WdfWaitLockAcquire(controller->ControllerLock, NULL);
+
+    if (controller->Doze.Interactive && !controller->Doze.SessionActive)
+    {
+        RmiApplyDozeProfile(controller, SpbContext, FALSE);
+    }
+
+    WdfWaitLockRelease(controller->ControllerLock);
+}
+
+VOID
+RmiResetDozePolicy(
+    IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+    IN SPB_CONTEXT *SpbContext
+    )
+/*++
+
+  Routine Description:
+
+    Ends the current touch session and goes back to the idle doze
+    profile, so the next wake starts from it. Called with the controller
+    lock held.
+
+  Arguments:
+
+    ControllerContext - Touch controller context
+    SpbContext - A pointer to the current i2c context
+
+  Return Value:
+
+    None.
+
+--*/
+{
+    ControllerContext->Doze.SessionActive = FALSE;
+    ControllerContext->Doze.FramePending = FALSE;
+
+    if (ControllerContext->Doze.Interactive)
+    {
+        RmiApplyDozeProfile(ControllerContext, SpbContext, FALSE);
+    }
+}
@@ -95,6 +95,13 @@ Return Value:
         goto exit;
     }
 
+#if DBG
+    //
+    // Checked builds exercise the discovery cache checks on load
+    //
+    NT_ASSERT(NT_SUCCESS(TchTestDiscoveryCache()));
+#endif
+
 exit:
 
     return status;
@@ -131,6 +138,8 @@ Return Value:
     WDF_INTERRUPT_CONFIG interruptConfig;  
     WDF_PNPPOWER_EVENT_CALLBACKS pnpPowerCallbacks;
     WDF_IO_QUEUE_CONFIG queueConfig;
+    WDF_WORKITEM_CONFIG workItemConfig;
+    WDF_TIMER_CONFIG timerConfig;
     NTSTATUS status;
     
     UNREFERENCED_PARAMETER(Driver);
@@ -289,6 +298,198 @@ Return Value:
         goto exit;
     }
 
+    //
+    // Create a work item for processing the frames captured by the ISR
+    //
+    WDF_WORKITEM_CONFIG_INIT(&workItemConfig, OnProcessingWorkItem);
+    workItemConfig.AutomaticSerialization = FALSE;
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = fxDevice;
+
+    status = WdfWorkItemCreate(
+        &workItemConfig,
+        &attributes,
+        &devContext->ProcessingWorkItem);
+
+    if (!NT_SUCCESS(status))
+    {
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_INIT,
+            "Error creating WDF processing work item - %!STATUS!",
+            status);
+
+        goto exit;
+    }
+
+    //
+    // Create the timer processing frames held back by the report rate
+    // limiter when they are due
+    //
+    WDF_TIMER_CONFIG_INIT(&timerConfig, OnRateTimer);
+    timerConfig.UseHighResolutionTimer = WdfTrue;
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = fxDevice;
+
+    status = WdfTimerCreate(
+        &timerConfig,
+        &attributes,
+        &devContext->RateTimer);
+
+    if (!NT_SUCCESS(status))
+    {
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_INIT,
+            "Error creating WDF rate timer - %!STATUS!",
+            status);
+
+        goto exit;
+    }
+
+    //
+    // Create the timer and work item polling frames under sustained
+    // touch data. The timer only queues the work item since bus access
+    // must happen at passive level
+    //
+    WDF_TIMER_CONFIG_INIT(&timerConfig, OnPollTimer);
+    timerConfig.UseHighResolutionTimer = WdfTrue;
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = fxDevice;
+
+    status = WdfTimerCreate(
+        &timerConfig,
+        &attributes,
+        &devContext->PollTimer);
+
+    if (!NT_SUCCESS(status))
+    {
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_INIT,
+            "Error creating WDF poll timer - %!STATUS!",
+            status);
+
+        goto exit;
+    }
+
+    WDF_WORKITEM_CONFIG_INIT(&workItemConfig, OnPollWorkItem);
+    workItemConfig.AutomaticSerialization = FALSE;
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = fxDevice;
+
+    status = WdfWorkItemCreate(
+        &workItemConfig,
+        &attributes,
+        &devContext->PollWorkItem);
+
+    if (!NT_SUCCESS(status))
+    {
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_INIT,
+            "Error creating WDF poll work item - %!STATUS!",
+            status);
+
+        goto exit;
+    }
+
+    //
+    // Create the timer and work item bringing back the idle doze profile
+    //
+    WDF_TIMER_CONFIG_INIT(&timerConfig, OnDozeTimer);
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = fxDevice;
+
+    status = WdfTimerCreate(
+        &timerConfig,
+        &attributes,
+        &devContext->DozeTimer);
+
+    if (!NT_SUCCESS(status))
+    {
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_INIT,
+            "Error creating WDF doze timer - %!STATUS!",
+            status);
+
+        goto exit;
+    }
+
+    WDF_WORKITEM_CONFIG_INIT(&workItemConfig, OnDozeWorkItem);
+    workItemConfig.AutomaticSerialization = FALSE;
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = fxDevice;
+
+    status = WdfWorkItemCreate(
+        &workItemConfig,
+        &attributes,
+        &devContext->DozeWorkItem);
+
+    if (!NT_SUCCESS(status))
+    {
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_INIT,
+            "Error creating WDF doze work item - %!STATUS!",
+            status);
+
+        goto exit;
+    }
+
+    //
+    // Create the timer and work item unmasking interrupts after a storm
+    //
+    WDF_TIMER_CONFIG_INIT(&timerConfig, OnStormTimer);
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = fxDevice;
+
+    status = WdfTimerCreate(
+        &timerConfig,
+        &attributes,
+        &devContext->StormTimer);
+
+    if (!NT_SUCCESS(status))
+    {
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_INIT,
+            "Error creating WDF storm timer - %!STATUS!",
+            status);
+
+        goto exit;
+    }
+
+    WDF_WORKITEM_CONFIG_INIT(&workItemConfig, OnStormWorkItem);
+    workItemConfig.AutomaticSerialization = FALSE;
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = fxDevice;
+
+    status = WdfWorkItemCreate(
+        &workItemConfig,
+        &attributes,
+        &devContext->StormWorkItem);
+
+    if (!NT_SUCCESS(status))
+    {
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_INIT,
+            "Error creating WDF storm work item - %!STATUS!",
+            status);
+
+        goto exit;
+    }
+
 exit:
 
     return status;
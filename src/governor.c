@@ -0,0 +1,220 @@
+/*++
+    Copyright (c) Microsoft Corporation. All Rights Reserved.
+    Sample code. Dealpoint ID #843729.
+
+    Module Name:
+
+        governor.c
+
+    Abstract:
+
+        Switches the F12 reporting mode between continuous and reduced
+        reporting. Resting contacts let the controller report only on
+        change, cutting interrupts and bus traffic, while contacts in
+        motion or arriving and leaving bring back full rate reporting.
+
+    Environment:
+
+        Kernel mode
+
+    Revision History:
+
+--*/
+
+#include <compat.h>
+#include <controller.h>
+#include <rmiinternal.h>
+#include <spbtarget.h>
+#include <governor.tmh>
+
+VOID
+RmiGovernReportingMode(
+    IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+    IN RMI4_F11_DATA_REGISTERS* Data
+    )
+/*++
+
+  Routine Description:
+
+    Measures the motion of the contacts in a decoded frame and decides
+    which reporting mode the controller should be in. Contacts must stay
+    still for a number of frames before reporting is reduced, and must
+    move twice as far as the still threshold to restore continuous
+    reporting. Called with the processing lock held.
+
+  Arguments:
+
+    ControllerContext - Touch controller context
+    Data - The decoded frame
+
+  Return Value:
+
+    None.
+
+--*/
+{
+    RMI4_REPORTING_GOVERNOR* governor;
+    RMI4_CONFIGURATION* config;
+    int objectStatus[RMI4_MAX_TOUCHES] = { 0 };
+    UINT32 valid = 0;
+    int contacts = 0;
+    int motion = 0;
+    int dx, dy;
+    UCHAR desiredMode;
+    int i;
+
+    governor = &ControllerContext->Governor;
+    config = &ControllerContext->Config;
+
+    if (config->ReportingGovernorFrames == 0)
+    {
+        goto exit;
+    }
+
+    //
+    // Fingers and pens share the object slots of the frame
+    //
+    objectStatus[0] = Data->Status.FingerState0 | Data->Status.PenState0;
+    objectStatus[1] = Data->Status.FingerState1 | Data->Status.PenState1;
+    objectStatus[2] = Data->Status.FingerState2 | Data->Status.PenState2;
+    objectStatus[3] = Data->Status.FingerState3 | Data->Status.PenState3;
+    objectStatus[4] = Data->Status.FingerState4 | Data->Status.PenState4;
+    objectStatus[5] = Data->Status.FingerState5 | Data->Status.PenState5;
+    objectStatus[6] = Data->Status.FingerState6 | Data->Status.PenState6;
+    objectStatus[7] = Data->Status.FingerState7 | Data->Status.PenState7;
+    objectStatus[8] = Data->Status.FingerState8 | Data->Status.PenState8;
+    objectStatus[9] = Data->Status.FingerState9 | Data->Status.PenState9;
+
+    for (i = 0; i < RMI4_MAX_TOUCHES; i++)
+    {
+        if (objectStatus[i] == RMI4_FINGER_STATE_NOT_PRESENT)
+        {
+            continue;
+        }
+
+        valid |= (1 << i);
+        contacts++;
+
+        if (governor->LastValid & (1 << i))
+        {
+            dx = Data->Finger[i].X - governor->Last[i].X;
+            dy = Data->Finger[i].Y - governor->Last[i].Y;
+
+            motion = max(motion,
+                (dx < 0 ? -dx : dx) + (dy < 0 ? -dy : dy));
+        }
+
+        governor->Last[i] = Data->Finger[i];
+    }
+
+    desiredMode = governor->DesiredMode;
+
+    if (valid != governor->LastValid ||
+        motion > (int) config->ReportingGovernorMotion * 2)
+    {
+        //
+        // Contacts arrived, left or are moving
+        //
+        governor->StillFrames = 0;
+        desiredMode = RMI_F12_REPORTING_MODE_CONTINUOUS;
+    }
+    else if (motion <= (int) config->ReportingGovernorMotion)
+    {
+        governor->StillFrames++;
+
+        if (contacts != 0 &&
+            governor->StillFrames >= config->ReportingGovernorFrames)
+        {
+            desiredMode = RMI_F12_REPORTING_MODE_REDUCED;
+        }
+    }
+    else
+    {
+        //
+        // Between both thresholds the current mode is kept
+        //
+        governor->StillFrames = 0;
+    }
+
+    governor->LastValid = valid;
+
+    if (desiredMode != governor->DesiredMode)
+    {
+        Trace(
+            TRACE_LEVEL_VERBOSE,
+            TRACE_REPORTING,
+            "Asking for %s reporting, %d contacts, motion %d",
+            desiredMode == RMI_F12_REPORTING_MODE_REDUCED ?
+                "reduced" : "continuous",
+            contacts,
+            motion);
+
+        governor->DesiredMode = desiredMode;
+    }
+
+exit:
+
+    return;
+}
+
+VOID
+RmiApplyReportingMode(
+    IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+    IN SPB_CONTEXT *SpbContext
+    )
+/*++
+
+  Routine Description:
+
+    Programs the reporting mode decided by the processing stage, if it
+    differs from the current one. Only the shadowed F12_2D_Ctrl20 is
+    written. Called from the capture stage with the controller lock
+    held.
+
+  Arguments:
+
+    ControllerContext - Touch controller context
+    SpbContext - A pointer to the current i2c context
+
+  Return Value:
+
+    None.
+
+--*/
+{
+    RMI4_REPORTING_GOVERNOR* governor;
+    UCHAR desiredMode;
+    NTSTATUS status;
+
+    governor = &ControllerContext->Governor;
+    desiredMode = governor->DesiredMode;
+
+    if (desiredMode == governor->Mode)
+    {
+        goto exit;
+    }
+
+    status = RmiSetReportingMode(
+        ControllerContext,
+        SpbContext,
+        desiredMode,
+        NULL);
+
+    if (!NT_SUCCESS(status))
+    {
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_INTERRUPT,
+            "Could not change reporting mode - %!STATUS!",
+            status);
+
+        goto exit;
+    }
+
+    governor->Mode = desiredMode;
+    governor->Switches++;
+
+exit:
+
+    return;
+}
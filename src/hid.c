@@ -14,6 +14,7 @@
 const UCHAR gReportDescriptor[] = {
 	SYNAPTICS_TOUCHSCREEN_TLC,
     SYNAPTICS_PEN_TLC,
+	SYNAPTICS_KEYPAD_TLC,
 	SYNAPTICS_CONFIGURATION_TLC
 };
 const ULONG gdwcbReportDescriptor = sizeof(gReportDescriptor);
@@ -92,17 +93,12 @@ Return Value:
     //
     if (devContext->ServiceInterruptsAfterD0Entry == TRUE)
     {
-		DEV_REPORT ptpReport;
-        BOOLEAN servicingComplete = FALSE;
-
-        while (servicingComplete == FALSE)
+        if (NT_SUCCESS(TchCaptureInterrupts(
+            devContext->TouchContext,
+            &devContext->I2CContext,
+            KeQueryInterruptTime())))
         {
-            TchServiceInterrupts(
-                devContext->TouchContext,
-                &devContext->I2CContext,
-                &ptpReport,
-                devContext->InputMode,
-                &servicingComplete);
+            WdfWorkItemEnqueue(devContext->ProcessingWorkItem);
         }
 
         devContext->ServiceInterruptsAfterD0Entry = FALSE;
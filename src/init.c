@@ -20,7 +20,7 @@
 
 #include <compat.h>
 #include <rmiinternal.h>
-#include <spb.h>
+#include <spbtarget.h>
 #include <init.tmh>
 
 
@@ -82,35 +82,63 @@ RmiChangePage(
         if (NT_SUCCESS(status))
         {
             ControllerContext->CurrentPage = DesiredPage;
+            ControllerContext->PageSelectWrites++;
         }
     }
 
     return status;
 }
 
-int
-RmiGetFunctionIndex(
-    IN RMI4_FUNCTION_DESCRIPTOR* FunctionDescriptors,
-    IN int FunctionCount,
-    IN int FunctionDesired
+VOID
+RmiBatchInitialize(
+    IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+    OUT RMI4_WRITE_BATCH* Batch
     )
 /*++
  
   Routine Description:
 
-    Returns the descriptor table index that corresponds to the
-    desired RMI function.
+    Starts an empty batch of register writes from the currently
+    selected register page.
 
   Arguments:
 
-    FunctionDescriptors - A pointer to the touch controllers
-    full list of function descriptors
-    
-    FunctionCount - The count of function descriptors contained
-    in the above FunctionDescriptors list
+    ControllerContext - A pointer to the current touch controller context
+    Batch - The batch to initialize
 
-    FunctionDesired - The RMI function number (note they are always
-    in hexadecimal the RMI4 specification)
+  Return Value:
+
+    None
+
+--*/
+{
+    SpbSequenceInitialize(&Batch->Sequence);
+    Batch->Page = ControllerContext->CurrentPage;
+    Batch->PageSelects = 0;
+}
+
+NTSTATUS
+RmiBatchAddWrite(
+    IN RMI4_WRITE_BATCH* Batch,
+    IN int Page,
+    IN UCHAR Address,
+    IN PVOID Data,
+    IN ULONG Length
+    )
+/*++
+ 
+  Routine Description:
+
+    Queues a register write, preceded by a page select if the register
+    lives on another page than the previous write of the batch.
+
+  Arguments:
+
+    Batch - The batch to append to
+    Page - The register page the write targets
+    Address - The register address within the page
+    Data - The data to write
+    Length - The amount of data to be written
 
   Return Value:
 
@@ -118,66 +146,287 @@ RmiGetFunctionIndex(
 
 --*/
 {
-    UCHAR i;
+    BYTE page;
+    NTSTATUS status;
 
-    for (i=0; i < FunctionCount; i++)
+    if (Batch->Page != Page)
+    {
+        page = (BYTE) Page;
+
+        status = SpbSequenceAddWrite(
+            &Batch->Sequence,
+            RMI4_PAGE_SELECT_ADDRESS,
+            &page,
+            sizeof(BYTE));
+
+        if (!NT_SUCCESS(status))
+        {
+            goto exit;
+        }
+
+        Batch->Page = Page;
+        Batch->PageSelects++;
+    }
+
+    status = SpbSequenceAddWrite(
+        &Batch->Sequence,
+        Address,
+        Data,
+        Length);
+
+exit:
+
+    return status;
+}
+
+NTSTATUS
+RmiBatchExecute(
+    IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+    IN SPB_CONTEXT* SpbContext,
+    IN RMI4_WRITE_BATCH* Batch
+    )
+/*++
+ 
+  Routine Description:
+
+    Sends a batch of register writes to the controller in one request.
+
+  Arguments:
+
+    ControllerContext - A pointer to the current touch controller context
+    SpbContext - A pointer to the current i2c context
+    Batch - The batch to execute
+
+  Return Value:
+
+    NTSTATUS indicating success or failure
+
+--*/
+{
+    NTSTATUS status;
+
+    status = SpbSequenceExecute(
+        SpbContext,
+        &Batch->Sequence);
+
+    if (NT_SUCCESS(status))
+    {
+        ControllerContext->CurrentPage = Batch->Page;
+        ControllerContext->PageSelectWrites += Batch->PageSelects;
+    }
+    else
     {
         //
-        // Break if we found the index
+        // Part of the batch may have gone through, the selected page
+        // is unknown
         //
-        if (FunctionDescriptors[i].Number == FunctionDesired)
-        {     
-             break;
+        ControllerContext->CurrentPage = RMI4_INVALID_PAGE;
+    }
+
+    return status;
+}
+
+VOID
+RmiBuildInterruptMap(
+    IN RMI4_CONTROLLER_CONTEXT* ControllerContext
+    )
+/*++
+ 
+  Routine Description:
+
+    Assigns the interrupt sources of the discovered functions. Sources
+    are numbered in PDT order, so firmware placing its functions
+    differently keeps being serviced correctly.
+
+  Arguments:
+
+    ControllerContext - A pointer to the current touch controller context
+
+  Return Value:
+
+    None
+
+--*/
+{
+    RMI4_INTERRUPT_MAP* map;
+    ULONG count;
+    ULONG mask;
+    int i;
+
+    map = &ControllerContext->Interrupts;
+    RtlZeroMemory(map, sizeof(RMI4_INTERRUPT_MAP));
+
+    for (i = 0; i < ControllerContext->FunctionCount; i++)
+    {
+        count = ControllerContext->Descriptors[i].VersionIrq.IrqCount;
+
+        if (map->SourceCount + count > RMI4_MAX_INTERRUPT_REGISTERS * 8)
+        {
+            Trace(
+                TRACE_LEVEL_ERROR,
+                TRACE_INIT,
+                "Interrupt sources of function $%x exceed the driver limit",
+                ControllerContext->Descriptors[i].Number);
+
+            break;
+        }
+
+        mask = ((1UL << count) - 1) << map->SourceCount;
+
+        map->FunctionMask[i] = mask;
+        map->SourceCount += count;
+
+        switch (ControllerContext->Descriptors[i].Number)
+        {
+            case RMI4_F01_RMI_DEVICE_CONTROL:
+            {
+                map->DeviceStatus |= mask;
+                break;
+            }
+            case RMI4_F12_2D_TOUCHPAD_SENSOR:
+            {
+                map->Touch |= mask;
+                break;
+            }
+            case RMI4_F1A_0D_CAP_BUTTON_SENSOR:
+            {
+                map->Buttons |= mask;
+                break;
+            }
+            default:
+            {
+                break;
+            }
         }
+
+        Trace(
+            TRACE_LEVEL_VERBOSE,
+            TRACE_INIT,
+            "Function $%x owns interrupt mask 0x%x",
+            ControllerContext->Descriptors[i].Number,
+            mask);
     }
 
     //
-    // Return the count if the index wasn't found
+    // Device status changes must raise the attention line, so that a
+    // controller which lost its configuration gets it back
     //
-    return i;
+    map->Serviced = map->DeviceStatus | map->Touch | map->Buttons;
+    map->Registers = max((map->SourceCount + 7) / 8, 1);
+}
+
+ULONG
+RmiUnpackInterruptMask(
+    IN BYTE* Registers,
+    IN ULONG Count
+    )
+/*++
+ 
+  Routine Description:
+
+    Assembles an interrupt mask from consecutive F01 interrupt status or
+    enable registers, the first one holding the lowest sources.
+
+  Arguments:
+
+    Registers - The register bytes
+
+    Count - The number of registers
+
+  Return Value:
+
+    The interrupt mask
+
+--*/
+{
+    ULONG mask = 0;
+    ULONG i;
+
+    for (i = 0; i < Count; i++)
+    {
+        mask |= (ULONG) Registers[i] << (i * 8);
+    }
+
+    return mask;
+}
+
+VOID
+RmiPackInterruptMask(
+    IN ULONG Mask,
+    OUT BYTE* Registers,
+    IN ULONG Count
+    )
+/*++
+ 
+  Routine Description:
+
+    Splits an interrupt mask into consecutive F01 interrupt registers,
+    the first one holding the lowest sources.
+
+  Arguments:
+
+    Mask - The interrupt mask
+
+    Registers - Receives the register bytes
+
+    Count - The number of registers
+
+  Return Value:
+
+    None
+
+--*/
+{
+    ULONG i;
+
+    for (i = 0; i < Count; i++)
+    {
+        Registers[i] = (BYTE) (Mask >> (i * 8));
+    }
 }
 
 NTSTATUS
-RmiGetFirmwareVersion(
-    IN RMI4_CONTROLLER_CONTEXT *ControllerContext,
-    IN SPB_CONTEXT *SpbContext
+RmiReadF01Control(
+    IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+    IN SPB_CONTEXT *SpbContext,
+    OUT RMI4_F01_CTRL_REGISTERS* Control
     )
 /*++
  
   Routine Description:
 
-    This function queries the firmware version of the current chip for
-    debugging purposes.
+    Reads the F01 control registers. Their layout depends on the number
+    of interrupt enable registers, so the doze registers are read from
+    behind the last one.
 
   Arguments:
 
     ControllerContext - A pointer to the current touch controller context
+
     SpbContext - A pointer to the current i2c context
 
+    Control - Receives the control registers
+
   Return Value:
 
     NTSTATUS indicating success or failure
 
 --*/
 {
+    ULONG registers;
     int index;
     NTSTATUS status;
 
-    //
-    // Find RMI device control function and configure it
-    // 
+    RtlZeroMemory(Control, sizeof(RMI4_F01_CTRL_REGISTERS));
+    registers = ControllerContext->Interrupts.Registers;
+
     index = RmiGetFunctionIndex(
         ControllerContext->Descriptors,
         ControllerContext->FunctionCount,
         RMI4_F01_RMI_DEVICE_CONTROL);
 
-    if (index == ControllerContext->FunctionCount)
+    if (index == ControllerContext->FunctionCount || registers == 0)
     {
-        Trace(
-            TRACE_LEVEL_ERROR,
-            TRACE_INIT,
-            "Unexpected - RMI Function 01 missing");
-
         status = STATUS_INVALID_DEVICE_STATE;
         goto exit;
     }
@@ -189,326 +438,1879 @@ RmiGetFirmwareVersion(
 
     if (!NT_SUCCESS(status))
     {
-        Trace(
-            TRACE_LEVEL_ERROR,
-            TRACE_INIT,
-            "Could not change register page");
-
         goto exit;
     }
 
-    //
-    // Store all F01 query registers, which contain the product ID
-    //
-    // TODO: Fix transfer size when SPB can support larger I2C 
-    //       transactions
-    //
     status = SpbReadDataSynchronously(
         SpbContext,
-        ControllerContext->Descriptors[index].QueryBase,
-        &ControllerContext->F01QueryRegisters,
-        sizeof(BYTE) * FIELD_OFFSET(RMI4_F01_QUERY_REGISTERS, ProductID10));
+        ControllerContext->Descriptors[index].ControlBase,
+        Control,
+        FIELD_OFFSET(RMI4_F01_CTRL_REGISTERS, InterruptEnable) + registers);
 
     if (!NT_SUCCESS(status))
     {
-        Trace(
-            TRACE_LEVEL_ERROR,
-            TRACE_INIT,
-            "Error reading RMI F01 Query registers - %!STATUS!",
-            status);
-
         goto exit;
     }
 
+    status = SpbReadDataSynchronously(
+        SpbContext,
+        (UCHAR) (ControllerContext->Descriptors[index].ControlBase +
+            FIELD_OFFSET(RMI4_F01_CTRL_REGISTERS, InterruptEnable) + registers),
+        &Control->DozeInterval,
+        RMI4_F01_DOZE_REGISTERS_SIZE);
+
 exit:
 
     return status;
 }
 
-VOID
-RmiConvertF01ToPhysical(
-    IN RMI4_F01_CTRL_REGISTERS_LOGICAL* Logical,
-    IN RMI4_F01_CTRL_REGISTERS* Physical
+NTSTATUS
+RmiBatchAddF01Control(
+    IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+    IN RMI4_WRITE_BATCH* Batch,
+    IN RMI4_F01_CTRL_REGISTERS* Control
     )
 /*++
  
   Routine Description:
 
-    Registry configuration values for F01 must be specified as
-    4-byte REG_DWORD values logically, however the chip interprets these
-    values as bits or bytes physically. This function converts
-    the registry parameters into a structure that can be programmed
-    into the controller's memory.
+    Queues a write of the F01 control registers, placing the doze
+    registers behind the interrupt enable registers the chip has.
 
   Arguments:
 
-    Logical - a pointer to the logical settings
+    ControllerContext - A pointer to the current touch controller context
 
-    Physical - a pointer to the controller memory-mapped structure
+    Batch - The batch to queue the write to
+
+    Control - The control registers to write, must stay valid until
+    the batch is executed
 
   Return Value:
 
-    None. Function may print warnings in the future when truncating.
+    NTSTATUS indicating success or failure
 
 --*/
 {
-    RtlZeroMemory(Physical, sizeof(RMI4_F01_CTRL_REGISTERS));
+    ULONG registers;
+    int index;
+    NTSTATUS status;
 
-    //
-    // Note that truncation of registry values is possible if 
-    // the data was incorrectly provided by the OEM, we may
-    // print warning messages in the future.
-    // 
+    registers = ControllerContext->Interrupts.Registers;
 
-    Physical->DeviceControl.SleepMode  = LOGICAL_TO_PHYSICAL(Logical->SleepMode);
-    Physical->DeviceControl.NoSleep    = LOGICAL_TO_PHYSICAL(Logical->NoSleep);
-    Physical->DeviceControl.ReportRate = LOGICAL_TO_PHYSICAL(Logical->ReportRate);
-    Physical->DeviceControl.Configured = LOGICAL_TO_PHYSICAL(Logical->Configured);
+    index = RmiGetFunctionIndex(
+        ControllerContext->Descriptors,
+        ControllerContext->FunctionCount,
+        RMI4_F01_RMI_DEVICE_CONTROL);
 
-    Physical->InterruptEnable = LOGICAL_TO_PHYSICAL(Logical->InterruptEnable);
-    Physical->DozeInterval    = LOGICAL_TO_PHYSICAL(Logical->DozeInterval);
+    if (index == ControllerContext->FunctionCount || registers == 0)
+    {
+        status = STATUS_INVALID_DEVICE_STATE;
+        goto exit;
+    }
+
+    status = RmiBatchAddWrite(
+        Batch,
+        ControllerContext->FunctionOnPage[index],
+        ControllerContext->Descriptors[index].ControlBase,
+        Control,
+        FIELD_OFFSET(RMI4_F01_CTRL_REGISTERS, InterruptEnable) + registers);
+
+    if (!NT_SUCCESS(status))
+    {
+        goto exit;
+    }
+
+    status = RmiBatchAddWrite(
+        Batch,
+        ControllerContext->FunctionOnPage[index],
+        (UCHAR) (ControllerContext->Descriptors[index].ControlBase +
+            FIELD_OFFSET(RMI4_F01_CTRL_REGISTERS, InterruptEnable) + registers),
+        &Control->DozeInterval,
+        RMI4_F01_DOZE_REGISTERS_SIZE);
+
+exit:
+
+    return status;
+}
+
+//
+// Function whose registers each service access reads
+//
+static const int gServiceAccessFunction[RmiServiceAccessMax] =
+{
+    RMI4_F01_RMI_DEVICE_CONTROL,    // RmiServiceAccessStatus
+    RMI4_F12_2D_TOUCHPAD_SENSOR,    // RmiServiceAccessTouchData
+};
+
+//
+// Accesses each service access has to follow. Reading the F01 interrupt
+// status clears it, a frame signaled between an earlier data read and
+// the status read would be acknowledged without its data ever being
+// read, so the F12 data never goes ahead of the status.
+//
+static const ULONG gServiceAccessPrerequisites[RmiServiceAccessMax] =
+{
+    0,                              // RmiServiceAccessStatus
+    1 << RmiServiceAccessStatus,    // RmiServiceAccessTouchData
+};
+
+int
+RmiGetServiceAccessPage(
+    IN RMI4_SERVICE_ACCESS Access,
+    IN RMI4_FUNCTION_DESCRIPTOR* Descriptors,
+    IN int* FunctionOnPage,
+    IN int FunctionCount
+    )
+/*++
+ 
+  Routine Description:
+
+    Returns the register page a service access reads from.
+
+  Arguments:
+
+    Access - The service access
+
+    Descriptors - The function descriptors of the layout
+
+    FunctionOnPage - The page of each function of the layout
+
+    FunctionCount - The number of functions of the layout
+
+  Return Value:
+
+    The register page, 0 if the function is not present
+
+--*/
+{
+    int index;
+
+    index = RmiGetFunctionIndex(
+        Descriptors,
+        FunctionCount,
+        gServiceAccessFunction[Access]);
+
+    return (index == FunctionCount) ? 0 : FunctionOnPage[index];
+}
+
+VOID
+RmiBuildServicePlan(
+    IN RMI4_CONTROLLER_CONTEXT* ControllerContext
+    )
+/*++
+ 
+  Routine Description:
+
+    Plans the register accesses of an interrupt service cycle for the
+    discovered layout. Accesses are grouped by the page their function
+    lives on as far as the order they must follow allows, so a cycle
+    selects as few pages as possible.
+
+  Arguments:
+
+    ControllerContext - A pointer to the current touch controller context
+
+  Return Value:
+
+    None
+
+--*/
+{
+    RMI4_SERVICE_PLAN* plan;
+    ULONG placed;
+    int access;
+    int next;
+    int nextPage;
+    int page;
+    int i;
+
+    plan = &ControllerContext->ServicePlan;
+    plan->Count = 0;
+    placed = 0;
+    page = ControllerContext->CurrentPage;
+
+    while (plan->Count < RmiServiceAccessMax)
+    {
+        next = RmiServiceAccessMax;
+        nextPage = 0;
+
+        //
+        // Among the accesses whose prerequisites are planned, stay on
+        // the page of the previous one, or else go to the lowest page
+        //
+        for (access = 0; access < RmiServiceAccessMax; access++)
+        {
+            if ((placed & (1 << access)) ||
+                (gServiceAccessPrerequisites[access] & ~placed))
+            {
+                continue;
+            }
+
+            i = RmiGetServiceAccessPage(
+                (RMI4_SERVICE_ACCESS) access,
+                ControllerContext->Descriptors,
+                ControllerContext->FunctionOnPage,
+                ControllerContext->FunctionCount);
+
+            if (next == RmiServiceAccessMax ||
+                (nextPage != page && (i == page || i < nextPage)))
+            {
+                next = access;
+                nextPage = i;
+            }
+        }
+
+        plan->Access[plan->Count] = (RMI4_SERVICE_ACCESS) next;
+        plan->Page[plan->Count] = nextPage;
+        plan->Count++;
+        placed |= 1 << next;
+        page = nextPage;
+    }
+
+    for (i = 0; i < plan->Count; i++)
+    {
+        Trace(
+            TRACE_LEVEL_VERBOSE,
+            TRACE_INIT,
+            "Service step %d - access %d on page %d",
+            i,
+            plan->Access[i],
+            plan->Page[i]);
+    }
+}
+
+BOOLEAN
+RmiServicePlanMatchesLayout(
+    IN RMI4_SERVICE_PLAN* Plan,
+    IN RMI4_FUNCTION_DESCRIPTOR* Descriptors,
+    IN int* FunctionOnPage,
+    IN int FunctionCount
+    )
+/*++
+ 
+  Routine Description:
+
+    Checks that a stored service plan holds every access once, after
+    its prerequisites and on the page its function lives on in the given
+    layout.
+
+  Arguments:
+
+    Plan - The stored service plan
+
+    Descriptors - The function descriptors of the layout
+
+    FunctionOnPage - The page of each function of the layout
+
+    FunctionCount - The number of functions of the layout
+
+  Return Value:
+
+    TRUE if the plan can be used for the layout
+
+--*/
+{
+    ULONG seen = 0;
+    int i;
+
+    if (Plan->Count != RmiServiceAccessMax)
+    {
+        return FALSE;
+    }
+
+    for (i = 0; i < Plan->Count; i++)
+    {
+        if (Plan->Access[i] < 0 ||
+            Plan->Access[i] >= RmiServiceAccessMax ||
+            (seen & (1 << Plan->Access[i])) ||
+            (gServiceAccessPrerequisites[Plan->Access[i]] & ~seen) ||
+            Plan->Page[i] != RmiGetServiceAccessPage(
+                Plan->Access[i],
+                Descriptors,
+                FunctionOnPage,
+                FunctionCount))
+        {
+            return FALSE;
+        }
+
+        seen |= 1 << Plan->Access[i];
+    }
+
+    return TRUE;
+}
+
+int
+RmiGetServiceOrder(
+    IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+    IN ULONG AccessMask,
+    OUT RMI4_SERVICE_ACCESS* Order
+    )
+/*++
+ 
+  Routine Description:
+
+    Orders the accesses needed by a service cycle. The planned sequence
+    is entered at the first access on the currently selected page, so
+    the cycle starts where the previous one left off, unless that would
+    move a needed access ahead of one of its prerequisites.
+
+  Arguments:
+
+    ControllerContext - A pointer to the current touch controller context
+
+    AccessMask - Bit mask of the RMI4_SERVICE_ACCESS values needed
+
+    Order - Receives the accesses in execution order
+
+  Return Value:
+
+    The number of accesses returned
+
+--*/
+{
+    RMI4_SERVICE_PLAN* plan;
+    ULONG wrapped;
+    int start;
+    int count;
+    int i;
+    int j;
+
+    plan = &ControllerContext->ServicePlan;
+
+    for (start = 0; start < plan->Count; start++)
+    {
+        if (plan->Page[start] != ControllerContext->CurrentPage)
+        {
+            continue;
+        }
+
+        //
+        // The needed accesses ahead of the entry are wrapped around to
+        // the end, none of the others may depend on them
+        //
+        wrapped = 0;
+        for (i = 0; i < start; i++)
+        {
+            wrapped |= AccessMask & (1 << plan->Access[i]);
+        }
+
+        for (i = start; i < plan->Count; i++)
+        {
+            if ((AccessMask & (1 << plan->Access[i])) &&
+                (gServiceAccessPrerequisites[plan->Access[i]] & wrapped))
+            {
+                break;
+            }
+        }
+
+        if (i == plan->Count)
+        {
+            break;
+        }
+    }
+
+    if (start == plan->Count)
+    {
+        start = 0;
+    }
+
+    count = 0;
+    for (i = 0; i < plan->Count; i++)
+    {
+        j = (start + i) % plan->Count;
+
+        if (AccessMask & (1 << plan->Access[j]))
+        {
+            Order[count++] = plan->Access[j];
+        }
+    }
+
+    return count;
+}
+
+int
+RmiGetFunctionIndex(
+    IN RMI4_FUNCTION_DESCRIPTOR* FunctionDescriptors,
+    IN int FunctionCount,
+    IN int FunctionDesired
+    )
+/*++
+ 
+  Routine Description:
+
+    Returns the descriptor table index that corresponds to the
+    desired RMI function.
+
+  Arguments:
+
+    FunctionDescriptors - A pointer to the touch controllers
+    full list of function descriptors
+    
+    FunctionCount - The count of function descriptors contained
+    in the above FunctionDescriptors list
+
+    FunctionDesired - The RMI function number (note they are always
+    in hexadecimal the RMI4 specification)
+
+  Return Value:
+
+    NTSTATUS indicating success or failure
+
+--*/
+{
+    UCHAR i;
+
+    for (i=0; i < FunctionCount; i++)
+    {
+        //
+        // Break if we found the index
+        //
+        if (FunctionDescriptors[i].Number == FunctionDesired)
+        {     
+             break;
+        }
+    }
+
+    //
+    // Return the count if the index wasn't found
+    //
+    return i;
+}
+
+NTSTATUS
+RmiGetFirmwareVersion(
+    IN RMI4_CONTROLLER_CONTEXT *ControllerContext,
+    IN SPB_CONTEXT *SpbContext
+    )
+/*++
+ 
+  Routine Description:
+
+    This function queries the firmware version of the current chip for
+    debugging purposes.
+
+  Arguments:
+
+    ControllerContext - A pointer to the current touch controller context
+    SpbContext - A pointer to the current i2c context
+
+  Return Value:
+
+    NTSTATUS indicating success or failure
+
+--*/
+{
+    int index;
+    NTSTATUS status;
+
+    //
+    // Find RMI device control function and configure it
+    // 
+    index = RmiGetFunctionIndex(
+        ControllerContext->Descriptors,
+        ControllerContext->FunctionCount,
+        RMI4_F01_RMI_DEVICE_CONTROL);
+
+    if (index == ControllerContext->FunctionCount)
+    {
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_INIT,
+            "Unexpected - RMI Function 01 missing");
+
+        status = STATUS_INVALID_DEVICE_STATE;
+        goto exit;
+    }
+
+    status = RmiChangePage(
+        ControllerContext,
+        SpbContext,
+        ControllerContext->FunctionOnPage[index]);
+
+    if (!NT_SUCCESS(status))
+    {
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_INIT,
+            "Could not change register page");
+
+        goto exit;
+    }
+
+    //
+    // Store all F01 query registers, which contain the product ID
+    //
+    // TODO: Fix transfer size when SPB can support larger I2C 
+    //       transactions
+    //
+    status = SpbReadDataSynchronously(
+        SpbContext,
+        ControllerContext->Descriptors[index].QueryBase,
+        &ControllerContext->F01QueryRegisters,
+        RMI4_F01_IDENTITY_SIZE);
+
+    if (!NT_SUCCESS(status))
+    {
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_INIT,
+            "Error reading RMI F01 Query registers - %!STATUS!",
+            status);
+
+        goto exit;
+    }
+
+exit:
+
+    return status;
+}
+
+VOID
+RmiConvertF01ToPhysical(
+    IN RMI4_F01_CTRL_REGISTERS_LOGICAL* Logical,
+    IN RMI4_F01_CTRL_REGISTERS* Physical
+    )
+/*++
+ 
+  Routine Description:
+
+    Registry configuration values for F01 must be specified as
+    4-byte REG_DWORD values logically, however the chip interprets these
+    values as bits or bytes physically. This function converts
+    the registry parameters into a structure that can be programmed
+    into the controller's memory.
+
+  Arguments:
+
+    Logical - a pointer to the logical settings
+
+    Physical - a pointer to the controller memory-mapped structure
+
+  Return Value:
+
+    None. Function may print warnings in the future when truncating.
+
+--*/
+{
+    RtlZeroMemory(Physical, sizeof(RMI4_F01_CTRL_REGISTERS));
+
+    //
+    // Note that truncation of registry values is possible if 
+    // the data was incorrectly provided by the OEM, we may
+    // print warning messages in the future.
+    // 
+
+    Physical->DeviceControl.SleepMode  = LOGICAL_TO_PHYSICAL(Logical->SleepMode);
+    Physical->DeviceControl.NoSleep    = LOGICAL_TO_PHYSICAL(Logical->NoSleep);
+    Physical->DeviceControl.ReportRate = LOGICAL_TO_PHYSICAL(Logical->ReportRate);
+    Physical->DeviceControl.Configured = LOGICAL_TO_PHYSICAL(Logical->Configured);
+
+    //
+    // InterruptEnable is a mask of sources the OEM allows, it is narrowed
+    // to the serviced sources and programmed by RmiConfigureFunctions
+    //
+    Physical->DozeInterval    = LOGICAL_TO_PHYSICAL(Logical->DozeInterval);
     Physical->DozeThreshold   = LOGICAL_TO_PHYSICAL(Logical->DozeThreshold);
     Physical->DozeHoldoff     = LOGICAL_TO_PHYSICAL(Logical->DozeHoldoff);
 }
 
-NTSTATUS
-RmiReadRegisterDescriptor(
-	IN SPB_CONTEXT *Context,
-	IN UCHAR Address,
-	IN PRMI_REGISTER_DESCRIPTOR Rdesc
+VOID
+RmiArenaReset(
+    IN RMI4_ARENA *Arena
+    )
+/*++
+ 
+  Routine Description:
+
+    Releases every allocation made from the discovery arena at once,
+    keeping its backing storage for the next discovery.
+
+  Arguments:
+
+    Arena - The arena to reset
+
+  Return Value:
+
+    None
+
+--*/
+{
+    Arena->Used = 0;
+    Arena->Requested = 0;
+}
+
+NTSTATUS
+RmiArenaReserve(
+    IN RMI4_ARENA *Arena,
+    IN SIZE_T Size
+    )
+/*++
+ 
+  Routine Description:
+
+    Makes sure the arena can hold Size bytes. Growing replaces the
+    backing storage, so it is only allowed while the arena is empty.
+
+  Arguments:
+
+    Arena - The arena to grow
+    Size - Capacity required, in bytes
+
+  Return Value:
+
+    NTSTATUS indicating success or failure
+
+--*/
+{
+    PUCHAR base;
+
+    if (Size <= Arena->Size)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    if (Arena->Used != 0)
+    {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    base = ExAllocatePoolWithTag(
+        NonPagedPoolNx,
+        Size,
+        TOUCH_POOL_TAG_F12);
+
+    if (base == NULL)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RmiArenaFree(Arena);
+
+    Arena->Base = base;
+    Arena->Size = Size;
+
+    return STATUS_SUCCESS;
+}
+
+PVOID
+RmiArenaAllocate(
+    IN RMI4_ARENA *Arena,
+    IN SIZE_T Size
+    )
+/*++
+ 
+  Routine Description:
+
+    Carves a zeroed block out of the arena. Requests are accounted even
+    when they do not fit, so a failed discovery knows how large the
+    arena must be for the retry.
+
+  Arguments:
+
+    Arena - The arena to allocate from
+    Size - Size of the block, in bytes
+
+  Return Value:
+
+    The block, or NULL if the arena is exhausted
+
+--*/
+{
+    PVOID block;
+
+    Size = ALIGN_UP_BY(Size, MEMORY_ALLOCATION_ALIGNMENT);
+    Arena->Requested += Size;
+
+    if (Arena->Base == NULL || Size > Arena->Size - Arena->Used)
+    {
+        return NULL;
+    }
+
+    block = Arena->Base + Arena->Used;
+    Arena->Used += Size;
+
+    RtlZeroMemory(block, Size);
+
+    return block;
+}
+
+VOID
+RmiArenaFree(
+    IN RMI4_ARENA *Arena
+    )
+/*++
+ 
+  Routine Description:
+
+    Returns the arena backing storage to pool.
+
+  Arguments:
+
+    Arena - The arena to free
+
+  Return Value:
+
+    None
+
+--*/
+{
+    if (Arena->Base != NULL)
+    {
+        ExFreePoolWithTag(Arena->Base, TOUCH_POOL_TAG_F12);
+    }
+
+    RtlZeroMemory(Arena, sizeof(RMI4_ARENA));
+}
+
+NTSTATUS
+RmiParseRegisterDescriptorHeader(
+	IN BYTE *Buffer,
+	IN ULONG Length,
+	IN PRMI_REGISTER_DESCRIPTOR Rdesc,
+	OUT ULONG *StructOffset
+)
+/*++
+
+  Routine Description:
+
+    Parses the size of presence and presence registers of a register
+    descriptor held in memory.
+
+  Arguments:
+
+    Buffer - Descriptor bytes, starting at the size of presence register
+    Length - Number of valid bytes in Buffer
+    Rdesc - Descriptor receiving the structure size and presence map
+    StructOffset - Receives the offset of the register structure in Buffer
+
+  Return Value:
+
+    STATUS_BUFFER_TOO_SMALL if Buffer does not hold the whole header,
+    otherwise NTSTATUS indicating success or failure
+
+--*/
+{
+	BYTE size_presence_reg;
+	BYTE *buf;
+	int presense_offset = 1;
+	int map_offset = 0;
+	int i;
+	int b;
+
+	if (Length < 1)
+	{
+		return STATUS_BUFFER_TOO_SMALL;
+	}
+
+	size_presence_reg = Buffer[0];
+
+	if (size_presence_reg < 1 || size_presence_reg > RMI_REG_DESC_PRESENCE_MAX_SIZE)
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			TRACE_INIT,
+			"size_presence_reg has invalid size, either less than 1 or larger than %d",
+			RMI_REG_DESC_PRESENCE_MAX_SIZE);
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	if (Length < 1 + (ULONG) size_presence_reg)
+	{
+		return STATUS_BUFFER_TOO_SMALL;
+	}
+
+	/*
+	* The presence register contains the size of the register structure
+	* and a bitmap which identified which packet registers are present
+	* for this particular register type (ie query, control, or data).
+	*/
+	buf = &Buffer[1];
+
+	if (buf[0] == 0)
+	{
+		if (size_presence_reg < 3)
+		{
+			return STATUS_INVALID_PARAMETER;
+		}
+
+		presense_offset = 3;
+		Rdesc->StructSize = buf[1] | (buf[2] << 8);
+	}
+	else
+	{
+		Rdesc->StructSize = buf[0];
+	}
+
+	RtlZeroMemory(Rdesc->PresenceMap, sizeof(Rdesc->PresenceMap));
+
+	for (i = presense_offset; i < size_presence_reg; i++)
+	{
+		for (b = 0; b < 8; b++)
+		{
+			if (buf[i] & (0x1 << b)) bitmap_set(Rdesc->PresenceMap, map_offset, 1);
+			++map_offset;
+		}
+	}
+
+	Rdesc->NumRegisters = (UINT8) bitmap_weight(Rdesc->PresenceMap, RMI_REG_DESC_PRESENSE_BITS);
+	*StructOffset = 1 + size_presence_reg;
+
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS
+RmiParseRegisterDescriptorItems(
+	IN BYTE *struct_buf,
+	IN PRMI_REGISTER_DESCRIPTOR Rdesc
+)
+/*++
+
+  Routine Description:
+
+    Parses the register structure of a register descriptor held in
+    memory into the list of packet registers. The descriptor header
+    must have been parsed and its Registers array allocated already.
+
+  Arguments:
+
+    struct_buf - Register structure bytes, Rdesc->StructSize long
+    Rdesc - Descriptor receiving the packet register list
+
+  Return Value:
+
+    NTSTATUS indicating success or failure
+
+--*/
+{
+	ULONG offset = 0;
+	int reg;
+	int map_offset;
+	int i;
+	int b;
+
+	/*
+	* The register structure contains information about every packet
+	* register of this type. This includes the size of the packet
+	* register and a bitmap of all subpackets contained in the packet
+	* register.
+	*/
+	reg = find_first_bit(Rdesc->PresenceMap, RMI_REG_DESC_PRESENSE_BITS);
+	for (i = 0; i < Rdesc->NumRegisters; i++)
+	{
+		PRMI_REGISTER_DESC_ITEM item = &Rdesc->Registers[i];
+		ULONG reg_size;
+
+		if (offset >= Rdesc->StructSize) goto malformed;
+		reg_size = struct_buf[offset];
+
+		++offset;
+		if (reg_size == 0)
+		{
+			if (offset + 2 > Rdesc->StructSize) goto malformed;
+			reg_size = struct_buf[offset] |
+				(struct_buf[offset + 1] << 8);
+			offset += 2;
+		}
+
+		if (reg_size == 0)
+		{
+			if (offset + 4 > Rdesc->StructSize) goto malformed;
+			reg_size = struct_buf[offset] |
+				(struct_buf[offset + 1] << 8) |
+				(struct_buf[offset + 2] << 16) |
+				(struct_buf[offset + 3] << 24);
+			offset += 4;
+		}
+
+		item->Register = (USHORT) reg;
+		item->RegisterSize = reg_size;
+
+		map_offset = 0;
+
+		do {
+			if (offset >= Rdesc->StructSize) goto malformed;
+			for (b = 0; b < 7; b++) {
+				if ((struct_buf[offset] & (0x1 << b)) &&
+					map_offset < RMI_REG_DESC_SUBPACKET_BITS)
+					bitmap_set(item->SubPacketMap, map_offset, 1);
+				++map_offset;
+			}
+		} while (struct_buf[offset++] & 0x80);
+
+		item->NumSubPackets = (BYTE) bitmap_weight(item->SubPacketMap, RMI_REG_DESC_SUBPACKET_BITS);
+
+		Trace(
+			TRACE_LEVEL_INFORMATION,
+			TRACE_INIT,
+			"%s: reg: %d reg size: %ld subpackets: %d\n",
+			__func__,
+			item->Register, item->RegisterSize, item->NumSubPackets
+		);
+
+		reg = find_next_bit(Rdesc->PresenceMap, RMI_REG_DESC_PRESENSE_BITS, reg + 1);
+	}
+
+	return STATUS_SUCCESS;
+
+malformed:
+	Trace(
+		TRACE_LEVEL_ERROR,
+		TRACE_INIT,
+		"Register structure of %ld bytes is truncated at register %d",
+		Rdesc->StructSize,
+		i);
+
+	return STATUS_INVALID_PARAMETER;
+}
+
+NTSTATUS
+RmiReadRegisterDescriptors(
+	IN SPB_CONTEXT *Context,
+	IN RMI4_ARENA *Arena,
+	IN UCHAR Address,
+	IN PRMI_REGISTER_DESCRIPTOR *Rdescs,
+	IN int Count
+)
+/*++
+
+  Routine Description:
+
+    Reads consecutive register descriptors (ie query, control and data)
+    starting at the given query register. Each descriptor spans three
+    packet registers (size of presence, presence and structure), which
+    the controller returns back to back in a single read. A block is
+    fetched once and every descriptor it fully contains is parsed from
+    memory; the bus is only touched again for a descriptor crossing the
+    end of the block.
+
+  Arguments:
+
+    Context - A pointer to the current i2c context
+    Arena - Arena the packet register lists are allocated from
+    Address - Query register holding the first size of presence register
+    Rdescs - Descriptors to fill, in register order
+    Count - Number of descriptors to read
+
+  Return Value:
+
+    NTSTATUS indicating success or failure
+
+--*/
+{
+	NTSTATUS Status = STATUS_SUCCESS;
+	BYTE block[RMI_REG_DESC_BULK_READ_SIZE];
+	BYTE *struct_buf;
+	ULONG length = 0;
+	ULONG offset = 0;
+	ULONG structOffset;
+	ULONG needed;
+	UCHAR descAddress;
+	int i;
+
+	for (i = 0; i < Count; i++)
+	{
+		descAddress = Address + (UCHAR) (i * RMI_REG_DESC_QUERY_REGISTERS);
+
+		Status = RmiParseRegisterDescriptorHeader(
+			&block[offset],
+			length - offset,
+			Rdescs[i],
+			&structOffset
+		);
+
+		if (Status == STATUS_BUFFER_TOO_SMALL)
+		{
+			//
+			// Header crosses the end of the block, refetch starting at
+			// this descriptor. A full block always holds a header.
+			//
+			Status = SpbReadDataSynchronously(
+				Context,
+				descAddress,
+				block,
+				sizeof(block)
+			);
+
+			if (!NT_SUCCESS(Status)) goto i2c_read_fail;
+
+			length = sizeof(block);
+			offset = 0;
+
+			Status = RmiParseRegisterDescriptorHeader(
+				block,
+				length,
+				Rdescs[i],
+				&structOffset
+			);
+		}
+
+		if (!NT_SUCCESS(Status)) goto exit;
+
+		Rdescs[i]->Registers = RmiArenaAllocate(
+			Arena,
+			Rdescs[i]->NumRegisters * sizeof(RMI_REGISTER_DESC_ITEM)
+		);
+
+		if (Rdescs[i]->Registers == NULL)
+		{
+			Status = STATUS_INSUFFICIENT_RESOURCES;
+			goto exit;
+		}
+
+		needed = structOffset + Rdescs[i]->StructSize;
+
+		if (needed <= length - offset)
+		{
+			struct_buf = &block[offset + structOffset];
+
+			Status = RmiParseRegisterDescriptorItems(struct_buf, Rdescs[i]);
+			if (!NT_SUCCESS(Status)) goto exit;
+
+			offset += needed;
+			continue;
+		}
+
+		if (needed <= sizeof(block))
+		{
+			Status = SpbReadDataSynchronously(
+				Context,
+				descAddress,
+				block,
+				sizeof(block)
+			);
+
+			if (!NT_SUCCESS(Status)) goto i2c_read_fail;
+
+			length = sizeof(block);
+			offset = 0;
+
+			Status = RmiParseRegisterDescriptorItems(&block[structOffset], Rdescs[i]);
+			if (!NT_SUCCESS(Status)) goto exit;
+
+			offset += needed;
+			continue;
+		}
+
+		/*
+		* The register structure is larger than a block, read this
+		* descriptor on its own into scratch space. It is reclaimed
+		* with the rest of the arena on the next discovery.
+		*/
+		struct_buf = RmiArenaAllocate(
+			Arena,
+			needed
+		);
+
+		if (struct_buf == NULL)
+		{
+			Status = STATUS_INSUFFICIENT_RESOURCES;
+			goto exit;
+		}
+
+		Status = SpbReadDataSynchronously(
+			Context,
+			descAddress,
+			struct_buf,
+			needed
+		);
+
+		if (!NT_SUCCESS(Status)) goto i2c_read_fail;
+
+		Status = RmiParseRegisterDescriptorItems(&struct_buf[structOffset], Rdescs[i]);
+		if (!NT_SUCCESS(Status)) goto exit;
+
+		//
+		// The block no longer lines up with the next descriptor
+		//
+		length = 0;
+		offset = 0;
+	}
+
+exit:
+	return Status;
+
+i2c_read_fail:
+	Trace(
+		TRACE_LEVEL_ERROR,
+		TRACE_INIT,
+		"Failed to read register descriptor %d - %!STATUS!",
+		i,
+		Status);
+	goto exit;
+}
+
+size_t 
+RmiRegisterDescriptorCalcSize(
+	IN PRMI_REGISTER_DESCRIPTOR Rdesc
+)
+{
+	PRMI_REGISTER_DESC_ITEM item;
+	int i;
+	size_t size = 0;
+
+	for (i = 0; i < Rdesc->NumRegisters; i++) 
+	{
+		item = &Rdesc->Registers[i];
+		size += item->RegisterSize;
+	}
+	return size;
+}
+
+const PRMI_REGISTER_DESC_ITEM RmiGetRegisterDescItem(
+	PRMI_REGISTER_DESCRIPTOR Rdesc, 
+	USHORT reg
 )
 {
-	NTSTATUS Status;
+	PRMI_REGISTER_DESC_ITEM item;
+	int i;
 
-	BYTE size_presence_reg;
-	BYTE buf[35];
-	int presense_offset = 1;
-	BYTE *struct_buf;
-	int reg;
-	int offset = 0;
-	int map_offset = 0;
+	for (i = 0; i < Rdesc->NumRegisters; i++) 
+	{
+		item = &Rdesc->Registers[i];
+		if (item->Register == reg) return item;
+	}
+
+	return NULL;
+}
+
+NTSTATUS
+RmiGetF12DataLayout(
+	IN PRMI_REGISTER_DESCRIPTOR DataRegDesc,
+	OUT size_t* PacketSize,
+	OUT USHORT* Data1Offset,
+	OUT BYTE* MaxFingers
+)
+/*++
+
+  Routine Description:
+
+    Derives the F12 data packet layout from the data register
+    descriptor: the packet size, the offset of the finger objects and
+    the number of them the packet and the driver can hold. Used by
+    discovery as well as to check a restored layout.
+
+  Arguments:
+
+    DataRegDesc - The F12 data register descriptor
+    PacketSize - Receives the size of the data packet
+    Data1Offset - Receives the offset of the finger objects
+    MaxFingers - Receives the number of finger objects
+
+  Return Value:
+
+    NTSTATUS indicating success or failure
+
+--*/
+{
+	PRMI_REGISTER_DESC_ITEM item;
+	ULONG64 packetSize = 0;
+	ULONG64 dataOffset = 0;
+	ULONG64 fingers;
 	int i;
-	int b;
 
-	Status = SpbReadDataSynchronously(
-		Context,
-		Address,
-		&size_presence_reg,
-		sizeof(BYTE)
+	for (i = 0; i < DataRegDesc->NumRegisters; i++)
+	{
+		packetSize += DataRegDesc->Registers[i].RegisterSize;
+	}
+
+	if (packetSize == 0 || packetSize > MAXUSHORT)
+	{
+		return STATUS_INVALID_DEVICE_STATE;
+	}
+
+	/*
+	* Figure out what data is contained in the data registers. HID devices
+	* may have registers defined, but their data is not reported in the
+	* HID attention report. Registers which are not reported in the HID
+	* attention report check to see if the device is receiving data from
+	* HID attention reports.
+	*/
+	item = RmiGetRegisterDescItem(DataRegDesc, 0);
+	if (item) dataOffset += item->RegisterSize;
+
+	item = RmiGetRegisterDescItem(DataRegDesc, 1);
+	if (item == NULL)
+	{
+		return STATUS_INVALID_DEVICE_STATE;
+	}
+
+	fingers = item->NumSubPackets;
+	if (fingers * F12_DATA1_BYTES_PER_OBJ > packetSize - dataOffset)
+	{
+		fingers = (packetSize - dataOffset) / F12_DATA1_BYTES_PER_OBJ;
+	}
+
+	if (fingers > RMI4_MAX_TOUCHES)
+	{
+		fingers = RMI4_MAX_TOUCHES;
+	}
+
+	*PacketSize = (size_t) packetSize;
+	*Data1Offset = (USHORT) dataOffset;
+	*MaxFingers = (BYTE) fingers;
+
+	return STATUS_SUCCESS;
+}
+
+UINT8 RmiGetRegisterIndex(
+	PRMI_REGISTER_DESCRIPTOR Rdesc,
+	USHORT reg
+)
+{
+	UINT8 i;
+
+	for (i = 0; i < Rdesc->NumRegisters; i++)
+	{
+		if (Rdesc->Registers[i].Register == reg) return i;
+	}
+
+	return Rdesc->NumRegisters;
+}
+
+BOOLEAN
+RmiRegisterDescHasSubpacket(
+    IN PRMI_REGISTER_DESC_ITEM Item,
+    IN UINT8 Subpacket
+    )
+/*++
+
+  Routine Description:
+
+    Tells whether a packet register implements a subpacket.
+
+  Arguments:
+
+    Item - The packet register
+
+    Subpacket - The subpacket number
+
+  Return Value:
+
+    TRUE if the subpacket is present
+
+--*/
+{
+    return !!(Item->SubPacketMap[BIT_WORD(Subpacket)] & BIT_MASK(Subpacket));
+}
+
+VOID
+RmiReadF12SensorTuning(
+    IN RMI4_CONTROLLER_CONTEXT *ControllerContext,
+    IN SPB_CONTEXT *SpbContext,
+    IN BYTE ControlBase
+    )
+/*++
+
+  Routine Description:
+
+    Reads the sensor tuning held in F12_2D_Ctrl8 and traces it, so the
+    configured sensor size can be checked against the firmware. The
+    register page of F12 must be selected.
+
+  Arguments:
+
+    ControllerContext - A pointer to the current touch controller
+    context
+
+    SpbContext - A pointer to the current i2c context
+
+    ControlBase - Base address of the F12 control registers
+
+  Return Value:
+
+    None.
+
+--*/
+{
+    PRMI_REGISTER_DESC_ITEM item;
+    BYTE buf[RMI4_F12_CONTROL_SHADOW_SIZE];
+    ULONG offset = 0;
+    USHORT maxX = 0;
+    USHORT maxY = 0;
+    USHORT pitchX = 0;
+    USHORT pitchY = 0;
+    NTSTATUS status;
+
+    item = RmiGetRegisterDescItem(&ControllerContext->ControlRegDesc, 8);
+
+    if (item == NULL || item->RegisterSize > sizeof(buf))
+    {
+        goto exit;
+    }
+
+    status = SpbReadDataSynchronously(
+        SpbContext,
+        ControlBase + RmiGetRegisterIndex(&ControllerContext->ControlRegDesc, 8),
+        buf,
+        item->RegisterSize);
+
+    if (!NT_SUCCESS(status))
+    {
+        Trace(
+            TRACE_LEVEL_WARNING,
+            TRACE_INIT,
+            "Could not read F12_2D_Ctrl8 register - %!STATUS!",
+            status);
+
+        goto exit;
+    }
+
+    if (RmiRegisterDescHasSubpacket(item, 0) && offset + 4 <= item->RegisterSize)
+    {
+        maxX = (buf[offset + 1] << 8) | buf[offset];
+        maxY = (buf[offset + 3] << 8) | buf[offset + 2];
+        offset += 4;
+    }
+
+    if (RmiRegisterDescHasSubpacket(item, 1) && offset + 4 <= item->RegisterSize)
+    {
+        pitchX = (buf[offset + 1] << 8) | buf[offset];
+        pitchY = (buf[offset + 3] << 8) | buf[offset + 2];
+    }
+
+    Trace(
+        TRACE_LEVEL_INFORMATION,
+        TRACE_INIT,
+        "F12 sensor tuning - max %dx%d, pitch %dx%d, configured max %dx%d",
+        maxX,
+        maxY,
+        pitchX,
+        pitchY,
+        ControllerContext->Config.TouchSettings.SensorMaxXPos,
+        ControllerContext->Config.TouchSettings.SensorMaxYPos);
+
+exit:
+
+    return;
+}
+
+NTSTATUS
+RmiDiscoverF12Registers(
+    IN RMI4_CONTROLLER_CONTEXT *ControllerContext,
+    IN SPB_CONTEXT *SpbContext
+    )
+/*++
+ 
+  Routine Description:
+
+    Function $12 describes its query, control and data packet registers
+    through register descriptors. This routine reads them and derives
+    the layout of the touch data packet. The layout only changes with
+    the firmware, so it is not repeated when the chip is reconfigured.
+
+  Arguments:
+
+    ControllerContext - A pointer to the current touch controller
+    context
+    
+    SpbContext - A pointer to the current i2c context
+
+  Return Value:
+
+    NTSTATUS indicating success or failure
+
+--*/
+{
+    int index;
+    NTSTATUS status;
+
+	BYTE queryF12Addr = 0;
+	char buf;
+	PRMI_REGISTER_DESCRIPTOR rdescs[RMI_F12_REGISTER_DESCRIPTORS];
+	SIZE_T arenaSize;
+
+    //
+    // Find 2D touch sensor function
+    //
+    index = RmiGetFunctionIndex(
+        ControllerContext->Descriptors,
+        ControllerContext->FunctionCount,
+        RMI4_F12_2D_TOUCHPAD_SENSOR);
+
+    if (index == ControllerContext->FunctionCount)
+    {
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_INIT,
+            "Unexpected - RMI Function 12 missing");
+
+        status = STATUS_INVALID_DEVICE_STATE;
+		goto exit;
+    }
+
+    status = RmiChangePage(
+        ControllerContext,
+        SpbContext,
+        ControllerContext->FunctionOnPage[index]);
+
+    if (!NT_SUCCESS(status))
+    {
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_INIT,
+            "Could not change register page");
+
+        goto exit;
+    }
+
+	// Retrieve base address for queries
+	queryF12Addr = ControllerContext->Descriptors[index].QueryBase;
+	status = SpbReadDataSynchronously(
+		SpbContext,
+		queryF12Addr,
+		&buf,
+		sizeof(char)
+	);
+
+	if (!NT_SUCCESS(status))
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			TRACE_INIT,
+			"Failed to read general info register - %!STATUS!",
+			status);
+		goto exit;
+	}
+
+	++queryF12Addr;
+
+	if (!(buf & BIT(0))) 
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			TRACE_INIT,
+			"Behavior of F12 without register descriptors is undefined."
+		);
+		
+		status = STATUS_INVALID_PARAMETER;
+		goto exit;
+	}
+
+	ControllerContext->HasDribble = !!(buf & BIT(3));
+
+	RmiGetF12RegisterDescriptors(ControllerContext, rdescs);
+
+	//
+	// All discovery state lives in the arena, so rediscovery starts by
+	// dropping what the previous one allocated
+	//
+	RmiArenaReset(&ControllerContext->Arena);
+
+	status = RmiArenaReserve(
+		&ControllerContext->Arena,
+		RMI4_DISCOVERY_ARENA_SIZE
 	);
 
-	if (!NT_SUCCESS(Status)) goto i2c_read_fail;
+	if (!NT_SUCCESS(status)) goto exit;
 
-	++Address;
+	status = RmiReadRegisterDescriptors(
+		SpbContext,
+		&ControllerContext->Arena,
+		queryF12Addr,
+		rdescs,
+		ARRAYSIZE(rdescs)
+	);
 
-	if (size_presence_reg < 0 || size_presence_reg > 35)
+	//
+	// If the layout did not fit, the failed pass measured what it needs
+	// up to the descriptor that ran out of space. Grow and read again.
+	//
+	while (!NT_SUCCESS(status) &&
+		ControllerContext->Arena.Requested > ControllerContext->Arena.Size)
 	{
-		Trace(
-			TRACE_LEVEL_ERROR,
-			TRACE_INIT,
-			"size_presence_reg has invalid size, either less than 0 or larger than 35");
-		Status = STATUS_INVALID_PARAMETER;
-		goto exit;
-	}
+		arenaSize = ControllerContext->Arena.Requested;
 
-	memset(buf, 0, sizeof(buf));
+		RmiArenaReset(&ControllerContext->Arena);
 
-	/*
-	* The presence register contains the size of the register structure
-	* and a bitmap which identified which packet registers are present
-	* for this particular register type (ie query, control, or data).
-	*/
-	Status = SpbReadDataSynchronously(
-		Context,
-		Address,
-		buf,
-		size_presence_reg
-	);
-	if (!NT_SUCCESS(Status)) goto i2c_read_fail;
-	++Address;
+		status = RmiArenaReserve(
+			&ControllerContext->Arena,
+			arenaSize
+		);
 
-	if (buf[0] == 0) 
-	{
-		presense_offset = 3;
-		Rdesc->StructSize = buf[1] | (buf[2] << 8);
-	}
-	else 
-	{
-		Rdesc->StructSize = buf[0];
-	}
+		if (!NT_SUCCESS(status)) goto exit;
 
-	for (i = presense_offset; i < size_presence_reg; i++) 
-	{
-		for (b = 0; b < 8; b++) 
-		{
-			if (buf[i] & (0x1 << b)) bitmap_set(Rdesc->PresenceMap, map_offset, 1);
-			++map_offset;
-		}
+		status = RmiReadRegisterDescriptors(
+			SpbContext,
+			&ControllerContext->Arena,
+			queryF12Addr,
+			rdescs,
+			ARRAYSIZE(rdescs)
+		);
 	}
 
-	Rdesc->NumRegisters = (UINT8) bitmap_weight(Rdesc->PresenceMap, RMI_REG_DESC_PRESENSE_BITS);
-	Rdesc->Registers = ExAllocatePoolWithTag(
-		NonPagedPoolNx,
-		Rdesc->NumRegisters * sizeof(RMI_REGISTER_DESC_ITEM),
-		TOUCH_POOL_TAG_F12
-	);
+	if (!NT_SUCCESS(status)) {
 
-	if (Rdesc->Registers == NULL)
-	{
-		Status = STATUS_INSUFFICIENT_RESOURCES;
+		Trace(
+			TRACE_LEVEL_ERROR,
+			TRACE_INIT,
+			"Failed to read the F12 Register Descriptors - %!STATUS!",
+			status);
 		goto exit;
 	}
+	queryF12Addr += ARRAYSIZE(rdescs) * RMI_REG_DESC_QUERY_REGISTERS;
+
+	//
+	// The sensor tuning is informational, a failure does not stop
+	// discovery
+	//
+	RmiReadF12SensorTuning(
+		ControllerContext,
+		SpbContext,
+		ControllerContext->Descriptors[index].ControlBase);
 
-	/*
-	* Allocate a temporary buffer to hold the register structure.
-	* I'm not using devm_kzalloc here since it will not be retained
-	* after exiting this function
-	*/
-	struct_buf = ExAllocatePoolWithTag(
-		NonPagedPoolNx,
-		Rdesc->StructSize,
-		TOUCH_POOL_TAG_F12
-	);
+	status = RmiGetF12DataLayout(
+		&ControllerContext->DataRegDesc,
+		&ControllerContext->PacketSize,
+		&ControllerContext->Data1Offset,
+		&ControllerContext->MaxFingers);
 
-	if (struct_buf == NULL)
+	if (!NT_SUCCESS(status))
 	{
-		Status = STATUS_INSUFFICIENT_RESOURCES;
+		Trace(
+			TRACE_LEVEL_ERROR,
+			TRACE_INIT,
+			"Unexpected F12 data packet layout - %!STATUS!",
+			status);
 		goto exit;
 	}
 
-	/*
-	* The register structure contains information about every packet
-	* register of this type. This includes the size of the packet
-	* register and a bitmap of all subpackets contained in the packet
-	* register.
-	*/
-	Status = SpbReadDataSynchronously(
-		Context,
-		Address,
-		struct_buf,
-		Rdesc->StructSize
-	);
+exit:
 
-	if (!NT_SUCCESS(Status)) goto free_buffer;
+    return status;
+}
 
-	reg = find_first_bit(Rdesc->PresenceMap, RMI_REG_DESC_PRESENSE_BITS);
-	for (i = 0; i < Rdesc->NumRegisters; i++)
-	{
-		PRMI_REGISTER_DESC_ITEM item = &Rdesc->Registers[i];
-		int reg_size = struct_buf[offset];
+NTSTATUS
+RmiConfigureFunctions(
+    IN RMI4_CONTROLLER_CONTEXT *ControllerContext,
+    IN SPB_CONTEXT *SpbContext
+    )
+/*++
+ 
+  Routine Description:
 
-		++offset;
-		if (reg_size == 0) 
-		{
-			reg_size = struct_buf[offset] |
-				(struct_buf[offset + 1] << 8);
-			offset += 2;
-		}
+    RMI4 devices such as this Synaptics touch controller are organized
+    as collections of logical functions. Discovered functions must be
+    configured, which is done in this function (things like sleep 
+    timeouts, interrupt enables, report rates, etc.)
+
+  Arguments:
+
+    ControllerContext - A pointer to the current touch controller
+    context
+    
+    SpbContext - A pointer to the current i2c context
+
+  Return Value:
+
+    NTSTATUS indicating success or failure
+
+--*/
+{
+    RMI4_WRITE_BATCH batch;
+    int index;
+    NTSTATUS status;
+
+    RMI4_F01_CTRL_REGISTERS controlF01 = {0};
+
+    //
+    // Find 0D capacitive button sensor function and configure it if it exists
+    //
+    index = RmiGetFunctionIndex(
+        ControllerContext->Descriptors,
+        ControllerContext->FunctionCount,
+        RMI4_F1A_0D_CAP_BUTTON_SENSOR);
+
+    if (index != ControllerContext->FunctionCount)
+    {
+        ControllerContext->HasButtons = TRUE;
+
+        //
+        // TODO: Get configuration data from registry once Synaptics
+        //       provides sane default values. Until then, assume the
+        //       object is configured for the desired product scenario
+        //       by default.
+        //
+    }
+
+    //
+    // Find RMI device control function and configure it
+    // 
+    index = RmiGetFunctionIndex(
+        ControllerContext->Descriptors,
+        ControllerContext->FunctionCount,
+        RMI4_F01_RMI_DEVICE_CONTROL);
+
+    if (index == ControllerContext->FunctionCount)
+    {
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_INIT,
+            "Unexpected - RMI Function 01 missing");
+
+        status = STATUS_INVALID_DEVICE_STATE;
+        goto exit;
+    }
+
+    RmiConvertF01ToPhysical(
+        &ControllerContext->Config.DeviceSettings,
+        &controlF01);	
+
+    //
+    // Only enable the interrupt sources the driver services, others
+    // would raise interrupts that are read and ignored
+    //
+    RmiPackInterruptMask(
+        ControllerContext->Config.DeviceSettings.InterruptEnable &
+            ControllerContext->Interrupts.Serviced,
+        controlF01.InterruptEnable,
+        ControllerContext->Interrupts.Registers);
+
+    Trace(
+        TRACE_LEVEL_VERBOSE,
+        TRACE_INIT,
+        "Enabling interrupt sources 0x%x",
+        ControllerContext->Config.DeviceSettings.InterruptEnable &
+            ControllerContext->Interrupts.Serviced);
+
+    //
+    // Capture the F12 controls the driver changes at runtime, later
+    // changes are then write-only
+    //
+    status = RmiReadF12ControlShadows(
+        ControllerContext,
+        SpbContext);
+
+    if (!NT_SUCCESS(status))
+    {
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_INIT,
+            "Error reading RMI F12 Ctrl settings - %!STATUS!",
+            status);
+        goto exit;
+    }
+
+    RmiBatchInitialize(ControllerContext, &batch);
+
+    //
+    // Motion suppression and dribble go out with the reporting mode,
+    // they share F12_2D_Ctrl20
+    //
+    RmiApplyF12Tuning(ControllerContext);
+
+    //
+    // Try to set continuous reporting mode during touch
+    //
+    RmiQueueReportingMode(
+        ControllerContext,
+        &batch,
+        RMI_F12_REPORTING_MODE_CONTINUOUS,
+        NULL);
+
+    //
+    // F01 goes last since it carries the Configured bit
+    //
+    status = RmiBatchAddF01Control(
+        ControllerContext,
+        &batch,
+        &controlF01);
+
+    if (!NT_SUCCESS(status))
+    {
+        goto exit;
+    }
+
+    //
+    // Write settings to controller
+    //
+    status = RmiBatchExecute(
+        ControllerContext,
+        SpbContext,
+        &batch);
+
+    if (!NT_SUCCESS(status))
+    {
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_INIT,
+            "Error writing RMI Ctrl settings - %!STATUS!",
+            status);
+        goto exit;
+    }
+
+    ControllerContext->F01ControlShadow = controlF01;
+    ControllerContext->F01ControlShadowValid = TRUE;
+
+    //
+    // The reporting mode governor starts over from continuous reporting
+    //
+    ControllerContext->Governor.Mode = RMI_F12_REPORTING_MODE_CONTINUOUS;
+    ControllerContext->Governor.DesiredMode =
+        RMI_F12_REPORTING_MODE_CONTINUOUS;
+
+    //
+    // The configured doze settings are the idle doze profile
+    //
+    ControllerContext->Doze.Interactive = FALSE;
+
+    //
+    // Note whether the device configuration settings initialized the
+    // controller in an operating state, to prevent a double-start from 
+    // the D0 entry dispatch routine (TchWakeDevice)
+    //
+    if (RMI4_F01_DEVICE_CONTROL_SLEEP_MODE_OPERATING ==
+        controlF01.DeviceControl.SleepMode)
+    {
+        ControllerContext->DevicePowerState = PowerDeviceD0;
+    }
+    else
+    {
+        ControllerContext->DevicePowerState = PowerDeviceD3;
+    }
+
+exit:
+
+    return status;
+}
+
+NTSTATUS
+RmiRestoreConfiguration(
+    IN RMI4_CONTROLLER_CONTEXT *ControllerContext,
+    IN SPB_CONTEXT *SpbContext
+    )
+/*++
+ 
+  Routine Description:
+
+    Reprograms a controller that lost its configuration, typically after
+    a reset. The control register image shadowed when the controller was
+    configured is replayed as-is in a single SPB sequence, which avoids
+    re-reading anything from the chip. F01 is written last since it
+    carries the Configured bit.
+    Falls back to a full configuration if no image is available.
+
+  Arguments:
+
+    ControllerContext - A pointer to the current touch controller
+    context
+    
+    SpbContext - A pointer to the current i2c context
+
+  Return Value:
+
+    NTSTATUS indicating success or failure
+
+--*/
+{
+    RMI4_WRITE_BATCH batch;
+    ULONG64 startTime;
+    ULONG64 elapsed;
+    int index;
+    int i;
+    NTSTATUS status;
+
+    startTime = KeQueryInterruptTime();
+
+    index = RmiGetFunctionIndex(
+        ControllerContext->Descriptors,
+        ControllerContext->FunctionCount,
+        RMI4_F01_RMI_DEVICE_CONTROL);
+
+    if (!ControllerContext->F01ControlShadowValid ||
+        index == ControllerContext->FunctionCount)
+    {
+        status = STATUS_INVALID_DEVICE_STATE;
+        goto fallback;
+    }
 
-		if (reg_size == 0) 
-		{
-			reg_size = struct_buf[offset] |
-				(struct_buf[offset + 1] << 8) |
-				(struct_buf[offset + 2] << 16) |
-				(struct_buf[offset + 3] << 24);
-			offset += 4;
-		}
+    RmiBatchInitialize(ControllerContext, &batch);
 
-		item->Register = (USHORT) reg;
-		item->RegisterSize = reg_size;
+    for (i = 0; i < RMI4_F12_SHADOWED_CONTROLS; i++)
+    {
+        if (!ControllerContext->F12ControlShadow[i].Valid)
+        {
+            continue;
+        }
 
-		map_offset = 0;
+        status = RmiBatchAddF12ControlShadow(
+            ControllerContext,
+            &batch,
+            &ControllerContext->F12ControlShadow[i]);
 
-		do {
-			for (b = 0; b < 7; b++) {
-				if (struct_buf[offset] & (0x1 << b))
-					bitmap_set(item->SubPacketMap, map_offset, 1);
-				++map_offset;
-			}
-		} while (struct_buf[offset++] & 0x80);
+        if (!NT_SUCCESS(status))
+        {
+            goto fallback;
+        }
+    }
 
-		item->NumSubPackets = (BYTE) bitmap_weight(item->SubPacketMap, RMI_REG_DESC_SUBPACKET_BITS);
+    status = RmiBatchAddF01Control(
+        ControllerContext,
+        &batch,
+        &ControllerContext->F01ControlShadow);
 
-		Trace(
-			TRACE_LEVEL_INFORMATION,
-			TRACE_INIT,
-			"%s: reg: %d reg size: %ld subpackets: %d\n",
-			__func__,
-			item->Register, item->RegisterSize, item->NumSubPackets
-		);
+    if (!NT_SUCCESS(status))
+    {
+        goto fallback;
+    }
 
-		reg = find_next_bit(Rdesc->PresenceMap, RMI_REG_DESC_PRESENSE_BITS, reg + 1);
-	}
+    status = RmiBatchExecute(
+        ControllerContext,
+        SpbContext,
+        &batch);
 
-free_buffer:
-	ExFreePoolWithTag(
-		struct_buf,
-		TOUCH_POOL_TAG_F12
-	);
+    if (!NT_SUCCESS(status))
+    {
+        goto fallback;
+    }
 
-exit:
-	return Status;
+    goto exit;
 
-i2c_read_fail:
-	Trace(
-		TRACE_LEVEL_ERROR,
-		TRACE_INIT,
-		"Failed to read general info register - %!STATUS!",
-		Status);
-	goto exit;
-}
+fallback:
 
-size_t 
-RmiRegisterDescriptorCalcSize(
-	IN PRMI_REGISTER_DESCRIPTOR Rdesc
-)
-{
-	PRMI_REGISTER_DESC_ITEM item;
-	int i;
-	size_t size = 0;
+    Trace(
+        TRACE_LEVEL_WARNING,
+        TRACE_INTERRUPT,
+        "Could not replay configuration, reconfiguring chip - %!STATUS!",
+        status);
 
-	for (i = 0; i < Rdesc->NumRegisters; i++) 
-	{
-		item = &Rdesc->Registers[i];
-		size += item->RegisterSize;
-	}
-	return size;
-}
+    //
+    // The chip may have dropped the page we believed was selected
+    //
+    ControllerContext->CurrentPage = RMI4_INVALID_PAGE;
 
-const PRMI_REGISTER_DESC_ITEM RmiGetRegisterDescItem(
-	PRMI_REGISTER_DESCRIPTOR Rdesc, 
-	USHORT reg
-)
-{
-	PRMI_REGISTER_DESC_ITEM item;
-	int i;
+    status = RmiConfigureFunctions(
+        ControllerContext,
+        SpbContext);
 
-	for (i = 0; i < Rdesc->NumRegisters; i++) 
-	{
-		item = &Rdesc->Registers[i];
-		if (item->Register == reg) return item;
-	}
+exit:
 
-	return NULL;
-}
+    if (NT_SUCCESS(status))
+    {
+        elapsed = KeQueryInterruptTime() - startTime;
 
-UINT8 RmiGetRegisterIndex(
-	PRMI_REGISTER_DESCRIPTOR Rdesc,
-	USHORT reg
-)
-{
-	UINT8 i;
+        ControllerContext->RecoveryCount++;
+        ControllerContext->LastRecoveryTime = elapsed;
 
-	for (i = 0; i < Rdesc->NumRegisters; i++)
-	{
-		if (Rdesc->Registers[i].Register == reg) return i;
-	}
+        if (elapsed > ControllerContext->MaxRecoveryTime)
+        {
+            ControllerContext->MaxRecoveryTime = elapsed;
+        }
 
-	return Rdesc->NumRegisters;
+        Trace(
+            TRACE_LEVEL_INFORMATION,
+            TRACE_INTERRUPT,
+            "Configuration restored in %lluus (max %lluus, %d recoveries)",
+            elapsed / 10,
+            ControllerContext->MaxRecoveryTime / 10,
+            ControllerContext->RecoveryCount);
+    }
+
+    return status;
 }
 
 NTSTATUS
-RmiConfigureFunctions(
+RmiBuildFunctionsTable(
     IN RMI4_CONTROLLER_CONTEXT *ControllerContext,
     IN SPB_CONTEXT *SpbContext
     )
@@ -517,14 +2319,13 @@ RmiConfigureFunctions(
   Routine Description:
 
     RMI4 devices such as this Synaptics touch controller are organized
-    as collections of logical functions. Discovered functions must be
-    configured, which is done in this function (things like sleep 
-    timeouts, interrupt enables, report rates, etc.)
+    as collections of logical functions. When initially communicating
+    with the chip, a driver must build a table of available functions,
+    as is done in this routine.
 
   Arguments:
 
-    ControllerContext - A pointer to the current touch controller
-    context
+    ControllerContext - A pointer to the current touch controller context
     
     SpbContext - A pointer to the current i2c context
 
@@ -534,198 +2335,179 @@ RmiConfigureFunctions(
 
 --*/
 {
-    int index;
+    RMI4_FUNCTION_DESCRIPTOR descriptor;
+    UCHAR address;
+    int entry;
+    int function;
+    int page;
     NTSTATUS status;
 
-    RMI4_F01_CTRL_REGISTERS controlF01 = {0};
-
-	BYTE queryF12Addr = 0;
-	char buf;
-	USHORT data_offset = 0;
-	PRMI_REGISTER_DESC_ITEM item;
+    function = 0;
+    page = 0;
 
     //
-    // Find 2D touch sensor function and configure it
+    // Discover chip functions page by page. Descriptors of a page are
+    // stored downwards from the fixed first function address and are
+    // read one by one down to the terminator. The function registers
+    // sit right below the table, and reading some of them, such as the
+    // F01 interrupt status, has side effects, so nothing past the
+    // terminator is fetched.
     //
-    index = RmiGetFunctionIndex(
-        ControllerContext->Descriptors,
-        ControllerContext->FunctionCount,
-        RMI4_F12_2D_TOUCHPAD_SENSOR);
-
-    if (index == ControllerContext->FunctionCount)
+    do
     {
-        Trace(
-            TRACE_LEVEL_ERROR,
-            TRACE_INIT,
-            "Unexpected - RMI Function 12 missing");
+        status = RmiChangePage(
+            ControllerContext,
+            SpbContext,
+            page);
 
-        status = STATUS_INVALID_DEVICE_STATE;
-		goto exit;
-    }
+        if (!NT_SUCCESS(status))
+        {
+            Trace(
+                TRACE_LEVEL_ERROR,
+                TRACE_INIT,
+                "Error attempting to change page - %!STATUS!",
+                status);
+            goto exit;
+        }
 
-    status = RmiChangePage(
-        ControllerContext,
-        SpbContext,
-        ControllerContext->FunctionOnPage[index]);
+        address = RMI4_FIRST_FUNCTION_ADDRESS;
 
-    if (!NT_SUCCESS(status))
-    {
-        Trace(
-            TRACE_LEVEL_ERROR,
-            TRACE_INIT,
-            "Could not change register page");
+        for (entry = 0; entry < RMI4_MAX_FUNCTIONS; entry++)
+        {
+            status = SpbReadDataSynchronously(
+                SpbContext,
+                address,
+                &descriptor,
+                sizeof(RMI4_FUNCTION_DESCRIPTOR));
 
-        goto exit;
-    }
+            if (!(NT_SUCCESS(status)))
+            {
+                Trace(
+                    TRACE_LEVEL_ERROR,
+                    TRACE_INIT,
+                    "Error returned from SPB/I2C read of page %d table - %!STATUS!",
+                    page,
+                    status);
+                goto exit;
+            }
 
-	// Retrieve base address for queries
-	queryF12Addr = ControllerContext->Descriptors[index].QueryBase;
-	status = SpbReadDataSynchronously(
-		SpbContext,
-		queryF12Addr,
-		&buf,
-		sizeof(char)
-	);
+            //
+            // Function number 0 implies "last function" on this register page
+            //
+            if (descriptor.Number == 0)
+            {
+                break;
+            }
 
-	if (!NT_SUCCESS(status))
-	{
-		Trace(
-			TRACE_LEVEL_ERROR,
-			TRACE_INIT,
-			"Failed to read general info register - %!STATUS!",
-			status);
-		goto exit;
-	}
+            if (function >= RMI4_MAX_FUNCTIONS)
+            {
+                break;
+            }
 
-	++queryF12Addr;
+            Trace(
+                TRACE_LEVEL_VERBOSE,
+                TRACE_INIT,
+                "Discovered function $%x",
+                descriptor.Number);
 
-	if (!(buf & BIT(0))) 
-	{
-		Trace(
-			TRACE_LEVEL_ERROR,
-			TRACE_INIT,
-			"Behavior of F12 without register descriptors is undefined."
-		);
-		
-		status = STATUS_INVALID_PARAMETER;
-		goto exit;
-	}
+            ControllerContext->Descriptors[function] = descriptor;
+            ControllerContext->FunctionOnPage[function] = page;
+            function++;
 
-	ControllerContext->HasDribble = !!(buf & BIT(3));
+            address -= sizeof(RMI4_FUNCTION_DESCRIPTOR);
+        }
 
-	status = RmiReadRegisterDescriptor(
-		SpbContext,
-		queryF12Addr,
-		&ControllerContext->QueryRegDesc
-	);
+        //
+        // If we maxed-out the total number of functions supported by the
+        // driver, or swept the table without finding an "end function",
+        // note the error and exit.
+        //
+        if (function >= RMI4_MAX_FUNCTIONS)
+        {
+            Trace(
+                TRACE_LEVEL_ERROR,
+                TRACE_INIT,
+                "Error, encountered more than %d functions, must extend driver",
+                RMI4_MAX_FUNCTIONS);
 
-	if (!NT_SUCCESS(status)) {
+            status = STATUS_INVALID_DEVICE_STATE;
+            goto exit;
+        }
+        if (entry == RMI4_MAX_FUNCTIONS)
+        {
+            Trace(
+                TRACE_LEVEL_ERROR,
+                TRACE_INIT,
+                "Error, did not find terminator function 0 on page %d",
+                page);
 
-		Trace(
-			TRACE_LEVEL_ERROR,
-			TRACE_INIT,
-			"Failed to read the Query Register Descriptor - %!STATUS!",
-			status);
-		goto exit;
-	}
-	queryF12Addr += 3;
+            status = STATUS_INVALID_DEVICE_STATE;
+            goto exit;
+        }
 
-	status = RmiReadRegisterDescriptor(
-		SpbContext,
-		queryF12Addr,
-		&ControllerContext->ControlRegDesc
-	);
+        //
+        // If the "last function" is the first function on the page, there
+        // are no more functions to discover, otherwise look for more
+        // functions on the next register page
+        //
+        page++;
 
-	if (!NT_SUCCESS(status)) {
+    } while (entry > 0);
 
-		Trace(
-			TRACE_LEVEL_ERROR,
-			TRACE_INIT,
-			"Failed to read the Control Register Descriptor - %!STATUS!",
-			status);
-		goto exit;
-	}
-	queryF12Addr += 3;
+    //
+    // Note the total number of functions that exist
+    //
+    ControllerContext->FunctionCount = function;
 
-	status = RmiReadRegisterDescriptor(
-		SpbContext,
-		queryF12Addr,
-		&ControllerContext->DataRegDesc
-	);
+    Trace(
+        TRACE_LEVEL_VERBOSE,
+        TRACE_INIT,
+        "Discovered %d RMI functions total",
+        function);
 
-	if (!NT_SUCCESS(status)) {
+exit:
 
-		Trace(
-			TRACE_LEVEL_ERROR,
-			TRACE_INIT,
-			"Failed to read the Data Register Descriptor - %!STATUS!",
-			status);
-		goto exit;
-	}
-	queryF12Addr += 3;
-	ControllerContext->PacketSize = RmiRegisterDescriptorCalcSize(
-		&ControllerContext->DataRegDesc
-	);
+    return status;
+}
 
-	// Skip rmi_f12_read_sensor_tuning for the prototype.
+NTSTATUS
+RmiCheckInterrupts(
+    IN RMI4_CONTROLLER_CONTEXT *ControllerContext,
+    IN SPB_CONTEXT *SpbContext,
+    IN ULONG* InterruptStatus
+    )
+/*++
+ 
+  Routine Description:
 
-	/*
-	* Figure out what data is contained in the data registers. HID devices
-	* may have registers defined, but their data is not reported in the
-	* HID attention report. Registers which are not reported in the HID
-	* attention report check to see if the device is receiving data from
-	* HID attention reports.
-	*/
-	item = RmiGetRegisterDescItem(&ControllerContext->DataRegDesc, 0);
-	if (item) data_offset += (USHORT) item->RegisterSize;
+    This function handles controller interrupts. It currently only
+    supports valid touch interrupts. Any other interrupt sources (such as
+    device losing configuration or being reset) are unhandled, but noted
+    in the controller context.
 
-	item = RmiGetRegisterDescItem(&ControllerContext->DataRegDesc, 1);
-	if (item != NULL)
-	{
-		ControllerContext->Data1Offset = data_offset;
-		ControllerContext->MaxFingers = item->NumSubPackets;
-		if ((ControllerContext->MaxFingers * F12_DATA1_BYTES_PER_OBJ) > 
-			(BYTE) (ControllerContext->PacketSize - ControllerContext->Data1Offset))
-		{
-			ControllerContext->MaxFingers = 
-				(BYTE) (ControllerContext->PacketSize - ControllerContext->Data1Offset) / 
-				F12_DATA1_BYTES_PER_OBJ;
-		}
+  Arguments:
 
-		if (ControllerContext->MaxFingers > RMI4_MAX_TOUCHES)
-		{
-			ControllerContext->MaxFingers = RMI4_MAX_TOUCHES;
-		}
-	}
-	else
-	{
-		status = STATUS_INVALID_DEVICE_STATE;
-		goto exit;
-	}
+    ControllerContext - A pointer to the current touch controller
+    context
+    
+    SpbContext - A pointer to the current i2c context
 
-    //
-    // Find 0D capacitive button sensor function and configure it if it exists
-    //
-    index = RmiGetFunctionIndex(
-        ControllerContext->Descriptors,
-        ControllerContext->FunctionCount,
-        RMI4_F1A_0D_CAP_BUTTON_SENSOR);
+  Return Value:
 
-    if (index != ControllerContext->FunctionCount)
-    {
-        ControllerContext->HasButtons = TRUE;
+    NTSTATUS indicating success or failure
 
-        //
-        // TODO: Get configuration data from registry once Synaptics
-        //       provides sane default values. Until then, assume the
-        //       object is configured for the desired product scenario
-        //       by default.
-        //
-    }
+--*/
+{
+    RMI4_F01_DATA_REGISTERS data;
+    int index;
+    NTSTATUS status;
+
+    RtlZeroMemory(&data, sizeof(data));
+    *InterruptStatus = 0;
 
     //
-    // Find RMI device control function and configure it
-    // 
+    // Locate RMI data base address
+    //
     index = RmiGetFunctionIndex(
         ControllerContext->Descriptors,
         ControllerContext->FunctionCount,
@@ -757,271 +2539,241 @@ RmiConfigureFunctions(
         goto exit;
     }
 
-    RmiConvertF01ToPhysical(
-        &ControllerContext->Config.DeviceSettings,
-        &controlF01);	
-
     //
-    // Write settings to controller
+    // Read interrupt status registers
     //
-    status = SpbWriteDataSynchronously(
+    status = SpbReadDataSynchronously(
         SpbContext,
-        ControllerContext->Descriptors[index].ControlBase,
-        &controlF01,
-        sizeof(controlF01)
-        );
+        ControllerContext->Descriptors[index].DataBase,
+        &data,
+        RMI4_F01_DATA_SIZE(ControllerContext->Interrupts.Registers));
 
     if (!NT_SUCCESS(status))
     {
         Trace(
             TRACE_LEVEL_ERROR,
-            TRACE_INIT,
-            "Error writing RMI F01 Ctrl settings - %!STATUS!",
+            TRACE_INTERRUPT,
+            "Error reading interrupt status - %!STATUS!",
             status);
+
         goto exit;
     }
 
-    //
-    // Try to set continuous reporting mode during touch
-    //
-    RmiSetReportingMode(
+    status = RmiHandleInterruptStatus(
         ControllerContext,
         SpbContext,
-        RMI_F12_REPORTING_MODE_CONTINUOUS,
-        NULL);
-
-    //
-    // Note whether the device configuration settings initialized the
-    // controller in an operating state, to prevent a double-start from 
-    // the D0 entry dispatch routine (TchWakeDevice)
-    //
-    if (RMI4_F01_DEVICE_CONTROL_SLEEP_MODE_OPERATING ==
-        controlF01.DeviceControl.SleepMode)
-    {
-        ControllerContext->DevicePowerState = PowerDeviceD0;
-    }
-    else
-    {
-        ControllerContext->DevicePowerState = PowerDeviceD3;
-    }
+        &data,
+        InterruptStatus);
 
 exit:
-
     return status;
 }
 
 NTSTATUS
-RmiBuildFunctionsTable(
+RmiHandleInterruptStatus(
     IN RMI4_CONTROLLER_CONTEXT *ControllerContext,
-    IN SPB_CONTEXT *SpbContext
+    IN SPB_CONTEXT *SpbContext,
+    IN RMI4_F01_DATA_REGISTERS *Data,
+    OUT ULONG* InterruptStatus
     )
 /*++
  
   Routine Description:
 
-    RMI4 devices such as this Synaptics touch controller are organized
-    as collections of logical functions. When initially communicating
-    with the chip, a driver must build a table of available functions,
-    as is done in this routine.
+    Handles the F01 data registers read by an interrupt service cycle.
+    Device status errors are noted in the controller context, and a
+    controller that lost its configuration is reconfigured.
 
   Arguments:
 
-    ControllerContext - A pointer to the current touch controller context
+    ControllerContext - A pointer to the current touch controller
+    context
     
     SpbContext - A pointer to the current i2c context
 
+    Data - The F01 device and interrupt status read from the controller
+
+    InterruptStatus - Receives the pending interrupt sources
+
   Return Value:
 
     NTSTATUS indicating success or failure
 
 --*/
 {
-    UCHAR address;
-    int function;
-    int page;
-    NTSTATUS status;
-
+    NTSTATUS status = STATUS_SUCCESS;
 
-    //
-    // First function is at a fixed address 
-    //
-    function = 0;
-    address = RMI4_FIRST_FUNCTION_ADDRESS;
-    page = 0;
+    *InterruptStatus = 0;
 
     //
-    // Discover chip functions one by one
+    // Check for catastrophic failures, simply store in context for
+    // debugging should these errors occur.
     //
-    do
+    switch (Data->DeviceStatus.Status)
     {
-        //
-        // Read function descriptor
-        //
-        status = SpbReadDataSynchronously(
-            SpbContext,
-            address,
-            &ControllerContext->Descriptors[function],
-            sizeof(RMI4_FUNCTION_DESCRIPTOR));
+        case RMI4_F01_DATA_STATUS_NO_ERROR:
+        {
+            break;
+        }
+        case RMI4_F01_DATA_STATUS_RESET_OCCURRED:
+        {
+            ControllerContext->ResetOccurred = TRUE;
+
+            //
+            // A reset returns the page select register to its default,
+            // force the next page change to be written
+            //
+            ControllerContext->CurrentPage = RMI4_INVALID_PAGE;
+
+            Trace(
+                TRACE_LEVEL_WARNING,
+                TRACE_INTERRUPT,
+                "Received status code 1 - reset occurred");
 
-        if (!(NT_SUCCESS(status)))
+            break;
+        }
+        case RMI4_F01_DATA_STATUS_INVALID_CONFIG:
         {
+            ControllerContext->InvalidConfiguration = TRUE;
+
             Trace(
                 TRACE_LEVEL_ERROR,
-                TRACE_INIT,
-                "Error returned from SPB/I2C read attempt %d - %!STATUS!",
-                function,
-                status);
-            goto exit;
-        }
+                TRACE_INTERRUPT,
+                "Received status code 2 - invalid configuration");
 
-        //
-        // Function number 0 implies "last function" on this register page,
-        // and if this "last function" is the first function on the page, there
-        // are no more functions to discover.
-        //
-        if (ControllerContext->Descriptors[function].Number == 0 &&
-            address == RMI4_FIRST_FUNCTION_ADDRESS)
-        {
             break;
         }
-        //
-        // If we've exhausted functions on this page, look for more functoins
-        // on the next register page
-        //
-        else if (ControllerContext->Descriptors[function].Number == 0 &&
-            address != RMI4_FIRST_FUNCTION_ADDRESS)
+        case RMI4_F01_DATA_STATUS_DEVICE_FAILURE:
         {
-            page++;
-            address = RMI4_FIRST_FUNCTION_ADDRESS;
+            ControllerContext->DeviceFailure = TRUE;
 
-            status = RmiChangePage(
-                ControllerContext,
-                SpbContext,
-                page);
+            Trace(
+                TRACE_LEVEL_ERROR,
+                TRACE_INTERRUPT,
+                "Received status code 4 - device failure");
 
-            if (!NT_SUCCESS(status))
-            {
-                Trace(
-                    TRACE_LEVEL_ERROR,
-                    TRACE_INIT,
-                    "Error attempting to change page - %!STATUS!",
-                    status);
-                goto exit;
-            }
+            break;
         }
-        //
-        // Descriptor stored, look for next or terminator
-        //
-        else
+        default:
         {
+            ControllerContext->UnknownStatus = TRUE;
+            ControllerContext->UnknownStatusMessage = Data->DeviceStatus.Status;
+
             Trace(
-                TRACE_LEVEL_VERBOSE,
-                TRACE_INIT,
-                "Discovered function $%x",
-                ControllerContext->Descriptors[function].Number);
+                TRACE_LEVEL_ERROR,
+                TRACE_INTERRUPT,
+                "Received unknown status code - %d",
+                ControllerContext->UnknownStatusMessage);
 
-            ControllerContext->FunctionOnPage[function] = page;
-            function++;
-            address = address - sizeof(RMI4_FUNCTION_DESCRIPTOR);
+            break;
         }
-
-    } while (
-        (address > 0) && 
-        (function < RMI4_MAX_FUNCTIONS));
+    }
 
     //
-    // If we swept the address space without finding an "end function"
-    // or maxed-out the total number of functions supported by the 
-    // driver, note the error and exit.
+    // If we're in flash programming mode, report an error
     //
-    if (function >= RMI4_MAX_FUNCTIONS)
+    if (Data->DeviceStatus.FlashProg)
     {
         Trace(
             TRACE_LEVEL_ERROR,
-            TRACE_INIT,
-            "Error, encountered more than %d functions, must extend driver",
-            RMI4_MAX_FUNCTIONS);
+            TRACE_INTERRUPT,
+            "Error, device status indicates chip in programming mode");
 
-        status = STATUS_INVALID_DEVICE_STATE;
         goto exit;
     }
-    if (address <= 0) 
+
+    //
+    // If the chip has lost it's configuration, reconfigure
+    //
+    if (Data->DeviceStatus.Unconfigured)
     {
         Trace(
             TRACE_LEVEL_ERROR,
-            TRACE_INIT,
-            "Error, did not find terminator function 0, address down to %d",
-            address);
+            TRACE_INTERRUPT,
+            "Error, device status indicates chip is unconfigured");
+
+        status = RmiRestoreConfiguration(
+            ControllerContext,
+            SpbContext);
+
+        if (!NT_SUCCESS(status))
+        {
+            Trace(
+                TRACE_LEVEL_ERROR,
+                TRACE_INTERRUPT,
+                "Could not reconfigure chip - %!STATUS!",
+                status);
+
+            goto exit;
+        }
 
-        status = STATUS_INVALID_DEVICE_STATE;
-        goto exit;
     }
 
-    //
-    // Note the total number of functions that exist
-    //
-    ControllerContext->FunctionCount = function;
+    *InterruptStatus = RmiUnpackInterruptMask(
+        Data->InterruptStatus,
+        ControllerContext->Interrupts.Registers);
 
-    Trace(
-        TRACE_LEVEL_VERBOSE,
-        TRACE_INIT,
-        "Discovered %d RMI functions total",
-        function);
+    if (*InterruptStatus == 0)
+    {
+        Trace(
+            TRACE_LEVEL_VERBOSE,
+            TRACE_INTERRUPT,
+            "Unexpected -- no interrupt status bit set");
+    }
 
 exit:
-
     return status;
 }
 
+//
+// F12 control registers shadowed by the driver
+//
+static const USHORT gF12ShadowedControls[RMI4_F12_SHADOWED_CONTROLS] =
+{
+    F12_2D_CTRL20,
+};
+
 NTSTATUS
-RmiCheckInterrupts(
-    IN RMI4_CONTROLLER_CONTEXT *ControllerContext,
-    IN SPB_CONTEXT *SpbContext,
-    IN ULONG* InterruptStatus
+RmiReadF12ControlShadows(
+    IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+    IN SPB_CONTEXT *SpbContext
     )
 /*++
- 
-  Routine Description:
 
-    This function handles controller interrupts. It currently only
-    supports valid touch interrupts. Any other interrupt sources (such as
-    device losing configuration or being reset) are unhandled, but noted
-    in the controller context.
+Routine Description:
 
-  Arguments:
+    Reads the current value of every shadowed F12 control register.
+    Registers the firmware does not implement are left invalid.
+
+Arguments:
+
+    ControllerContext - Touch controller context
 
-    ControllerContext - A pointer to the current touch controller
-    context
-    
     SpbContext - A pointer to the current i2c context
 
-  Return Value:
+Return Value:
 
     NTSTATUS indicating success or failure
 
 --*/
 {
-    RMI4_F01_DATA_REGISTERS data;
+    PRMI4_F12_CONTROL_SHADOW shadow;
+    UINT8 regIndex;
     int index;
+    int i;
     NTSTATUS status;
 
-    RtlZeroMemory(&data, sizeof(data));
-    *InterruptStatus = 0;
-
-    //
-    // Locate RMI data base address
-    //
     index = RmiGetFunctionIndex(
         ControllerContext->Descriptors,
         ControllerContext->FunctionCount,
-        RMI4_F01_RMI_DEVICE_CONTROL);
+        RMI4_F12_2D_TOUCHPAD_SENSOR);
 
     if (index == ControllerContext->FunctionCount)
     {
         Trace(
             TRACE_LEVEL_ERROR,
             TRACE_INIT,
-            "Unexpected - RMI Function 01 missing");
+            "Unexpected - RMI Function 12 missing");
 
         status = STATUS_INVALID_DEVICE_STATE;
         goto exit;
@@ -1042,268 +2794,464 @@ RmiCheckInterrupts(
         goto exit;
     }
 
-    //
-    // Read interrupt status registers
-    //
-    status = SpbReadDataSynchronously(
-        SpbContext,
-        ControllerContext->Descriptors[index].DataBase,
-        &data,
-        sizeof(data));
-
-    if (!NT_SUCCESS(status))
+    for (i = 0; i < RMI4_F12_SHADOWED_CONTROLS; i++)
     {
-        Trace(
-            TRACE_LEVEL_ERROR,
-            TRACE_INTERRUPT,
-            "Error reading interrupt status - %!STATUS!",
-            status);
+        shadow = &ControllerContext->F12ControlShadow[i];
 
-        goto exit;
-    }
+        RtlZeroMemory(shadow, sizeof(RMI4_F12_CONTROL_SHADOW));
+        shadow->Register = gF12ShadowedControls[i];
 
-    //
-    // Check for catastrophic failures, simply store in context for
-    // debugging should these errors occur.
-    //
-    switch (data.DeviceStatus.Status)
-    {
-        case RMI4_F01_DATA_STATUS_NO_ERROR:
-        {
-            break;
-        }
-        case RMI4_F01_DATA_STATUS_RESET_OCCURRED:
+        regIndex = RmiGetRegisterIndex(
+            &ControllerContext->ControlRegDesc,
+            shadow->Register);
+
+        if (regIndex == ControllerContext->ControlRegDesc.NumRegisters)
         {
-            ControllerContext->ResetOccurred = TRUE;
-            break;
+            continue;
         }
-        case RMI4_F01_DATA_STATUS_INVALID_CONFIG:
-        {
-            ControllerContext->InvalidConfiguration = TRUE;
 
+        if (ControllerContext->ControlRegDesc.Registers[regIndex].RegisterSize >
+            RMI4_F12_CONTROL_SHADOW_SIZE)
+        {
             Trace(
-                TRACE_LEVEL_ERROR,
-                TRACE_INTERRUPT,
-                "Received status code 2 - invalid configuration");
+                TRACE_LEVEL_WARNING,
+                TRACE_INIT,
+                "F12_2D_Ctrl%d too large to shadow",
+                shadow->Register);
 
-            break;
+            continue;
         }
-        case RMI4_F01_DATA_STATUS_DEVICE_FAILURE:
-        {
-            ControllerContext->DeviceFailure = TRUE;
 
+        //
+        // Packet registers are addressed by their rank among the
+        // registers present
+        //
+        shadow->Offset = regIndex;
+        shadow->Size = (UCHAR) ControllerContext->ControlRegDesc.Registers[regIndex].RegisterSize;
+
+        status = SpbReadDataSynchronously(
+            SpbContext,
+            ControllerContext->Descriptors[index].ControlBase + shadow->Offset,
+            shadow->Data,
+            shadow->Size);
+
+        if (!NT_SUCCESS(status))
+        {
             Trace(
                 TRACE_LEVEL_ERROR,
-                TRACE_INTERRUPT,
-                "Received status code 4 - device failure");
+                TRACE_INIT,
+                "Could not read F12_2D_Ctrl%d register - %!STATUS!",
+                shadow->Register,
+                status);
 
-            break;
+            goto exit;
         }
-        default:
-        {
-            ControllerContext->UnknownStatus = TRUE;
-            ControllerContext->UnknownStatusMessage = data.DeviceStatus.Status;
 
-            Trace(
-                TRACE_LEVEL_ERROR,
-                TRACE_INTERRUPT,
-                "Received unknown status code - %d",
-                ControllerContext->UnknownStatusMessage);
+        shadow->Valid = TRUE;
+    }
 
-            break;
+exit:
+
+    return status;
+}
+
+PRMI4_F12_CONTROL_SHADOW
+RmiGetF12ControlShadow(
+    IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+    IN USHORT Register
+    )
+/*++
+
+Routine Description:
+
+    Returns the shadow of an F12 control register.
+
+Arguments:
+
+    ControllerContext - Touch controller context
+
+    Register - F12 control register number
+
+Return Value:
+
+    The shadow, or NULL if the register is not shadowed or implemented
+
+--*/
+{
+    int i;
+
+    for (i = 0; i < RMI4_F12_SHADOWED_CONTROLS; i++)
+    {
+        if (ControllerContext->F12ControlShadow[i].Valid &&
+            ControllerContext->F12ControlShadow[i].Register == Register)
+        {
+            return &ControllerContext->F12ControlShadow[i];
         }
     }
 
-    //
-    // If we're in flash programming mode, report an error
-    //
-    if (data.DeviceStatus.FlashProg)
+    return NULL;
+}
+
+NTSTATUS
+RmiBatchAddF12ControlShadow(
+    IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+    IN RMI4_WRITE_BATCH* Batch,
+    IN PRMI4_F12_CONTROL_SHADOW Shadow
+    )
+/*++
+
+Routine Description:
+
+    Queues the value held in a control shadow for writing.
+
+Arguments:
+
+    ControllerContext - Touch controller context
+
+    Batch - The batch to append to
+
+    Shadow - The control register shadow to write
+
+Return Value:
+
+    NTSTATUS indicating success or failure
+
+--*/
+{
+    int index;
+
+    index = RmiGetFunctionIndex(
+        ControllerContext->Descriptors,
+        ControllerContext->FunctionCount,
+        RMI4_F12_2D_TOUCHPAD_SENSOR);
+
+    if (index == ControllerContext->FunctionCount)
     {
-        Trace(
-            TRACE_LEVEL_ERROR,
-            TRACE_INTERRUPT,
-            "Error, device status indicates chip in programming mode");
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    return RmiBatchAddWrite(
+        Batch,
+        ControllerContext->FunctionOnPage[index],
+        ControllerContext->Descriptors[index].ControlBase + Shadow->Offset,
+        Shadow->Data,
+        Shadow->Size);
+}
+
+NTSTATUS
+RmiWriteF12ControlShadow(
+    IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+    IN SPB_CONTEXT *SpbContext,
+    IN PRMI4_F12_CONTROL_SHADOW Shadow
+    )
+/*++
+
+Routine Description:
+
+    Programs the controller with the value held in a control shadow.
+
+Arguments:
+
+    ControllerContext - Touch controller context
+
+    SpbContext - A pointer to the current i2c context
+
+    Shadow - The control register shadow to write
+
+Return Value:
+
+    NTSTATUS indicating success or failure
+
+--*/
+{
+    RMI4_WRITE_BATCH batch;
+    NTSTATUS status;
+
+    RmiBatchInitialize(ControllerContext, &batch);
 
+    status = RmiBatchAddF12ControlShadow(
+        ControllerContext,
+        &batch,
+        Shadow);
+
+    if (!NT_SUCCESS(status))
+    {
         goto exit;
     }
 
-    //
-    // If the chip has lost it's configuration, reconfigure
-    //
-    if (data.DeviceStatus.Unconfigured)
+    status = RmiBatchExecute(
+        ControllerContext,
+        SpbContext,
+        &batch);
+
+exit:
+
+    return status;
+}
+
+UCHAR
+RmiGetF12ReportFlagsOffset(
+    IN RMI4_CONTROLLER_CONTEXT* ControllerContext
+    )
+/*++
+
+Routine Description:
+
+    Locates the report flags byte in F12_2D_Ctrl20. It follows the two
+    motion suppression bytes when the firmware implements them.
+
+Arguments:
+
+    ControllerContext - Touch controller context
+
+Return Value:
+
+    Offset of the report flags byte in the register
+
+--*/
+{
+    PRMI_REGISTER_DESC_ITEM item;
+
+    item = RmiGetRegisterDescItem(
+        &ControllerContext->ControlRegDesc,
+        F12_2D_CTRL20);
+
+    if (item != NULL && RmiRegisterDescHasSubpacket(item, 0))
+    {
+        return RMI_F12_CTRL20_SUPPRESSION_SIZE;
+    }
+
+    return 0;
+}
+
+VOID
+RmiApplyF12Tuning(
+    IN RMI4_CONTROLLER_CONTEXT* ControllerContext
+    )
+/*++
+
+Routine Description:
+
+    Maps the 2D sensor settings from the registry onto the F12 control
+    shadows, so the controller suppresses jitter below the position
+    thresholds and reports no dribble after a lift at the source. A
+    zero threshold keeps the firmware default. The shadows are written
+    by the caller.
+
+Arguments:
+
+    ControllerContext - Touch controller context
+
+Return Value:
+
+    None.
+
+--*/
+{
+    RMI4_F11_CTRL_REGISTERS_LOGICAL* settings;
+    PRMI4_F12_CONTROL_SHADOW suppression;
+    UCHAR flagsOffset;
+
+    settings = &ControllerContext->Config.TouchSettings;
+
+    suppression = RmiGetF12ControlShadow(
+        ControllerContext,
+        F12_2D_CTRL20);
+
+    if (suppression == NULL)
     {
         Trace(
-            TRACE_LEVEL_ERROR,
-            TRACE_INTERRUPT,
-            "Error, device status indicates chip is unconfigured");
+            TRACE_LEVEL_WARNING,
+            TRACE_INIT,
+            "F12_2D_Ctrl20 missing, motion suppression left to firmware");
 
-        status = RmiConfigureFunctions(
-            ControllerContext,
-            SpbContext);
+        goto exit;
+    }
 
-        if (!NT_SUCCESS(status))
-        {
-            Trace(
-                TRACE_LEVEL_ERROR,
-                TRACE_INTERRUPT,
-                "Could not reconfigure chip - %!STATUS!",
-                status);
+    flagsOffset = RmiGetF12ReportFlagsOffset(ControllerContext);
 
-            goto exit;
+    if (flagsOffset != 0)
+    {
+        if (settings->DeltaXPosThreshold != 0)
+        {
+            suppression->Data[0] = (BYTE) min(settings->DeltaXPosThreshold, 0xff);
         }
 
+        if (settings->DeltaYPosThreshold != 0)
+        {
+            suppression->Data[1] = (BYTE) min(settings->DeltaYPosThreshold, 0xff);
+        }
     }
 
-    if (data.InterruptStatus[0])
-    {
-        *InterruptStatus = data.InterruptStatus[0] & 0xFF;
-    }
-    else
+    if (ControllerContext->HasDribble && flagsOffset < suppression->Size)
     {
-        Trace(
-            TRACE_LEVEL_VERBOSE,
-            TRACE_INTERRUPT,
-            "Unexpected -- no interrupt status bit set");
+        if (settings->Dribble)
+        {
+            suppression->Data[flagsOffset] |= RMI_F12_ENABLE_DRIBBLE;
+        }
+        else
+        {
+            suppression->Data[flagsOffset] &= ~RMI_F12_ENABLE_DRIBBLE;
+        }
     }
 
+    Trace(
+        TRACE_LEVEL_VERBOSE,
+        TRACE_INIT,
+        "F12 motion suppression %dx%d, dribble %d",
+        flagsOffset != 0 ? suppression->Data[0] : 0,
+        flagsOffset != 0 ? suppression->Data[1] : 0,
+        ControllerContext->HasDribble && settings->Dribble);
+
 exit:
-    return status;
+
+    return;
 }
 
 NTSTATUS
-RmiSetReportingMode(
+RmiQueueReportingMode(
     IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
-    IN SPB_CONTEXT *SpbContext,
+    IN RMI4_WRITE_BATCH* Batch,
     IN UCHAR NewMode,
-    OUT UCHAR *OldMode
-)
+    OUT OPTIONAL UCHAR *OldMode
+    )
 /*++
 
 Routine Description:
 
-Changes the F12 Reporting Mode on the controller as specified
+    Updates the F12 Reporting Mode in the F12_2D_Ctrl20 shadow and queues
+    the register for writing
 
 Arguments:
 
-ControllerContext - Touch controller context
+    ControllerContext - Touch controller context
 
-SpbContext - A pointer to the current i2c context
+    Batch - The batch to append to
 
-NewMode - Either RMI_F12_REPORTING_MODE_CONTINUOUS
-          or RMI_F12_REPORTING_MODE_REDUCED
+    NewMode - Either RMI_F12_REPORTING_MODE_CONTINUOUS
+              or RMI_F12_REPORTING_MODE_REDUCED
 
-OldMode - Old value of reporting mode
+    OldMode - Old value of the whole F12_2D_Ctrl20 report flags byte
 
 Return Value:
 
-NTSTATUS indicating success or failure
+    NTSTATUS indicating success or failure
 
 --*/
 {
-    UCHAR reportingControl[3];
-    int index;
+    PRMI4_F12_CONTROL_SHADOW reportingControl;
+    UCHAR flagsOffset;
     NTSTATUS status;
-    UINT8 indexCtrl20;
-
-    //
-    // Find RMI F12 function
-    //
-    index = RmiGetFunctionIndex(
-        ControllerContext->Descriptors,
-        ControllerContext->FunctionCount,
-        RMI4_F12_2D_TOUCHPAD_SENSOR);
-
-    if (index == ControllerContext->FunctionCount)
-    {
-        Trace(
-            TRACE_LEVEL_ERROR,
-            TRACE_INIT,
-            "Set ReportingMode failure - RMI Function 12 missing");
-
-        status = STATUS_INVALID_DEVICE_STATE;
-        goto exit;
-    }
 
-    status = RmiChangePage(
+    reportingControl = RmiGetF12ControlShadow(
         ControllerContext,
-        SpbContext,
-        ControllerContext->FunctionOnPage[index]);
+        F12_2D_CTRL20);
 
-    if (!NT_SUCCESS(status))
+    if (reportingControl == NULL)
     {
         Trace(
             TRACE_LEVEL_ERROR,
             TRACE_INIT,
-            "Could not change register page");
+            "Cannot find F12_2D_Ctrl20 offset");
 
+        status = STATUS_INVALID_DEVICE_STATE;
         goto exit;
     }
 
-    indexCtrl20 = RmiGetRegisterIndex(&ControllerContext->ControlRegDesc, F12_2D_CTRL20);
+    flagsOffset = RmiGetF12ReportFlagsOffset(ControllerContext);
 
-    if (indexCtrl20 == ControllerContext->ControlRegDesc.NumRegisters)
+    if (flagsOffset >= reportingControl->Size)
     {
         Trace(
             TRACE_LEVEL_ERROR,
             TRACE_INIT,
-            "Cannot find F12_2D_Ctrl20 offset");
+            "Unexpected F12_2D_Ctrl20 register size");
 
         status = STATUS_INVALID_DEVICE_STATE;
         goto exit;
     }
 
-    if (ControllerContext->ControlRegDesc.Registers[indexCtrl20].RegisterSize != sizeof(reportingControl))
+    if (OldMode)
     {
-        Trace(
-            TRACE_LEVEL_ERROR,
-            TRACE_INIT,
-            "Unexpected F12_2D_Ctrl20 register size");
-
-        status = STATUS_INVALID_DEVICE_STATE;
-        goto exit;
+        *OldMode = reportingControl->Data[flagsOffset];
     }
 
     //
-    // Read Device Control register
+    // Assign new value
     //
-    status = SpbReadDataSynchronously(
-        SpbContext,
-        ControllerContext->Descriptors[index].ControlBase + indexCtrl20,
-        &reportingControl,
-        sizeof(reportingControl)
-    );
+    reportingControl->Data[flagsOffset] &= ~RMI_F12_REPORTING_MODE_MASK;
+    reportingControl->Data[flagsOffset] |= NewMode & RMI_F12_REPORTING_MODE_MASK;
+
+    status = RmiBatchAddF12ControlShadow(
+        ControllerContext,
+        Batch,
+        reportingControl);
+
+exit:
+
+    return status;
+}
+
+NTSTATUS
+RmiSetReportingMode(
+    IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+    IN SPB_CONTEXT *SpbContext,
+    IN UCHAR NewMode,
+    OUT UCHAR *OldMode
+)
+/*++
+
+Routine Description:
+
+Changes the F12 Reporting Mode on the controller as specified
+
+Arguments:
+
+ControllerContext - Touch controller context
+
+SpbContext - A pointer to the current i2c context
+
+NewMode - Either RMI_F12_REPORTING_MODE_CONTINUOUS
+          or RMI_F12_REPORTING_MODE_REDUCED
+
+OldMode - Old value of reporting mode
+
+Return Value:
+
+NTSTATUS indicating success or failure
+
+--*/
+{
+    RMI4_WRITE_BATCH batch;
+    PRMI4_F12_CONTROL_SHADOW reportingControl;
+    UCHAR oldControl;
+    NTSTATUS status;
+
+    RmiBatchInitialize(ControllerContext, &batch);
+
+    status = RmiQueueReportingMode(
+        ControllerContext,
+        &batch,
+        NewMode,
+        &oldControl);
 
     if (!NT_SUCCESS(status))
     {
-        Trace(
-            TRACE_LEVEL_ERROR,
-            TRACE_INIT,
-            "Could not read F12_2D_Ctrl20 register - %!STATUS!",
-            status);
-
         goto exit;
     }
 
     if (OldMode)
     {
-        *OldMode = reportingControl[0] & RMI_F12_REPORTING_MODE_MASK;
+        *OldMode = oldControl & RMI_F12_REPORTING_MODE_MASK;
     }
 
     //
-    // Assign new value
-    //
-    reportingControl[0] &= ~RMI_F12_REPORTING_MODE_MASK;
-    reportingControl[0] |= NewMode & RMI_F12_REPORTING_MODE_MASK;
-
-    //
-    // Write setting back to the controller
+    // Write setting to the controller
     //
-    status = SpbWriteDataSynchronously(
+    status = RmiBatchExecute(
+        ControllerContext,
         SpbContext,
-        ControllerContext->Descriptors[index].ControlBase + indexCtrl20,
-        &reportingControl,
-        sizeof(reportingControl)
-    );
+        &batch);
 
     if (!NT_SUCCESS(status))
     {
@@ -1313,6 +3261,12 @@ NTSTATUS indicating success or failure
             "Could not write F12_2D_Ctrl20 register - %X",
             status);
 
+        reportingControl = RmiGetF12ControlShadow(
+            ControllerContext,
+            F12_2D_CTRL20);
+
+        reportingControl->Data[RmiGetF12ReportFlagsOffset(ControllerContext)] =
+            oldControl;
         goto exit;
     }
 
@@ -1348,6 +3302,7 @@ TchStartDevice(
 {
     RMI4_CONTROLLER_CONTEXT* controller;
     ULONG interruptStatus;
+    BOOLEAN cached;
     NTSTATUS status;
 
     controller = (RMI4_CONTROLLER_CONTEXT*) ControllerContext;
@@ -1355,22 +3310,58 @@ TchStartDevice(
     status = STATUS_SUCCESS;
 
     //
-    // Populate context with RMI function descriptors
+    // The function table and F12 register layout only change with the
+    // firmware, reuse them from a previous start when the chip still
+    // reports the same identity
     //
-    status = RmiBuildFunctionsTable(
+    status = RmiLoadDiscoveryCache(
         ControllerContext,
         SpbContext);
 
-    if (!NT_SUCCESS(status))
+    cached = NT_SUCCESS(status);
+
+    if (!cached)
     {
-        Trace(
-            TRACE_LEVEL_ERROR,
-            TRACE_INIT,
-            "Could not build table of RMI functions - %!STATUS!",
-            status);
-        goto exit;
+        //
+        // Populate context with RMI function descriptors
+        //
+        status = RmiBuildFunctionsTable(
+            ControllerContext,
+            SpbContext);
+
+        if (!NT_SUCCESS(status))
+        {
+            Trace(
+                TRACE_LEVEL_ERROR,
+                TRACE_INIT,
+                "Could not build table of RMI functions - %!STATUS!",
+                status);
+            goto exit;
+        }
+
+        //
+        // Discover the F12 packet register layout
+        //
+        status = RmiDiscoverF12Registers(
+            ControllerContext,
+            SpbContext);
+
+        if (!NT_SUCCESS(status))
+        {
+            Trace(
+                TRACE_LEVEL_ERROR,
+                TRACE_INIT,
+                "Could not discover F12 registers - %!STATUS!",
+                status);
+            goto exit;
+        }
     }
 
+    //
+    // Assign interrupt sources to the discovered functions
+    //
+    RmiBuildInterruptMap(controller);
+
     //
     // Initialize RMI function control registers
     //
@@ -1388,11 +3379,52 @@ TchStartDevice(
         goto exit;
     }
 
+    if (!cached)
+    {
+        //
+        // Order interrupt servicing for the discovered layout, the plan
+        // is persisted along with it
+        //
+        RmiBuildServicePlan(controller);
+
+        //
+        // Read and store the firmware version
+        //
+        status = RmiGetFirmwareVersion(
+            ControllerContext,
+            SpbContext);
+
+        if (!NT_SUCCESS(status))
+        {
+            Trace(
+                TRACE_LEVEL_ERROR,
+                TRACE_INIT,
+                "Could not get RMI firmware version - %!STATUS!",
+                status);
+            goto exit;
+        }
+
+        //
+        // Failing to persist the layout only costs the next start a
+        // full discovery
+        //
+        status = RmiSaveDiscoveryCache(controller);
+
+        if (!NT_SUCCESS(status))
+        {
+            Trace(
+                TRACE_LEVEL_WARNING,
+                TRACE_INIT,
+                "Could not store discovery cache - %!STATUS!",
+                status);
+        }
+    }
+
     //
-    // Read and store the firmware version
+    // Preallocate the F12 frame buffers for the discovered packet size
     //
-    status = RmiGetFirmwareVersion(
-        ControllerContext,
+    status = RmiAllocateFrames(
+        controller,
         SpbContext);
 
     if (!NT_SUCCESS(status))
@@ -1400,7 +3432,7 @@ TchStartDevice(
         Trace(
             TRACE_LEVEL_ERROR,
             TRACE_INIT,
-            "Could not get RMI firmware version - %!STATUS!",
+            "Could not allocate F12 frame buffers - %!STATUS!",
             status);
         goto exit;
     }
@@ -1456,6 +3488,101 @@ Return Value:
 
     controller = (RMI4_CONTROLLER_CONTEXT*) ControllerContext;
 
+    Trace(
+        TRACE_LEVEL_INFORMATION,
+        TRACE_INIT,
+        "F12 frames read - %d asynchronously, %d synchronously, "
+        "%d along with the status",
+        controller->Frames.AsyncReads,
+        controller->Frames.SyncReads,
+        controller->Frames.StatusReads);
+
+    Trace(
+        TRACE_LEVEL_INFORMATION,
+        TRACE_INIT,
+        "Capture modes - %d switches to polling, %d interrupt frames "
+        "(%lluus avg), %d polled frames (%lluus avg)",
+        controller->Polling.Switches,
+        controller->Polling.InterruptFrames,
+        controller->Polling.InterruptFrames == 0 ? 0 :
+            controller->Polling.InterruptCaptureTime /
+            controller->Polling.InterruptFrames / 10,
+        controller->Polling.PolledFrames,
+        controller->Polling.PolledFrames == 0 ? 0 :
+            controller->Polling.PolledCaptureTime /
+            controller->Polling.PolledFrames / 10);
+
+    Trace(
+        TRACE_LEVEL_INFORMATION,
+        TRACE_INIT,
+        "Scan PLL - period %lluus, dispatch latency %lluus, %d unlocks, "
+        "%d stale polls",
+        controller->Polling.Pll.Period / 10,
+        controller->Polling.Pll.DispatchLatency / 10,
+        controller->Polling.Pll.Unlocks,
+        controller->Polling.Pll.TotalStalePolls);
+
+    Trace(
+        TRACE_LEVEL_INFORMATION,
+        TRACE_INIT,
+        "Scan intervals - %d measured, %lluus min, %lluus avg, %lluus max, "
+        "%lluus max processing latency",
+        controller->Timing.Intervals,
+        controller->Timing.MinInterval / 10,
+        controller->Timing.AverageInterval / 10,
+        controller->Timing.MaxInterval / 10,
+        controller->Timing.MaxLatency / 10);
+
+    Trace(
+        TRACE_LEVEL_INFORMATION,
+        TRACE_INIT,
+        "Reporting mode governor - %d switches",
+        controller->Governor.Switches);
+
+    Trace(
+        TRACE_LEVEL_INFORMATION,
+        TRACE_INIT,
+        "Doze policy - %d sessions, %d switches, %d started dozing "
+        "(%lluus avg first-touch latency bound), %llums at full scan rate",
+        controller->Doze.Sessions,
+        controller->Doze.Switches,
+        controller->Doze.DozedStarts,
+        controller->Doze.DozedStarts == 0 ? 0 :
+            controller->Doze.FirstTouchLatency /
+            controller->Doze.DozedStarts / 10,
+        controller->Doze.ActiveTime / 10000);
+
+    Trace(
+        TRACE_LEVEL_INFORMATION,
+        TRACE_INIT,
+        "Contact prediction - %dms horizon, %d scored, avg error %llu "
+        "predicted vs %llu unpredicted (sensor units x100)",
+        controller->Config.PredictionHorizon,
+        controller->Prediction.Samples,
+        controller->Prediction.Samples == 0 ? 0 :
+            controller->Prediction.ErrorSum * 100 /
+            controller->Prediction.Samples,
+        controller->Prediction.Samples == 0 ? 0 :
+            controller->Prediction.LagSum * 100 /
+            controller->Prediction.Samples);
+
+    Trace(
+        TRACE_LEVEL_INFORMATION,
+        TRACE_INIT,
+        "Unchanged frame suppression - %d of %d touch frames suppressed",
+        controller->Suppression.Suppressed,
+        controller->Suppression.Frames);
+
+    Trace(
+        TRACE_LEVEL_INFORMATION,
+        TRACE_INIT,
+        "Report rate limiter - %dHz, %d frames coalesced, %d released late",
+        controller->Config.MaxReportRate,
+        controller->RateLimiter.Coalesced,
+        controller->RateLimiter.Released);
+
+    RmiFreeFrames(controller);
+
     return STATUS_SUCCESS;
 }
 
@@ -1528,6 +3655,26 @@ Return Value:
 
     }
 
+    //
+    // Allocate a WDFWAITLOCK serializing the processing of captured
+    // frames into HID reports
+    //
+    status = WdfWaitLockCreate(
+        WDF_NO_OBJECT_ATTRIBUTES,
+        &context->ProcessingLock);
+
+    if (!NT_SUCCESS(status))
+    {
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_INIT,
+            "Could not create processing lock - %!STATUS!",
+            status);
+
+        TchFreeContext(context);
+        goto exit;
+    }
+
     *ControllerContext = context;
 
 exit:
@@ -1566,6 +3713,14 @@ Return Value:
             WdfObjectDelete(controller->ControllerLock);
         }
 
+        if (controller->ProcessingLock != NULL)
+        {
+            WdfObjectDelete(controller->ProcessingLock);
+        }
+
+        RmiArenaFree(&controller->Arena);
+        RmiFreeFrames(controller);
+
         ExFreePoolWithTag(controller, TOUCH_POOL_TAG);
     }
     
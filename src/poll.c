@@ -0,0 +1,889 @@
+/*++
+    Copyright (c) Microsoft Corporation. All Rights Reserved.
+    Sample code. Dealpoint ID #843729.
+
+    Module Name:
+
+        poll.c
+
+    Abstract:
+
+        Switches frame capture between the attention interrupt and
+        timer driven polling. Under sustained touch data the 2D
+        interrupt is masked and frames are read on a schedule kept in
+        phase with the controller scan, sparing the interrupt round
+        trip for every frame.
+
+    Environment:
+
+        Kernel mode
+
+    Revision History:
+
+--*/
+
+#include <compat.h>
+#include <controller.h>
+#include <rmiinternal.h>
+#include <spbtarget.h>
+#include <poll.tmh>
+
+VOID
+RmiPllUpdate(
+    IN RMI4_SCAN_PLL* Pll,
+    IN ULONG64 Timestamp
+    )
+/*++
+
+  Routine Description:
+
+    Feeds the timestamp of an interrupt that carried a frame to the
+    scan PLL. The phase error against the predicted frame corrects both
+    the prediction and, at a lower gain, the period.
+
+  Arguments:
+
+    Pll - The scan PLL
+    Timestamp - Interrupt time of the frame
+
+  Return Value:
+
+    None
+
+--*/
+{
+    LONG64 error;
+    LONG64 window;
+    ULONG64 skipped;
+
+    //
+    // Restart acquisition after a pause in touch data, the period is
+    // kept since the scan rate does not change
+    //
+    if (Pll->LastFrame == 0 ||
+        Timestamp - Pll->LastFrame > RMI4_POLL_MAX_PERIOD * 2)
+    {
+        Pll->LastFrame = Timestamp;
+        Pll->NextFrame = 0;
+        Pll->InLock = 0;
+        Pll->Locked = FALSE;
+        return;
+    }
+
+    if (Pll->NextFrame == 0)
+    {
+        if (Pll->Period == 0)
+        {
+            Pll->Period = min(
+                max(Timestamp - Pll->LastFrame, RMI4_POLL_MIN_PERIOD),
+                RMI4_POLL_MAX_PERIOD);
+        }
+
+        Pll->LastFrame = Timestamp;
+        Pll->NextFrame = Timestamp + Pll->Period;
+        return;
+    }
+
+    Pll->LastFrame = Timestamp;
+
+    //
+    // Frames whose interrupt was collapsed into this one are skipped
+    // over rather than counted as phase error
+    //
+    error = (LONG64) (Timestamp - Pll->NextFrame);
+
+    if (error > (LONG64) Pll->Period / 2)
+    {
+        skipped = ((ULONG64) error + Pll->Period / 2) / Pll->Period;
+        Pll->NextFrame += skipped * Pll->Period;
+        error -= (LONG64) (skipped * Pll->Period);
+    }
+
+    window = (LONG64) Pll->Period / 8;
+
+    if (error <= window && error >= -window)
+    {
+        if (Pll->InLock < RMI4_PLL_LOCK_FRAMES)
+        {
+            Pll->InLock++;
+        }
+
+        if (!Pll->Locked && Pll->InLock == RMI4_PLL_LOCK_FRAMES)
+        {
+            Pll->Locked = TRUE;
+
+            Trace(
+                TRACE_LEVEL_VERBOSE,
+                TRACE_INTERRUPT,
+                "Scan PLL locked, period %lluus",
+                Pll->Period / 10);
+        }
+    }
+    else
+    {
+        Pll->InLock = 0;
+
+        if (Pll->Locked)
+        {
+            Pll->Locked = FALSE;
+            Pll->Unlocks++;
+
+            Trace(
+                TRACE_LEVEL_VERBOSE,
+                TRACE_INTERRUPT,
+                "Scan PLL lost lock, phase error %lldus",
+                error / 10);
+        }
+    }
+
+    //
+    // Loop filter, half the phase error goes to the prediction and a
+    // sixteenth to the period
+    //
+    Pll->Period = (ULONG64) min(
+        max((LONG64) Pll->Period + error / 16, RMI4_POLL_MIN_PERIOD),
+        RMI4_POLL_MAX_PERIOD);
+
+    Pll->NextFrame = (ULONG64) ((LONG64) Pll->NextFrame + error / 2) +
+        Pll->Period;
+}
+
+ULONG
+RmiPllSchedulePoll(
+    IN RMI4_SCAN_PLL* Pll,
+    IN ULONG64 Now
+    )
+/*++
+
+  Routine Description:
+
+    Picks the time of the next poll, a guard time after the predicted
+    frame and ahead by the latency of dispatching the poll.
+
+  Arguments:
+
+    Pll - The scan PLL
+    Now - The current interrupt time
+
+  Return Value:
+
+    The interval to the next poll in microseconds
+
+--*/
+{
+    ULONG64 target;
+    ULONG64 skipped;
+
+    target = Pll->NextFrame + RMI4_PLL_GUARD - Pll->DispatchLatency;
+
+    if (target <= Now)
+    {
+        skipped = (Now - target) / Pll->Period + 1;
+        Pll->NextFrame += skipped * Pll->Period;
+        target += skipped * Pll->Period;
+    }
+
+    Pll->ArmedTime = target;
+
+    return (ULONG) ((target - Now) / 10);
+}
+
+VOID
+RmiTrackCapturedFrame(
+    IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+    IN ULONG64 Timestamp,
+    IN BOOLEAN Captured
+    )
+/*++
+
+  Routine Description:
+
+    Tracks the run of consecutive interrupts that carried touch data and
+    feeds their timestamps to the scan PLL. Called with the controller
+    lock held.
+
+  Arguments:
+
+    ControllerContext - Touch controller context
+    Timestamp - Interrupt time of the interrupt
+    Captured - Whether the interrupt captured a frame
+
+  Return Value:
+
+    None
+
+--*/
+{
+    RMI4_POLLING_STATE* polling;
+
+    polling = &ControllerContext->Polling;
+
+    if (!Captured)
+    {
+        polling->ConsecutiveFrames = 0;
+        return;
+    }
+
+    RmiPllUpdate(&polling->Pll, Timestamp);
+
+    polling->ConsecutiveFrames++;
+}
+
+NTSTATUS
+RmiSetInterruptEnable(
+    IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+    IN SPB_CONTEXT *SpbContext,
+    IN ULONG InterruptEnable
+    )
+/*++
+
+  Routine Description:
+
+    Writes the F01 interrupt enable registers and updates their shadow.
+
+  Arguments:
+
+    ControllerContext - Touch controller context
+    SpbContext - A pointer to the current i2c context
+    InterruptEnable - The new interrupt enable mask
+
+  Return Value:
+
+    NTSTATUS indicating success or failure
+
+--*/
+{
+    RMI4_WRITE_BATCH batch;
+    BYTE oldEnable[RMI4_MAX_INTERRUPT_REGISTERS];
+    int index;
+    NTSTATUS status;
+
+    index = RmiGetFunctionIndex(
+        ControllerContext->Descriptors,
+        ControllerContext->FunctionCount,
+        RMI4_F01_RMI_DEVICE_CONTROL);
+
+    if (index == ControllerContext->FunctionCount ||
+        !ControllerContext->F01ControlShadowValid)
+    {
+        status = STATUS_INVALID_DEVICE_STATE;
+        goto exit;
+    }
+
+    RtlCopyMemory(
+        oldEnable,
+        ControllerContext->F01ControlShadow.InterruptEnable,
+        sizeof(oldEnable));
+
+    RmiPackInterruptMask(
+        InterruptEnable,
+        ControllerContext->F01ControlShadow.InterruptEnable,
+        ControllerContext->Interrupts.Registers);
+
+    RmiBatchInitialize(ControllerContext, &batch);
+
+    status = RmiBatchAddWrite(
+        &batch,
+        ControllerContext->FunctionOnPage[index],
+        ControllerContext->Descriptors[index].ControlBase +
+            FIELD_OFFSET(RMI4_F01_CTRL_REGISTERS, InterruptEnable),
+        ControllerContext->F01ControlShadow.InterruptEnable,
+        ControllerContext->Interrupts.Registers);
+
+    if (NT_SUCCESS(status))
+    {
+        status = RmiBatchExecute(
+            ControllerContext,
+            SpbContext,
+            &batch);
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        RtlCopyMemory(
+            ControllerContext->F01ControlShadow.InterruptEnable,
+            oldEnable,
+            sizeof(oldEnable));
+    }
+
+exit:
+
+    return status;
+}
+
+BOOLEAN
+TchMaskInterrupts(
+    IN VOID *ControllerContext,
+    IN SPB_CONTEXT *SpbContext
+    )
+/*++
+
+  Routine Description:
+
+    Masks every F01 interrupt source during an interrupt storm, so that
+    the attention line is released instead of the ISR being held. The
+    masked sources are remembered for TchUnmaskInterrupts.
+
+  Arguments:
+
+    ControllerContext - Touch controller context
+    SpbContext - A pointer to the current i2c context
+
+  Return Value:
+
+    TRUE if the caller must arm the timer unmasking the interrupts
+
+--*/
+{
+    RMI4_CONTROLLER_CONTEXT* controller;
+    BOOLEAN masked = FALSE;
+    ULONG enabled;
+    NTSTATUS status;
+
+    controller = (RMI4_CONTROLLER_CONTEXT*) ControllerContext;
+
+    WdfWaitLockAcquire(controller->ControllerLock, NULL);
+
+    if (controller->StormMask != 0)
+    {
+        goto exit;
+    }
+
+    enabled = RmiUnpackInterruptMask(
+        controller->F01ControlShadow.InterruptEnable,
+        controller->Interrupts.Registers);
+
+    if (enabled == 0)
+    {
+        goto exit;
+    }
+
+    status = RmiSetInterruptEnable(controller, SpbContext, 0);
+
+    if (!NT_SUCCESS(status))
+    {
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_INTERRUPT,
+            "Could not mask interrupts - %!STATUS!",
+            status);
+
+        goto exit;
+    }
+
+    controller->StormMask = enabled;
+    masked = TRUE;
+
+exit:
+
+    WdfWaitLockRelease(controller->ControllerLock);
+
+    return masked;
+}
+
+NTSTATUS
+RmiUnmaskInterrupts(
+    IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+    IN SPB_CONTEXT *SpbContext
+    )
+/*++
+
+  Routine Description:
+
+    Restores the interrupt sources masked during an interrupt storm.
+    The touch interrupt stays masked if polling started meanwhile.
+    Called with the controller lock held.
+
+  Arguments:
+
+    ControllerContext - Touch controller context
+    SpbContext - A pointer to the current i2c context
+
+  Return Value:
+
+    NTSTATUS indicating success or failure
+
+--*/
+{
+    ULONG restore;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    restore = ControllerContext->StormMask;
+
+    if (restore == 0)
+    {
+        goto exit;
+    }
+
+    if (ControllerContext->Polling.Active)
+    {
+        restore &= ~ControllerContext->Interrupts.Touch;
+    }
+
+    status = RmiSetInterruptEnable(
+        ControllerContext,
+        SpbContext,
+        RmiUnpackInterruptMask(
+            ControllerContext->F01ControlShadow.InterruptEnable,
+            ControllerContext->Interrupts.Registers) |
+        restore);
+
+    if (!NT_SUCCESS(status))
+    {
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_INTERRUPT,
+            "Could not unmask interrupts - %!STATUS!",
+            status);
+
+        goto exit;
+    }
+
+    ControllerContext->StormMask = 0;
+
+exit:
+
+    return status;
+}
+
+BOOLEAN
+TchUnmaskInterrupts(
+    IN VOID *ControllerContext,
+    IN SPB_CONTEXT *SpbContext
+    )
+/*++
+
+  Routine Description:
+
+    Called when the storm backoff expired, restores the interrupt
+    sources masked by TchMaskInterrupts.
+
+  Arguments:
+
+    ControllerContext - Touch controller context
+    SpbContext - A pointer to the current i2c context
+
+  Return Value:
+
+    TRUE if the interrupts are still masked and the caller must retry
+
+--*/
+{
+    RMI4_CONTROLLER_CONTEXT* controller;
+    NTSTATUS status;
+
+    controller = (RMI4_CONTROLLER_CONTEXT*) ControllerContext;
+
+    WdfWaitLockAcquire(controller->ControllerLock, NULL);
+
+    status = RmiUnmaskInterrupts(controller, SpbContext);
+
+    WdfWaitLockRelease(controller->ControllerLock);
+
+    return !NT_SUCCESS(status);
+}
+
+VOID
+RmiStopPolling(
+    IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+    IN SPB_CONTEXT *SpbContext
+    )
+/*++
+
+  Routine Description:
+
+    Leaves polling mode and re-enables the touch attention interrupt.
+    Called with the controller lock held.
+
+  Arguments:
+
+    ControllerContext - Touch controller context
+    SpbContext - A pointer to the current i2c context
+
+  Return Value:
+
+    None
+
+--*/
+{
+    RMI4_POLLING_STATE* polling;
+    NTSTATUS status;
+
+    polling = &ControllerContext->Polling;
+
+    if (!polling->Active)
+    {
+        return;
+    }
+
+    polling->Active = FALSE;
+    polling->ConsecutiveFrames = 0;
+    polling->IdleFrames = 0;
+
+    //
+    // The PLL reacquires the phase from the next interrupts
+    //
+    polling->Pll.LastFrame = 0;
+    polling->Pll.ArmedTime = 0;
+    polling->Pll.StalePolls = 0;
+
+    status = RmiSetInterruptEnable(
+        ControllerContext,
+        SpbContext,
+        RmiUnpackInterruptMask(
+            ControllerContext->F01ControlShadow.InterruptEnable,
+            ControllerContext->Interrupts.Registers) |
+        ControllerContext->Interrupts.Touch);
+
+    if (!NT_SUCCESS(status))
+    {
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_INTERRUPT,
+            "Could not re-enable touch interrupt - %!STATUS!",
+            status);
+    }
+    else
+    {
+        Trace(
+            TRACE_LEVEL_VERBOSE,
+            TRACE_INTERRUPT,
+            "Switched to interrupt mode");
+    }
+}
+
+BOOLEAN
+TchUpdateInterruptMode(
+    IN VOID *ControllerContext,
+    IN SPB_CONTEXT *SpbContext,
+    OUT ULONG *PollInterval
+    )
+/*++
+
+  Routine Description:
+
+    Called after an interrupt was serviced. Once enough consecutive
+    interrupts carried touch data, masks the 2D attention interrupt so
+    that frames are polled instead. Polling is only scheduled from a
+    locked scan PLL, otherwise interrupts are kept.
+
+  Arguments:
+
+    ControllerContext - Touch controller context
+    SpbContext - A pointer to the current i2c context
+    PollInterval - Receives the polling interval in microseconds
+
+  Return Value:
+
+    TRUE if the caller must start polling
+
+--*/
+{
+    RMI4_CONTROLLER_CONTEXT* controller;
+    RMI4_POLLING_STATE* polling;
+    BOOLEAN startPolling = FALSE;
+    NTSTATUS status;
+
+    controller = (RMI4_CONTROLLER_CONTEXT*) ControllerContext;
+    polling = &controller->Polling;
+
+    WdfWaitLockAcquire(controller->ControllerLock, NULL);
+
+    if (polling->Active ||
+        controller->Config.PollingThreshold == 0 ||
+        polling->ConsecutiveFrames < controller->Config.PollingThreshold ||
+        !polling->Pll.Locked ||
+        controller->Frames.Size == 0)
+    {
+        goto exit;
+    }
+
+    status = RmiSetInterruptEnable(
+        controller,
+        SpbContext,
+        RmiUnpackInterruptMask(
+            controller->F01ControlShadow.InterruptEnable,
+            controller->Interrupts.Registers) &
+        ~controller->Interrupts.Touch);
+
+    if (!NT_SUCCESS(status))
+    {
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_INTERRUPT,
+            "Could not mask touch interrupt - %!STATUS!",
+            status);
+
+        //
+        // Do not retry on every interrupt
+        //
+        polling->ConsecutiveFrames = 0;
+        goto exit;
+    }
+
+    polling->Active = TRUE;
+    polling->IdleFrames = 0;
+    polling->Pll.StalePolls = 0;
+    polling->Switches++;
+
+    *PollInterval = RmiPllSchedulePoll(
+        &polling->Pll,
+        KeQueryInterruptTime());
+
+    Trace(
+        TRACE_LEVEL_VERBOSE,
+        TRACE_INTERRUPT,
+        "Switched to polling every %lluus",
+        polling->Pll.Period / 10);
+
+    startPolling = TRUE;
+
+exit:
+
+    WdfWaitLockRelease(controller->ControllerLock);
+
+    return startPolling;
+}
+
+BOOLEAN
+TchPollFrame(
+    IN VOID *ControllerContext,
+    IN SPB_CONTEXT *SpbContext,
+    OUT BOOLEAN *FrameCaptured,
+    OUT ULONG *PollInterval
+    )
+/*++
+
+  Routine Description:
+
+    Reads a frame in polling mode and queues it to the processing stage.
+    The interrupt status tells whether the controller scanned a new
+    frame since the last poll, which keeps the scan PLL in phase: a poll
+    that comes too early moves the phase later, and each new frame moves
+    it slightly earlier. Interrupts are restored once the sensor stayed
+    empty for the configured number of frames, when the PLL drifted off
+    the scan, or if a read fails.
+
+  Arguments:
+
+    ControllerContext - Touch controller context
+    SpbContext - A pointer to the current i2c context
+    FrameCaptured - Receives whether a frame was queued
+    PollInterval - Receives the interval to the next poll in microseconds
+
+  Return Value:
+
+    TRUE if polling continues
+
+--*/
+{
+    RMI4_CONTROLLER_CONTEXT* controller;
+    RMI4_POLLING_STATE* polling;
+    RMI4_SCAN_PLL* pll;
+    BOOLEAN keepPolling = FALSE;
+    BOOLEAN frameRead = FALSE;
+    ULONG interruptStatus = 0;
+    BYTE buttons = 0;
+    ULONG64 timestamp;
+    ULONG64 sampleTime;
+    NTSTATUS status;
+
+    controller = (RMI4_CONTROLLER_CONTEXT*) ControllerContext;
+    polling = &controller->Polling;
+    pll = &polling->Pll;
+    *FrameCaptured = FALSE;
+
+    WdfWaitLockAcquire(controller->ControllerLock, NULL);
+
+    if (!polling->Active)
+    {
+        goto exit;
+    }
+
+    timestamp = KeQueryInterruptTime();
+
+    //
+    // Learn how late the poll runs after its timer was due, so that the
+    // next one is armed ahead by that much
+    //
+    if (pll->ArmedTime != 0 && timestamp > pll->ArmedTime)
+    {
+        pll->DispatchLatency = min(
+            (pll->DispatchLatency * 7 + (timestamp - pll->ArmedTime)) / 8,
+            pll->Period / 2);
+    }
+
+    //
+    // Fetch the status along with the frame when possible, a stale
+    // frame is simply dropped
+    //
+    status = RmiReadFrameAndStatus(
+        controller,
+        SpbContext,
+        &interruptStatus);
+
+    if (status == STATUS_NOT_SUPPORTED)
+    {
+        status = RmiCheckInterrupts(
+            controller,
+            SpbContext,
+            &interruptStatus);
+    }
+    else
+    {
+        frameRead = TRUE;
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_INTERRUPT,
+            "Error polling interrupt status - %!STATUS!",
+            status);
+
+        RmiStopPolling(controller, SpbContext);
+        goto exit;
+    }
+
+    //
+    // The device status was handled along with the status read
+    //
+    interruptStatus &=
+        controller->Interrupts.Serviced & ~controller->Interrupts.DeviceStatus;
+
+    if (!(interruptStatus & controller->Interrupts.Touch))
+    {
+        //
+        // A button event acknowledged by this status read must still
+        // reach the processing stage
+        //
+        if ((interruptStatus & controller->Interrupts.Buttons) &&
+            NT_SUCCESS(RmiReadButtons(controller, SpbContext, &buttons)) &&
+            NT_SUCCESS(RmiQueueFrame(
+                controller,
+                timestamp,
+                controller->Interrupts.Buttons,
+                buttons)))
+        {
+            *FrameCaptured = TRUE;
+        }
+
+        //
+        // Polled ahead of the scan, the frame is still the last one
+        //
+        pll->StalePolls++;
+        pll->TotalStalePolls++;
+
+        if (pll->StalePolls == RMI4_PLL_MAX_STALE_POLLS)
+        {
+            pll->Locked = FALSE;
+            pll->InLock = 0;
+            pll->Unlocks++;
+
+            Trace(
+                TRACE_LEVEL_VERBOSE,
+                TRACE_INTERRUPT,
+                "Scan PLL drifted, falling back to interrupts");
+
+            RmiStopPolling(controller, SpbContext);
+            goto exit;
+        }
+
+        pll->NextFrame += pll->Period / 16;
+
+        *PollInterval = RmiPllSchedulePoll(pll, KeQueryInterruptTime());
+        keepPolling = TRUE;
+        goto exit;
+    }
+
+    //
+    // The frame completed at its predicted time rather than when this
+    // poll happened to run, which is what its reports are stamped with
+    //
+    sampleTime = min(pll->NextFrame, timestamp);
+
+    pll->StalePolls = 0;
+    pll->NextFrame += pll->Period - pll->Period / 128;
+
+    if (!frameRead)
+    {
+        status = RmiStartFrameRead(controller, SpbContext, FALSE);
+
+        if (NT_SUCCESS(status))
+        {
+            status = RmiFinishFrameRead(controller, SpbContext);
+        }
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_INTERRUPT,
+            "Error polling touch data - %!STATUS!",
+            status);
+
+        RmiStopPolling(controller, SpbContext);
+        goto exit;
+    }
+
+    if (RmiFrameHasObjects(
+        controller,
+        controller->Frames.Buffer[controller->Frames.Front]))
+    {
+        polling->IdleFrames = 0;
+    }
+    else
+    {
+        polling->IdleFrames++;
+    }
+
+    //
+    // Queue the frame even when empty, it carries the lift of the last
+    // contacts
+    //
+    if ((interruptStatus & controller->Interrupts.Buttons) &&
+        !NT_SUCCESS(RmiReadButtons(controller, SpbContext, &buttons)))
+    {
+        interruptStatus &= ~controller->Interrupts.Buttons;
+    }
+
+    status = RmiQueueFrame(
+        controller,
+        sampleTime,
+        interruptStatus,
+        buttons);
+
+    if (NT_SUCCESS(status))
+    {
+        *FrameCaptured = TRUE;
+
+        polling->PolledFrames++;
+        polling->PolledCaptureTime += KeQueryInterruptTime() - timestamp;
+    }
+
+    if (polling->IdleFrames >= controller->Config.PollingIdleFrames)
+    {
+        RmiStopPolling(controller, SpbContext);
+        goto exit;
+    }
+
+    *PollInterval = RmiPllSchedulePoll(pll, KeQueryInterruptTime());
+    keepPolling = TRUE;
+
+exit:
+
+    //
+    // Resting contacts stop the scan updates in reduced reporting, the
+    // stale polls then bring back the interrupt
+    //
+    if (polling->Active)
+    {
+        RmiApplyReportingMode(controller, SpbContext);
+    }
+
+    WdfWaitLockRelease(controller->ControllerLock);
+
+    return keepPolling;
+}
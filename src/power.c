@@ -21,7 +21,7 @@
 #include <compat.h>
 #include <controller.h>
 #include <rmiinternal.h>
-#include <spb.h>
+#include <spbtarget.h>
 #include <power.tmh>
 
 NTSTATUS
@@ -52,11 +52,12 @@ Return Value:
 --*/
 {
     RMI4_F01_CTRL_REGISTERS* controlF01;
-    UCHAR deviceControl;
+    RMI4_WRITE_BATCH batch;
+    UCHAR oldControl;
     int index;
     NTSTATUS status;
 
-    controlF01 = (RMI4_F01_CTRL_REGISTERS*) &deviceControl;
+    controlF01 = &ControllerContext->F01ControlShadow;
 
     //
     // Find RMI device control function housing sleep settings
@@ -77,68 +78,178 @@ Return Value:
         goto exit;
     }
 
-    status = RmiChangePage(
-        ControllerContext,
-        SpbContext,
-        ControllerContext->FunctionOnPage[index]);
-
-    if (!NT_SUCCESS(status))
+    //
+    // The shadow is filled when the controller is configured, only read
+    // Device Control register if that has not happened
+    //
+    if (!ControllerContext->F01ControlShadowValid)
     {
-        Trace(
-            TRACE_LEVEL_ERROR,
-            TRACE_POWER,
-            "Could not change register page");
-
-        goto exit;
+        status = RmiReadF01Control(
+            ControllerContext,
+            SpbContext,
+            controlF01);
+
+        if (!NT_SUCCESS(status))
+        {
+            Trace(
+                TRACE_LEVEL_ERROR,
+                TRACE_POWER,
+                "Could not read sleep register - %!STATUS!",
+                status);
+
+            goto exit;
+        }
+
+        ControllerContext->F01ControlShadowValid = TRUE;
     }
 
     //
-    // Read Device Control register
+    // Assign new sleep state
     //
-    status = SpbReadDataSynchronously(
-        SpbContext,
+    oldControl = controlF01->DeviceControl.All;
+    controlF01->DeviceControl.SleepMode = SleepState;
+
+    //
+    // Write setting to the controller, along with the page select when
+    // needed, in one sequence
+    //
+    RmiBatchInitialize(ControllerContext, &batch);
+
+    status = RmiBatchAddWrite(
+        &batch,
+        ControllerContext->FunctionOnPage[index],
         ControllerContext->Descriptors[index].ControlBase,
-        &deviceControl,
-        sizeof(deviceControl)
-        );
+        &controlF01->DeviceControl.All,
+        sizeof(controlF01->DeviceControl.All));
+
+    if (NT_SUCCESS(status))
+    {
+        status = RmiBatchExecute(
+            ControllerContext,
+            SpbContext,
+            &batch);
+    }
 
     if (!NT_SUCCESS(status))
     {
         Trace(
             TRACE_LEVEL_ERROR,
             TRACE_POWER,
-            "Could not read sleep register - %!STATUS!",
+            "Could not write sleep register - %X",
             status);
 
+        controlF01->DeviceControl.All = oldControl;
         goto exit;
     }
 
+exit:
+
+    return status;
+}
+
+NTSTATUS
+RmiResumeController(
+    IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+    IN SPB_CONTEXT *SpbContext
+    )
+/*++
+
+Routine Description:
+
+   Puts the controller back into operating mode from the control
+   shadows, without reading anything from the chip. Device control,
+   interrupt enables and doze settings are written in one SPB sequence,
+   preceded by the F12 controls when the controller lost power in D3.
+   Called before the framework unmasks the interrupt.
+
+Arguments:
+
+   ControllerContext - Touch controller context
+   
+   SpbContext - A pointer to the current i2c context
+
+Return Value:
+
+   NTSTATUS indicating success or failure
+
+--*/
+{
+    RMI4_F01_CTRL_REGISTERS* controlF01;
+    RMI4_WRITE_BATCH batch;
+    UCHAR oldControl;
+    int i;
+    NTSTATUS status;
+
+    controlF01 = &ControllerContext->F01ControlShadow;
+
     //
-    // Assign new sleep state
+    // A power cycle returned the page select register to its default,
+    // force the next page change to be written
     //
-    controlF01->DeviceControl.SleepMode = SleepState;
+    if (ControllerContext->Config.PepRemovesVoltageInD3)
+    {
+        ControllerContext->CurrentPage = RMI4_INVALID_PAGE;
+    }
 
     //
-    // Write setting back to the controller
+    // Without a shadow the sleep state is changed the slow way
     //
-    status = SpbWriteDataSynchronously(
-        SpbContext,
-        ControllerContext->Descriptors[index].ControlBase,
-        &deviceControl,
-        sizeof(deviceControl)
-        );
-
-    if (!NT_SUCCESS(status))
+    if (!ControllerContext->F01ControlShadowValid)
     {
-        Trace(
-            TRACE_LEVEL_ERROR,
-            TRACE_POWER,
-            "Could not write sleep register - %X",
-            status);
+        status = RmiChangeSleepState(
+            ControllerContext,
+            SpbContext,
+            RMI4_F01_DEVICE_CONTROL_SLEEP_MODE_OPERATING);
 
         goto exit;
     }
 
+    oldControl = controlF01->DeviceControl.All;
+    controlF01->DeviceControl.SleepMode =
+        RMI4_F01_DEVICE_CONTROL_SLEEP_MODE_OPERATING;
+
+    RmiBatchInitialize(ControllerContext, &batch);
+
+    status = STATUS_SUCCESS;
+
+    if (ControllerContext->Config.PepRemovesVoltageInD3)
+    {
+        for (i = 0; i < RMI4_F12_SHADOWED_CONTROLS && NT_SUCCESS(status); i++)
+        {
+            if (ControllerContext->F12ControlShadow[i].Valid)
+            {
+                status = RmiBatchAddF12ControlShadow(
+                    ControllerContext,
+                    &batch,
+                    &ControllerContext->F12ControlShadow[i]);
+            }
+        }
+    }
+
+    //
+    // F01 goes last since it carries the Configured bit
+    //
+    if (NT_SUCCESS(status))
+    {
+        status = RmiBatchAddF01Control(
+            ControllerContext,
+            &batch,
+            controlF01);
+    }
+
+    if (NT_SUCCESS(status))
+    {
+        status = RmiBatchExecute(
+            ControllerContext,
+            SpbContext,
+            &batch);
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        controlF01->DeviceControl.All = oldControl;
+    }
+
 exit:
 
     return status;
@@ -185,10 +296,9 @@ Return Value:
     //
     // Attempt to put the controller into operating mode 
     //
-    status = RmiChangeSleepState(
+    status = RmiResumeController(
         controller,
-        SpbContext,
-        RMI4_F01_DEVICE_CONTROL_SLEEP_MODE_OPERATING);
+        SpbContext);
 
     if (!NT_SUCCESS(status))
     {
@@ -239,6 +349,33 @@ Return Value:
     //
     WdfWaitLockAcquire(controller->ControllerLock, NULL);
 
+    //
+    // Go back to interrupt mode so that the next wake starts from it
+    //
+    RmiStopPolling(controller, SpbContext);
+
+    //
+    // Interrupts masked against a storm are enabled again on wake, even
+    // if they could not be unmasked now
+    //
+    if (!NT_SUCCESS(RmiUnmaskInterrupts(controller, SpbContext)))
+    {
+        RmiPackInterruptMask(
+            RmiUnpackInterruptMask(
+                controller->F01ControlShadow.InterruptEnable,
+                controller->Interrupts.Registers) |
+            controller->StormMask,
+            controller->F01ControlShadow.InterruptEnable,
+            controller->Interrupts.Registers);
+
+        controller->StormMask = 0;
+    }
+
+    //
+    // Likewise for the idle doze profile
+    //
+    RmiResetDozePolicy(controller, SpbContext);
+
     //
     // Put the chip in sleep mode
     //
@@ -259,12 +396,21 @@ Return Value:
     controller->DevicePowerState = PowerDeviceD3;
 
     //
-    // Invalidate state
+    // Invalidate state, dropping frames captured but not yet processed
     //
+    WdfWaitLockAcquire(controller->ProcessingLock, NULL);
+
+    while (RmiRingFront(&controller->Ring) != NULL)
+    {
+        RmiRingPop(&controller->Ring);
+    }
+
+    controller->InterruptStatus = 0;
     controller->TouchesReported = 0;
     controller->TouchesTotal = 0;
     controller->Cache.FingerSlotValid = 0;
     controller->Cache.FingerSlotDirty = 0;
+    controller->Cache.FingerSlotNew = 0;
     controller->Cache.FingerDownCount = 0;
 
     controller->PensReported = 0;
@@ -273,6 +419,22 @@ Return Value:
     controller->PenCache.PenSlotDirty = 0;
     controller->PenCache.PenDownCount = 0;
 
+    controller->TouchReportDue = FALSE;
+    controller->PenReportDue = FALSE;
+
+    controller->Governor.LastValid = 0;
+    controller->Governor.StillFrames = 0;
+
+    RtlZeroMemory(
+        controller->Prediction.Contact,
+        sizeof(controller->Prediction.Contact));
+
+    controller->Suppression.ReportedValid = 0;
+    controller->RateLimiter.Held = FALSE;
+    controller->RateLimiter.ReportedValid = 0;
+
+    WdfWaitLockRelease(controller->ProcessingLock);
+
     WdfWaitLockRelease(controller->ControllerLock);
 
     return STATUS_SUCCESS;
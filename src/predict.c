@@ -0,0 +1,298 @@
+/*++
+    Copyright (c) Microsoft Corporation. All Rights Reserved.
+    Sample code. Dealpoint ID #843729.
+
+    Module Name:
+
+        predict.c
+
+    Abstract:
+
+        Optional contact prediction stage between the finger cache and
+        the HID reports. Each contact is smoothed by a fixed-point 1 Euro
+        filter, whose cutoff rises with speed so slow motion loses its
+        jitter while fast motion keeps up, and is extrapolated along its
+        filtered velocity by the configured horizon.
+
+    Environment:
+
+        Kernel mode
+
+    Revision History:
+
+--*/
+
+#include <compat.h>
+#include <controller.h>
+#include <rmiinternal.h>
+#include <predict.tmh>
+
+LONG64
+RmiFilterAlpha(
+    IN ULONG64 Interval,
+    IN ULONG64 Cutoff
+    )
+/*++
+
+  Routine Description:
+
+    Computes the smoothing factor of a first order low-pass filter,
+    alpha = 1 / (1 + tau / dt) with tau = 1 / (2 pi fc).
+
+  Arguments:
+
+    Interval - Time since the previous sample in 100us units
+    Cutoff - Cutoff frequency in mHz
+
+  Return Value:
+
+    The smoothing factor in Q16
+
+--*/
+{
+    ULONG64 tau;
+
+    tau = RMI4_PREDICT_TAU_SCALE / max(Cutoff, 1);
+
+    return (LONG64) ((Interval << 16) / (Interval + tau));
+}
+
+LONG
+RmiClampCoordinate(
+    IN LONG64 Value,
+    IN ULONG Range
+    )
+/*++
+
+  Routine Description:
+
+    Keeps an extrapolated coordinate on the sensor.
+
+  Arguments:
+
+    Value - The coordinate
+    Range - The size of the sensor along the axis, zero if unknown
+
+  Return Value:
+
+    The clamped coordinate
+
+--*/
+{
+    if (Value < 0)
+    {
+        return 0;
+    }
+
+    if (Range != 0 && Value >= (LONG64) Range)
+    {
+        return (LONG) Range - 1;
+    }
+
+    return (LONG) Value;
+}
+
+ULONG64
+RmiContactDistance(
+    IN LONG64 DeltaX,
+    IN LONG64 DeltaY
+    )
+/*++
+
+  Routine Description:
+
+    Computes the Manhattan distance of a position error.
+
+  Arguments:
+
+    DeltaX - Error along X
+    DeltaY - Error along Y
+
+  Return Value:
+
+    The distance in sensor units
+
+--*/
+{
+    return (ULONG64) ((DeltaX < 0 ? -DeltaX : DeltaX) +
+        (DeltaY < 0 ? -DeltaY : DeltaY));
+}
+
+VOID
+RmiFilterAxis(
+    IN OUT LONG64* Position,
+    IN OUT LONG64* Velocity,
+    IN LONG Sample,
+    IN ULONG64 Interval,
+    IN ULONG64 Cutoff
+    )
+/*++
+
+  Routine Description:
+
+    Runs one axis of the filter for a new sample.
+
+  Arguments:
+
+    Position - Filtered position in Q8 sensor units
+    Velocity - Filtered velocity in Q8 sensor units per second
+    Sample - The new raw position
+    Interval - Time since the previous sample in 100us units
+    Cutoff - Position cutoff frequency in mHz
+
+  Return Value:
+
+    None.
+
+--*/
+{
+    LONG64 sample;
+    LONG64 rawVelocity;
+    LONG64 alpha;
+
+    sample = (LONG64) Sample << 8;
+
+    //
+    // The velocity is smoothed with a fixed cutoff first, it drives the
+    // cutoff of the position
+    //
+    rawVelocity = (sample - *Position) * 10000 / (LONG64) Interval;
+    alpha = RmiFilterAlpha(Interval, RMI4_PREDICT_VELOCITY_CUTOFF);
+    *Velocity += ((rawVelocity - *Velocity) * alpha) >> 16;
+
+    alpha = RmiFilterAlpha(Interval, Cutoff);
+    *Position += ((sample - *Position) * alpha) >> 16;
+}
+
+VOID
+RmiPredictContacts(
+    IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+    IN RMI4_FINGER_CACHE* Cache
+    )
+/*++
+
+  Routine Description:
+
+    Filters the contacts just updated in the finger cache and replaces
+    their positions by the predicted ones. Lifted contacts are reported
+    at their last filtered position. Called with the processing lock
+    held, once per frame.
+
+    For evaluating the horizon, a contact's prediction is kept along
+    with its target time and scored against the first sample at or after
+    that time. The error of reporting the filtered position unpredicted
+    is scored alongside, for comparison.
+
+  Arguments:
+
+    ControllerContext - Touch controller context
+    Cache - The finger cache, updated from the frame
+
+  Return Value:
+
+    None.
+
+--*/
+{
+    RMI4_PREDICTION_STATE* prediction;
+    RMI4_CONTACT_FILTER* filter;
+    RMI4_FINGER_INFO* slot;
+    ULONG64 interval;
+    ULONG64 speed;
+    ULONG64 cutoff;
+    LONG64 horizon;
+    int i;
+
+    prediction = &ControllerContext->Prediction;
+    horizon = ControllerContext->Config.PredictionHorizon;
+
+    if (horizon == 0)
+    {
+        return;
+    }
+
+    for (i = 0; i < RMI4_MAX_TOUCHES; i++)
+    {
+        filter = &prediction->Contact[i];
+        slot = &Cache->FingerSlot[i];
+
+        if (!(Cache->FingerSlotValid & (1 << i)) &&
+            !(Cache->FingerSlotDirty & (1 << i)))
+        {
+            filter->Valid = FALSE;
+            continue;
+        }
+
+        //
+        // A lift is reported where the contact was last seen
+        //
+        if (slot->fingerStatus == RMI4_FINGER_STATE_NOT_PRESENT)
+        {
+            if (filter->Valid)
+            {
+                slot->x = (int) (filter->X >> 8);
+                slot->y = (int) (filter->Y >> 8);
+            }
+
+            filter->Valid = FALSE;
+            continue;
+        }
+
+        interval = (Cache->ScanTime - filter->LastTime) / 1000;
+
+        if (!filter->Valid || interval == 0 ||
+            interval > RMI4_PREDICT_MAX_INTERVAL)
+        {
+            filter->X = (LONG64) slot->x << 8;
+            filter->Y = (LONG64) slot->y << 8;
+            filter->VelocityX = 0;
+            filter->VelocityY = 0;
+            filter->LastTime = Cache->ScanTime;
+            filter->Valid = TRUE;
+            filter->PendingValid = FALSE;
+            continue;
+        }
+
+        //
+        // Score the pending prediction once its target time is reached
+        //
+        if (filter->PendingValid && Cache->ScanTime >= filter->PendingTime)
+        {
+            prediction->ErrorSum += RmiContactDistance(
+                filter->PendingX - slot->x,
+                filter->PendingY - slot->y);
+            prediction->LagSum += RmiContactDistance(
+                filter->BaseX - slot->x,
+                filter->BaseY - slot->y);
+            prediction->Samples++;
+            filter->PendingValid = FALSE;
+        }
+
+        speed = (ULONG64) (
+            (filter->VelocityX < 0 ? -filter->VelocityX : filter->VelocityX) +
+            (filter->VelocityY < 0 ? -filter->VelocityY : filter->VelocityY)) >> 8;
+        cutoff = ControllerContext->Config.PredictionMinCutoff +
+            ControllerContext->Config.PredictionBeta * speed;
+
+        RmiFilterAxis(&filter->X, &filter->VelocityX, slot->x, interval, cutoff);
+        RmiFilterAxis(&filter->Y, &filter->VelocityY, slot->y, interval, cutoff);
+        filter->LastTime = Cache->ScanTime;
+
+        slot->x = RmiClampCoordinate(
+            (filter->X + filter->VelocityX * horizon / 1000) >> 8,
+            ControllerContext->Props.TouchPhysicalWidth);
+        slot->y = RmiClampCoordinate(
+            (filter->Y + filter->VelocityY * horizon / 1000) >> 8,
+            ControllerContext->Props.TouchPhysicalHeight);
+
+        if (!filter->PendingValid)
+        {
+            filter->PendingX = slot->x;
+            filter->PendingY = slot->y;
+            filter->BaseX = (LONG) (filter->X >> 8);
+            filter->BaseY = (LONG) (filter->Y >> 8);
+            filter->PendingTime = Cache->ScanTime + horizon * 10000;
+            filter->PendingValid = TRUE;
+        }
+    }
+}
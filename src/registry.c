@@ -39,7 +39,7 @@ static RMI4_CONFIGURATION gDefaultConfiguration =
         1,                                              // No Sleep (do sleep)
         0,                                              // Report Rate (standard)
         1,                                              // Configured
-        0xf,                                            // Interrupt Enable
+        0xffffffff,                                     // Interrupt Enable (serviced sources)
         RMI4_MILLISECONDS_TO_TENTH_MILLISECONDS(20),    // Doze Interval
         10,                                             // Doze Threshold
         RMI4_SECONDS_TO_HALF_SECONDS(2)                 // Doze Holdoff
@@ -94,6 +94,41 @@ static RMI4_CONFIGURATION gDefaultConfiguration =
     {
         0x0,                                            // Controller stays powered in D3
     },
+
+    //
+    // Interrupt and polling mode switching
+    //
+    16,                                                 // Frames before polling
+    8,                                                  // Idle frames before interrupts
+
+    //
+    // Reporting mode governor
+    //
+    16,                                                 // Still frames before reduced reporting
+    10,                                                 // Still motion threshold (sensor units)
+
+    //
+    // Doze policy
+    //
+    1,                                                  // Adapt doze to touch activity
+
+    //
+    // Contact prediction
+    //
+    0,                                                  // Prediction horizon (ms, disabled)
+    1000,                                               // Minimum cutoff (mHz)
+    1,                                                  // Cutoff slope (mHz per sensor unit/s)
+
+    //
+    // Unchanged frame suppression
+    //
+    0,                                                  // Dead-band (sensor units)
+    0,                                                  // Heartbeat (ms, disabled)
+
+    //
+    // Report rate limiter
+    //
+    0,                                                  // Maximum report rate (Hz, unlimited)
 };
 
 RTL_QUERY_REGISTRY_TABLE gRegistryTable[] =
@@ -526,6 +561,94 @@ RTL_QUERY_REGISTRY_TABLE gRegistryTable[] =
         &gDefaultConfiguration.PepRemovesVoltageInD3,
         sizeof(UINT32)
     },
+    {
+        NULL, RTL_QUERY_REGISTRY_DIRECT,
+        L"PollingThreshold",
+        (PVOID) (FIELD_OFFSET(RMI4_CONFIGURATION, PollingThreshold)),
+        REG_DWORD,
+        &gDefaultConfiguration.PollingThreshold,
+        sizeof(UINT32)
+    },
+    {
+        NULL, RTL_QUERY_REGISTRY_DIRECT,
+        L"PollingIdleFrames",
+        (PVOID) (FIELD_OFFSET(RMI4_CONFIGURATION, PollingIdleFrames)),
+        REG_DWORD,
+        &gDefaultConfiguration.PollingIdleFrames,
+        sizeof(UINT32)
+    },
+    {
+        NULL, RTL_QUERY_REGISTRY_DIRECT,
+        L"ReportingGovernorFrames",
+        (PVOID) (FIELD_OFFSET(RMI4_CONFIGURATION, ReportingGovernorFrames)),
+        REG_DWORD,
+        &gDefaultConfiguration.ReportingGovernorFrames,
+        sizeof(UINT32)
+    },
+    {
+        NULL, RTL_QUERY_REGISTRY_DIRECT,
+        L"ReportingGovernorMotion",
+        (PVOID) (FIELD_OFFSET(RMI4_CONFIGURATION, ReportingGovernorMotion)),
+        REG_DWORD,
+        &gDefaultConfiguration.ReportingGovernorMotion,
+        sizeof(UINT32)
+    },
+    {
+        NULL, RTL_QUERY_REGISTRY_DIRECT,
+        L"AdaptiveDoze",
+        (PVOID) (FIELD_OFFSET(RMI4_CONFIGURATION, AdaptiveDoze)),
+        REG_DWORD,
+        &gDefaultConfiguration.AdaptiveDoze,
+        sizeof(UINT32)
+    },
+    {
+        NULL, RTL_QUERY_REGISTRY_DIRECT,
+        L"PredictionHorizon",
+        (PVOID) (FIELD_OFFSET(RMI4_CONFIGURATION, PredictionHorizon)),
+        REG_DWORD,
+        &gDefaultConfiguration.PredictionHorizon,
+        sizeof(UINT32)
+    },
+    {
+        NULL, RTL_QUERY_REGISTRY_DIRECT,
+        L"PredictionMinCutoff",
+        (PVOID) (FIELD_OFFSET(RMI4_CONFIGURATION, PredictionMinCutoff)),
+        REG_DWORD,
+        &gDefaultConfiguration.PredictionMinCutoff,
+        sizeof(UINT32)
+    },
+    {
+        NULL, RTL_QUERY_REGISTRY_DIRECT,
+        L"PredictionBeta",
+        (PVOID) (FIELD_OFFSET(RMI4_CONFIGURATION, PredictionBeta)),
+        REG_DWORD,
+        &gDefaultConfiguration.PredictionBeta,
+        sizeof(UINT32)
+    },
+    {
+        NULL, RTL_QUERY_REGISTRY_DIRECT,
+        L"ReportDeadband",
+        (PVOID) (FIELD_OFFSET(RMI4_CONFIGURATION, ReportDeadband)),
+        REG_DWORD,
+        &gDefaultConfiguration.ReportDeadband,
+        sizeof(UINT32)
+    },
+    {
+        NULL, RTL_QUERY_REGISTRY_DIRECT,
+        L"ReportHeartbeat",
+        (PVOID) (FIELD_OFFSET(RMI4_CONFIGURATION, ReportHeartbeat)),
+        REG_DWORD,
+        &gDefaultConfiguration.ReportHeartbeat,
+        sizeof(UINT32)
+    },
+    {
+        NULL, RTL_QUERY_REGISTRY_DIRECT,
+        L"MaxReportRate",
+        (PVOID) (FIELD_OFFSET(RMI4_CONFIGURATION, MaxReportRate)),
+        REG_DWORD,
+        &gDefaultConfiguration.MaxReportRate,
+        sizeof(UINT32)
+    },
 
     //
     // List Terminator
@@ -720,4 +843,175 @@ exit:
     }
 
     return status;
-}
\ No newline at end of file
+}
+
+NTSTATUS
+TchRegistryQueryDiscoveryCache(
+    IN WDFDEVICE FxDevice,
+    OUT WDFMEMORY *Memory
+    )
+/*++
+ 
+  Routine Description:
+
+    This routine retrieves the controller discovery cache blob
+    stored in the device hardware key by a previous start.
+
+  Arguments:
+
+    FxDevice - a handle to the framework device object
+    Memory - Receives a memory object holding the blob, which the
+    caller must delete
+
+  Return Value:
+
+    NTSTATUS indicating success or failure
+
+--*/
+{
+    WDFKEY key;
+    NTSTATUS status;
+    ULONG valueType;
+    DECLARE_CONST_UNICODE_STRING(valueName, L"DiscoveryCache");
+
+    key = NULL;
+    *Memory = NULL;
+
+    status = WdfDeviceOpenRegistryKey(
+        FxDevice,
+        PLUGPLAY_REGKEY_DEVICE,
+        KEY_READ,
+        WDF_NO_OBJECT_ATTRIBUTES,
+        &key);
+
+    if (!NT_SUCCESS(status))
+    {
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_REGISTRY,
+            "Error opening device registry key - %!STATUS!",
+            status);
+
+        goto exit;
+    }
+
+    status = WdfRegistryQueryMemory(
+        key,
+        &valueName,
+        NonPagedPoolNx,
+        WDF_NO_OBJECT_ATTRIBUTES,
+        Memory,
+        &valueType);
+
+    if (!NT_SUCCESS(status))
+    {
+        Trace(
+            TRACE_LEVEL_INFORMATION,
+            TRACE_REGISTRY,
+            "No discovery cache in registry - %!STATUS!",
+            status);
+
+        goto exit;
+    }
+
+    if (valueType != REG_BINARY)
+    {
+        Trace(
+            TRACE_LEVEL_WARNING,
+            TRACE_REGISTRY,
+            "Discovery cache has unexpected type %d",
+            valueType);
+
+        WdfObjectDelete(*Memory);
+        *Memory = NULL;
+
+        status = STATUS_OBJECT_TYPE_MISMATCH;
+        goto exit;
+    }
+
+exit:
+
+    if (key != NULL)
+    {
+        WdfRegistryClose(key);
+    }
+
+    return status;
+}
+
+NTSTATUS
+TchRegistrySetDiscoveryCache(
+    IN WDFDEVICE FxDevice,
+    IN PVOID Buffer,
+    IN ULONG Length
+    )
+/*++
+ 
+  Routine Description:
+
+    This routine stores the controller discovery cache blob in the
+    device hardware key so the next start can skip discovery.
+
+  Arguments:
+
+    FxDevice - a handle to the framework device object
+    Buffer - The blob to store
+    Length - Size of the blob in bytes
+
+  Return Value:
+
+    NTSTATUS indicating success or failure
+
+--*/
+{
+    WDFKEY key;
+    NTSTATUS status;
+    DECLARE_CONST_UNICODE_STRING(valueName, L"DiscoveryCache");
+
+    key = NULL;
+
+    status = WdfDeviceOpenRegistryKey(
+        FxDevice,
+        PLUGPLAY_REGKEY_DEVICE,
+        KEY_WRITE,
+        WDF_NO_OBJECT_ATTRIBUTES,
+        &key);
+
+    if (!NT_SUCCESS(status))
+    {
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_REGISTRY,
+            "Error opening device registry key for write - %!STATUS!",
+            status);
+
+        goto exit;
+    }
+
+    status = WdfRegistryAssignValue(
+        key,
+        &valueName,
+        REG_BINARY,
+        Length,
+        Buffer);
+
+    if (!NT_SUCCESS(status))
+    {
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_REGISTRY,
+            "Error writing discovery cache - %!STATUS!",
+            status);
+
+        goto exit;
+    }
+
+exit:
+
+    if (key != NULL)
+    {
+        WdfRegistryClose(key);
+    }
+
+    return status;
+}
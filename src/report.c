@@ -5,7 +5,7 @@
 #include <controller.h>
 #include <rmiinternal.h>
 #include <HidCommon.h>
-#include <spb.h>
+#include <spbtarget.h>
 #include <report.tmh>
 
 const USHORT gOEMVendorID = 0x7379;    // "sy"
@@ -17,109 +17,982 @@ const PWSTR gpwstrProductID = L"3400";
 const PWSTR gpwstrSerialNumber = L"4";
 
 NTSTATUS
-RmiGetTouchesFromController(
-	IN VOID *ControllerContext,
+RmiAllocateFrames(
+	IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+	IN SPB_CONTEXT *SpbContext
+)
+/*++
+
+Routine Description:
+
+	Allocates the F12 frame buffers and the captured frame ring for the
+	discovered packet size, and the request used to read frames
+	asynchronously, so servicing an interrupt never allocates.
+
+Arguments:
+
+	ControllerContext - Touch controller context
+	SpbContext - A pointer to the current i2c context
+
+Return Value:
+
+	NTSTATUS indicating success or failure
+
+--*/
+{
+	RMI4_F12_FRAMES* frames;
+	RMI4_FRAME_RING* ring;
+	PUCHAR buffer;
+	NTSTATUS status;
+	int i;
+
+	frames = &ControllerContext->Frames;
+	ring = &ControllerContext->Ring;
+
+	RmiFreeFrames(ControllerContext);
+
+	buffer = ExAllocatePoolWithTag(
+		NonPagedPoolNx,
+		(RMI4_F12_FRAME_BUFFERS + RMI4_FRAME_RING_SIZE) *
+			ControllerContext->PacketSize,
+		TOUCH_POOL_TAG_F12
+	);
+
+	if (buffer == NULL)
+	{
+		status = STATUS_INSUFFICIENT_RESOURCES;
+		goto exit;
+	}
+
+	RtlZeroMemory(
+		buffer,
+		(RMI4_F12_FRAME_BUFFERS + RMI4_FRAME_RING_SIZE) *
+			ControllerContext->PacketSize);
+
+	for (i = 0; i < RMI4_F12_FRAME_BUFFERS; i++)
+	{
+		frames->Buffer[i] = buffer;
+		buffer += ControllerContext->PacketSize;
+	}
+
+	for (i = 0; i < RMI4_FRAME_RING_SIZE; i++)
+	{
+		ring->Entries[i].Data = buffer;
+		buffer += ControllerContext->PacketSize;
+	}
+
+	ring->Head = 0;
+	ring->Tail = 0;
+
+	frames->Size = (ULONG) ControllerContext->PacketSize;
+	frames->Front = 0;
+	frames->InFlight = FALSE;
+
+	//
+	// Frames are still read synchronously if no request is available
+	//
+	status = SpbAsyncReadInitialize(
+		SpbContext,
+		&frames->Read);
+
+	if (!NT_SUCCESS(status))
+	{
+		Trace(
+			TRACE_LEVEL_WARNING,
+			TRACE_INIT,
+			"Could not set up asynchronous F12 reads - %!STATUS!",
+			status);
+
+		status = STATUS_SUCCESS;
+	}
+
+exit:
+	return status;
+}
+
+VOID
+RmiFreeFrames(
+	IN RMI4_CONTROLLER_CONTEXT* ControllerContext
+)
+/*++
+
+Routine Description:
+
+	Frees the F12 frame buffers, the captured frame ring and the
+	asynchronous read request.
+
+Arguments:
+
+	ControllerContext - Touch controller context
+
+Return Value:
+
+	None.
+
+--*/
+{
+	RMI4_F12_FRAMES* frames;
+	int i;
+
+	frames = &ControllerContext->Frames;
+
+	NT_ASSERT(!frames->InFlight);
+
+	SpbAsyncReadDeinitialize(&frames->Read);
+
+	//
+	// The frame buffers and ring entries come from a single allocation
+	//
+	if (frames->Buffer[0] != NULL)
+	{
+		ExFreePoolWithTag(
+			frames->Buffer[0],
+			TOUCH_POOL_TAG_F12
+		);
+	}
+
+	RtlZeroMemory(frames->Buffer, sizeof(frames->Buffer));
+	frames->Size = 0;
+
+	for (i = 0; i < RMI4_FRAME_RING_SIZE; i++)
+	{
+		ControllerContext->Ring.Entries[i].Data = NULL;
+	}
+
+	ControllerContext->Ring.Head = 0;
+	ControllerContext->Ring.Tail = 0;
+}
+
+NTSTATUS
+RmiStartFrameRead(
+	IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+	IN SPB_CONTEXT *SpbContext,
+	IN BOOLEAN WithStatus
+)
+/*++
+
+Routine Description:
+
+	Sends the read of the next F12 data frame into the back buffer
+	without waiting for it, so that the I/O which follows in the service
+	cycle is queued behind it on the bus. The page selects are part of
+	the same SPB sequence, as is the F01 status read when requested.
+	When the controller cannot execute sequences the read is left to
+	RmiFinishFrameRead.
+
+Arguments:
+
+	ControllerContext - Touch controller context
+	SpbContext - A pointer to the current i2c context
+	WithStatus - Read the F01 device and interrupt status ahead of the
+		frame
+
+Return Value:
+
+	NTSTATUS indicating success or failure
+
+--*/
+{
+	RMI4_F12_FRAMES* frames;
+	SPB_ASYNC_READ* read;
+	BOOLEAN contiguous = FALSE;
+	ULONG pageSelects = 0;
+	int currentPage;
+	BYTE page;
+	int f01;
+	int index;
+	NTSTATUS status;
+
+	frames = &ControllerContext->Frames;
+	read = &frames->Read;
+
+	if (frames->InFlight || frames->Size == 0)
+	{
+		status = STATUS_SUCCESS;
+		goto exit;
+	}
+
+	index = RmiGetFunctionIndex(
+		ControllerContext->Descriptors,
+		ControllerContext->FunctionCount,
+		RMI4_F12_2D_TOUCHPAD_SENSOR);
+
+	f01 = RmiGetFunctionIndex(
+		ControllerContext->Descriptors,
+		ControllerContext->FunctionCount,
+		RMI4_F01_RMI_DEVICE_CONTROL);
+
+	if (index == ControllerContext->FunctionCount ||
+		(WithStatus && f01 == ControllerContext->FunctionCount))
+	{
+		status = STATUS_INVALID_DEVICE_STATE;
+		goto exit;
+	}
+
+	SpbAsyncReadReset(read);
+
+	currentPage = ControllerContext->CurrentPage;
+
+	if (WithStatus)
+	{
+		if (currentPage != ControllerContext->FunctionOnPage[f01])
+		{
+			currentPage = ControllerContext->FunctionOnPage[f01];
+			page = (BYTE) currentPage;
+			pageSelects++;
+
+			status = SpbSequenceAddWrite(
+				&read->Writes,
+				RMI4_PAGE_SELECT_ADDRESS,
+				&page,
+				sizeof(BYTE));
+
+			if (!NT_SUCCESS(status))
+			{
+				goto exit;
+			}
+		}
+
+		status = SpbSequenceAddWrite(
+			&read->Writes,
+			ControllerContext->Descriptors[f01].DataBase,
+			NULL,
+			0);
+
+		if (!NT_SUCCESS(status))
+		{
+			goto exit;
+		}
+
+		status = SpbAsyncReadAddLead(
+			read,
+			&frames->Status,
+			RMI4_F01_DATA_SIZE(ControllerContext->Interrupts.Registers));
+
+		if (!NT_SUCCESS(status))
+		{
+			goto exit;
+		}
+
+		//
+		// When the F12 data registers follow the F01 ones the frame is
+		// read on from where the status ended
+		//
+		contiguous =
+			currentPage == ControllerContext->FunctionOnPage[index] &&
+			ControllerContext->Descriptors[index].DataBase ==
+				ControllerContext->Descriptors[f01].DataBase +
+				RMI4_F01_DATA_SIZE(ControllerContext->Interrupts.Registers);
+	}
+
+	if (!contiguous)
+	{
+		if (currentPage != ControllerContext->FunctionOnPage[index])
+		{
+			currentPage = ControllerContext->FunctionOnPage[index];
+			page = (BYTE) currentPage;
+			pageSelects++;
+
+			status = SpbSequenceAddWrite(
+				&read->Writes,
+				RMI4_PAGE_SELECT_ADDRESS,
+				&page,
+				sizeof(BYTE));
+
+			if (!NT_SUCCESS(status))
+			{
+				goto exit;
+			}
+		}
+
+		//
+		// The address pointer write has no payload
+		//
+		status = SpbSequenceAddWrite(
+			&read->Writes,
+			ControllerContext->Descriptors[index].DataBase,
+			NULL,
+			0);
+
+		if (!NT_SUCCESS(status))
+		{
+			goto exit;
+		}
+	}
+
+	status = SpbAsyncReadStart(
+		SpbContext,
+		read,
+		frames->Buffer[frames->Front ^ 1],
+		frames->Size);
+
+	if (status == STATUS_NOT_SUPPORTED)
+	{
+		status = STATUS_SUCCESS;
+		goto exit;
+	}
+
+	if (!NT_SUCCESS(status))
+	{
+		goto exit;
+	}
+
+	frames->InFlight = TRUE;
+	frames->StatusInFlight = WithStatus;
+
+	if (pageSelects != 0)
+	{
+		ControllerContext->CurrentPage = currentPage;
+		ControllerContext->PageSelectWrites += pageSelects;
+	}
+
+exit:
+	return status;
+}
+
+NTSTATUS
+RmiFinishFrameRead(
+	IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+	IN SPB_CONTEXT *SpbContext
+)
+/*++
+
+Routine Description:
+
+	Completes the read of the next F12 data frame, waiting for the read
+	sent by RmiStartFrameRead or reading synchronously if none is in
+	flight. On success the frame becomes the front buffer, and the F01
+	status is marked valid if it was read along.
+
+Arguments:
+
+	ControllerContext - Touch controller context
+	SpbContext - A pointer to the current i2c context
+
+Return Value:
+
+	NTSTATUS indicating success or failure
+
+--*/
+{
+	RMI4_F12_FRAMES* frames;
+	int index;
+	NTSTATUS status;
+
+	frames = &ControllerContext->Frames;
+	frames->StatusValid = FALSE;
+
+	if (frames->Size == 0)
+	{
+		status = STATUS_INVALID_DEVICE_STATE;
+		goto exit;
+	}
+
+	if (frames->InFlight)
+	{
+		frames->InFlight = FALSE;
+
+		status = SpbAsyncReadWait(&frames->Read);
+
+		if (NT_SUCCESS(status))
+		{
+			frames->StatusValid = frames->StatusInFlight;
+			frames->StatusInFlight = FALSE;
+			frames->AsyncReads++;
+			goto swap;
+		}
+
+		frames->StatusInFlight = FALSE;
+
+		//
+		// The sequence may have failed after selecting the page
+		//
+		ControllerContext->CurrentPage = RMI4_INVALID_PAGE;
+
+		if (status != STATUS_NOT_SUPPORTED)
+		{
+			goto exit;
+		}
+	}
+
+	index = RmiGetFunctionIndex(
+		ControllerContext->Descriptors,
+		ControllerContext->FunctionCount,
+		RMI4_F12_2D_TOUCHPAD_SENSOR);
+
+	if (index == ControllerContext->FunctionCount)
+	{
+		status = STATUS_INVALID_DEVICE_STATE;
+		goto exit;
+	}
+
+	status = RmiChangePage(
+		ControllerContext,
+		SpbContext,
+		ControllerContext->FunctionOnPage[index]);
+
+	if (!NT_SUCCESS(status))
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			TRACE_INIT,
+			"Could not change register page");
+
+		goto exit;
+	}
+
+	status = SpbReadDataSynchronously(
+		SpbContext,
+		ControllerContext->Descriptors[index].DataBase,
+		frames->Buffer[frames->Front ^ 1],
+		frames->Size
+	);
+
+	if (!NT_SUCCESS(status))
+	{
+		goto exit;
+	}
+
+	frames->SyncReads++;
+
+swap:
+	frames->Front ^= 1;
+
+exit:
+	return status;
+}
+
+NTSTATUS
+RmiReadFrameAndStatus(
+	IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+	IN SPB_CONTEXT *SpbContext,
+	OUT ULONG* InterruptStatus
+)
+/*++
+
+Routine Description:
+
+	Fast path of a service cycle, fetching the F01 status and the next
+	F12 frame with a single SPB sequence. The status is handled exactly
+	as RmiCheckInterrupts does, so device status errors and interrupt
+	sources other than touch data take the same course as on the full
+	path.
+
+Arguments:
+
+	ControllerContext - Touch controller context
+	SpbContext - A pointer to the current i2c context
+	InterruptStatus - Receives the pending interrupt sources
+
+Return Value:
+
+	STATUS_NOT_SUPPORTED if the sequence was never executed and the
+	caller must take the full path, otherwise the outcome of handling
+	the status. On success the frame is in the front buffer.
+
+	Once the sequence went out the F01 interrupt status may have been
+	read, which clears it, so a failed transfer fails the interrupt
+	rather than falling back to a status read that would find nothing.
+
+--*/
+{
+	RMI4_F12_FRAMES* frames;
+	NTSTATUS status;
+
+	frames = &ControllerContext->Frames;
+	*InterruptStatus = 0;
+
+	if (frames->InFlight || frames->Size == 0 || frames->Read.Unsupported)
+	{
+		return STATUS_NOT_SUPPORTED;
+	}
+
+	status = RmiStartFrameRead(
+		ControllerContext,
+		SpbContext,
+		TRUE);
+
+	if (!NT_SUCCESS(status) || !frames->InFlight)
+	{
+		return STATUS_NOT_SUPPORTED;
+	}
+
+	status = RmiFinishFrameRead(
+		ControllerContext,
+		SpbContext);
+
+	if (!frames->StatusValid)
+	{
+		//
+		// The Spb controller refused the sequence without running it
+		//
+		if (frames->Read.Unsupported)
+		{
+			return STATUS_NOT_SUPPORTED;
+		}
+
+		Trace(
+			TRACE_LEVEL_ERROR,
+			TRACE_INTERRUPT,
+			"Error reading frame and status - %!STATUS!",
+			status);
+
+		return NT_SUCCESS(status) ? STATUS_UNSUCCESSFUL : status;
+	}
+
+	frames->StatusReads++;
+
+	return RmiHandleInterruptStatus(
+		ControllerContext,
+		SpbContext,
+		&frames->Status,
+		InterruptStatus);
+}
+
+RMI4_FRAME_RING_ENTRY*
+RmiRingReserve(
+	IN RMI4_FRAME_RING* Ring
+)
+/*++
+
+Routine Description:
+
+	Returns the entry the capture stage fills next, or NULL if the
+	processing stage has not caught up and the ring is full.
+
+Arguments:
+
+	Ring - The captured frame ring
+
+Return Value:
+
+	The entry to fill, or NULL
+
+--*/
+{
+	ULONG tail;
+
+	tail = Ring->Tail;
+
+	//
+	// Do not touch the entry before the consumer is done with it
+	//
+	KeMemoryBarrier();
+
+	if (Ring->Head - tail == RMI4_FRAME_RING_SIZE)
+	{
+		return NULL;
+	}
+
+	return &Ring->Entries[Ring->Head % RMI4_FRAME_RING_SIZE];
+}
+
+VOID
+RmiRingCommit(
+	IN RMI4_FRAME_RING* Ring
+)
+/*++
+
+Routine Description:
+
+	Publishes the entry returned by RmiRingReserve to the processing
+	stage.
+
+Arguments:
+
+	Ring - The captured frame ring
+
+Return Value:
+
+	None.
+
+--*/
+{
+	//
+	// The entry contents must be visible before the new head
+	//
+	KeMemoryBarrier();
+
+	Ring->Head++;
+}
+
+RMI4_FRAME_RING_ENTRY*
+RmiRingFront(
+	IN RMI4_FRAME_RING* Ring
+)
+/*++
+
+Routine Description:
+
+	Returns the oldest captured entry, or NULL if the ring is empty.
+
+Arguments:
+
+	Ring - The captured frame ring
+
+Return Value:
+
+	The oldest entry, or NULL
+
+--*/
+{
+	ULONG head;
+
+	head = Ring->Head;
+
+	//
+	// Do not read the entry before the head that published it
+	//
+	KeMemoryBarrier();
+
+	if (head == Ring->Tail)
+	{
+		return NULL;
+	}
+
+	return &Ring->Entries[Ring->Tail % RMI4_FRAME_RING_SIZE];
+}
+
+VOID
+RmiRingPop(
+	IN RMI4_FRAME_RING* Ring
+)
+/*++
+
+Routine Description:
+
+	Hands the entry returned by RmiRingFront back to the capture stage.
+
+Arguments:
+
+	Ring - The captured frame ring
+
+Return Value:
+
+	None.
+
+--*/
+{
+	//
+	// Finish reading the entry before it can be reused
+	//
+	KeMemoryBarrier();
+
+	Ring->Tail++;
+}
+
+NTSTATUS
+RmiQueueFrame(
+	IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+	IN ULONG64 Timestamp,
+	IN ULONG InterruptStatus,
+	IN BYTE Buttons
+)
+/*++
+
+Routine Description:
+
+	Queues the frame in the front buffer to the processing stage. When
+	the processing stage fell behind, the frame is coalesced into the
+	newest queued entry. F12 frames are full state snapshots and the
+	controller stops interrupting after the last lift, so the latest
+	state must never be lost.
+
+Arguments:
+
+	ControllerContext - Touch controller context
+	Timestamp - Interrupt time the frame was captured at
+	InterruptStatus - The interrupts the frame carries data for
+	Buttons - The 0D button state, if the button interrupt is set
+
+Return Value:
+
+	NTSTATUS, where only success indicates the frame was queued
+
+--*/
+{
+	RMI4_FRAME_RING* ring;
+	RMI4_FRAME_RING_ENTRY* entry;
+	BOOLEAN coalesce = FALSE;
+
+	ring = &ControllerContext->Ring;
+	entry = RmiRingReserve(ring);
+
+	if (entry == NULL)
+	{
+		//
+		// Keep the consumer off the ring while its newest entry is
+		// rewritten. The processing lock nests inside the controller
+		// lock held here
+		//
+		WdfWaitLockAcquire(ControllerContext->ProcessingLock, NULL);
+
+		entry = RmiRingReserve(ring);
+
+		if (entry == NULL)
+		{
+			coalesce = TRUE;
+			entry = &ring->Entries[(ring->Head - 1) % RMI4_FRAME_RING_SIZE];
+			ring->Overruns++;
+
+			Trace(
+				TRACE_LEVEL_WARNING,
+				TRACE_INTERRUPT,
+				"Frame ring full, coalescing frame (%d overruns)",
+				ring->Overruns);
+		}
+		else
+		{
+			WdfWaitLockRelease(ControllerContext->ProcessingLock);
+		}
+	}
+
+	entry->Timestamp = Timestamp;
+
+	if (coalesce)
+	{
+		//
+		// Interrupt sources of both frames stay pending, the button
+		// state is the one of the newest frame reading it
+		//
+		entry->InterruptStatus |= InterruptStatus;
+
+		if (InterruptStatus & ControllerContext->Interrupts.Buttons)
+		{
+			entry->Buttons = Buttons;
+		}
+	}
+	else
+	{
+		entry->InterruptStatus = InterruptStatus;
+		entry->Buttons = Buttons;
+	}
+
+	//
+	// A button-only event carries no touch frame
+	//
+	if (InterruptStatus & ControllerContext->Interrupts.Touch)
+	{
+		RtlCopyMemory(
+			entry->Data,
+			ControllerContext->Frames.Buffer[ControllerContext->Frames.Front],
+			ControllerContext->Frames.Size);
+
+		//
+		// Touch sessions drive the doze policy
+		//
+		ControllerContext->Doze.FramePending = TRUE;
+		ControllerContext->Doze.FrameObjects = RmiFrameHasObjects(
+			ControllerContext,
+			entry->Data);
+	}
+
+	if (coalesce)
+	{
+		WdfWaitLockRelease(ControllerContext->ProcessingLock);
+	}
+	else
+	{
+		RmiRingCommit(ring);
+	}
+
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS
+RmiReadButtons(
+	IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
 	IN SPB_CONTEXT *SpbContext,
-	IN RMI4_F11_DATA_REGISTERS *Data
+	OUT BYTE* Buttons
+)
+/*++
+
+Routine Description:
+
+	Reads the state of the F1A 0D capacitive buttons.
+
+Arguments:
+
+	ControllerContext - Touch controller context
+	SpbContext - A pointer to the current i2c context
+	Buttons - Receives a bit per pressed button
+
+Return Value:
+
+	NTSTATUS indicating success or failure
+
+--*/
+{
+	RMI4_F1A_DATA_REGISTERS data;
+	int index;
+	NTSTATUS status;
+
+	*Buttons = 0;
+
+	index = RmiGetFunctionIndex(
+		ControllerContext->Descriptors,
+		ControllerContext->FunctionCount,
+		RMI4_F1A_0D_CAP_BUTTON_SENSOR);
+
+	if (index == ControllerContext->FunctionCount)
+	{
+		status = STATUS_INVALID_DEVICE_STATE;
+		goto exit;
+	}
+
+	status = RmiChangePage(
+		ControllerContext,
+		SpbContext,
+		ControllerContext->FunctionOnPage[index]);
+
+	if (!NT_SUCCESS(status))
+	{
+		goto exit;
+	}
+
+	status = SpbReadDataSynchronously(
+		SpbContext,
+		ControllerContext->Descriptors[index].DataBase,
+		&data,
+		sizeof(data));
+
+	if (!NT_SUCCESS(status))
+	{
+		goto exit;
+	}
+
+	*Buttons = *((BYTE*) &data) & ((1 << KEYPAD_BUTTON_COUNT) - 1);
+
+exit:
+	return status;
+}
+
+NTSTATUS
+RmiServiceCapButtonInterrupt(
+	IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+	OUT PKEYPAD_REPORT KeypadReport
+)
+/*++
+
+Routine Description:
+
+	Reports the 0D capacitive buttons of the frame being processed, if
+	their state changed since the last report.
+
+Arguments:
+
+	ControllerContext - Touch controller context
+	KeypadReport - Receives the keypad report
+
+Return Value:
+
+	NTSTATUS, where success indicates a report was filled
+
+--*/
+{
+	if (ControllerContext->Buttons == ControllerContext->ButtonsReported)
+	{
+		return STATUS_NO_DATA_DETECTED;
+	}
+
+	RtlZeroMemory(KeypadReport, sizeof(KEYPAD_REPORT));
+
+	KeypadReport->ReportID = REPORTID_KEYPAD;
+	KeypadReport->Back = (ControllerContext->Buttons >> 0) & 1;
+	KeypadReport->Home = (ControllerContext->Buttons >> 1) & 1;
+	KeypadReport->Search = (ControllerContext->Buttons >> 2) & 1;
+
+	Trace(
+		TRACE_LEVEL_VERBOSE,
+		TRACE_REPORTING,
+		"Reporting buttons 0x%x",
+		ControllerContext->Buttons);
+
+	ControllerContext->ButtonsReported = ControllerContext->Buttons;
+
+	return STATUS_SUCCESS;
+}
+
+BOOLEAN
+RmiFrameHasObjects(
+	IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+	IN PUCHAR Frame
 )
 /*++
 
 Routine Description:
 
-	This routine reads raw touch messages from hardware. If there is
-	no touch data available (if a non-touch interrupt fired), the
-	function will not return success and no touch data was transferred.
+	Checks whether a raw F12 frame reports any object on the sensor,
+	without decoding it.
 
 Arguments:
 
 	ControllerContext - Touch controller context
-	SpbContext - A pointer to the current i2c context
-	Data - A pointer to any returned F11 touch data
+	Frame - The raw F12 data packet
 
 Return Value:
 
-	NTSTATUS, where only success indicates data was returned
+	TRUE if any object slot is in use
 
 --*/
 {
-	NTSTATUS status;
-	RMI4_CONTROLLER_CONTEXT* controller;
-
-	int index, i, x, y, fingers, pens;
-
-	BYTE fingerStatus[RMI4_MAX_TOUCHES] = { 0 };
-	BYTE penStatus[RMI4_MAX_TOUCHES] = { 0 };
 	BYTE* data1;
-	BYTE* controllerData;
-
-	controller = (RMI4_CONTROLLER_CONTEXT*) ControllerContext;
+	int i;
 
-	//
-	// Locate RMI data base address of 2D touch function
-	//
-	index = RmiGetFunctionIndex(
-		controller->Descriptors,
-		controller->FunctionCount,
-		RMI4_F12_2D_TOUCHPAD_SENSOR);
+	data1 = &Frame[ControllerContext->Data1Offset];
 
-	if (index == controller->FunctionCount)
+	for (i = 0; i < ControllerContext->MaxFingers; i++)
 	{
-		Trace(
-			TRACE_LEVEL_ERROR,
-			TRACE_INIT,
-			"Unexpected - RMI Function 12 missing");
+		if (data1[0] != RMI_F12_OBJECT_NONE)
+		{
+			return TRUE;
+		}
 
-		status = STATUS_INVALID_DEVICE_STATE;
-		goto exit;
+		data1 += F12_DATA1_BYTES_PER_OBJ;
 	}
 
-	status = RmiChangePage(
-		ControllerContext,
-		SpbContext,
-		controller->FunctionOnPage[index]);
+	return FALSE;
+}
 
-	if (!NT_SUCCESS(status))
-	{
-		Trace(
-			TRACE_LEVEL_ERROR,
-			TRACE_INIT,
-			"Could not change register page");
+NTSTATUS
+RmiGetTouchesFromFrame(
+	IN VOID *ControllerContext,
+	IN PUCHAR Frame,
+	IN RMI4_F11_DATA_REGISTERS *Data
+)
+/*++
 
-		goto exit;
-	}
+Routine Description:
 
-	controllerData = ExAllocatePoolWithTag(
-		NonPagedPoolNx,
-		controller->PacketSize,
-		TOUCH_POOL_TAG_F12
-	);
+	This routine decodes raw touch messages captured from hardware. If
+	there is no touch data available, the function will not return
+	success and no touch data was transferred.
 
-	if (controllerData == NULL)
-	{
-		status = STATUS_INSUFFICIENT_RESOURCES;
-		goto exit;
-	}
+Arguments:
 
-	// 
-	// Packets we need is determined by context
-	//
-	status = SpbReadDataSynchronously(
-		SpbContext,
-		controller->Descriptors[index].DataBase,
-		controllerData,
-		(ULONG) controller->PacketSize
-	);
+	ControllerContext - Touch controller context
+	Frame - The raw F12 data packet
+	Data - A pointer to any returned F11 touch data
 
-	if (!NT_SUCCESS(status))
-	{
-		Trace(
-			TRACE_LEVEL_ERROR,
-			TRACE_INTERRUPT,
-			"Error reading finger status data - %!STATUS!",
-			status);
+Return Value:
 
-		goto free_buffer;
-	}
+	NTSTATUS, where only success indicates data was returned
+
+--*/
+{
+	NTSTATUS status;
+	RMI4_CONTROLLER_CONTEXT* controller;
+
+	int i, x, y, fingers, pens;
+
+	BYTE fingerStatus[RMI4_MAX_TOUCHES] = { 0 };
+	BYTE penStatus[RMI4_MAX_TOUCHES] = { 0 };
+	BYTE* data1;
+	BYTE* controllerData;
+
+	controller = (RMI4_CONTROLLER_CONTEXT*) ControllerContext;
+	controllerData = Frame;
+	status = STATUS_SUCCESS;
 
 	data1 = &controllerData[controller->Data1Offset];
 	fingers = 0;
@@ -170,7 +1043,8 @@ Return Value:
 			"Error reading finger status data - empty buffer"
 		);
 
-		goto free_buffer;
+		status = STATUS_NO_DATA_DETECTED;
+		goto exit;
 	}
 
 	// Synchronize status back
@@ -196,12 +1070,6 @@ Return Value:
 	Data->Status.PenState8 = penStatus[8];
 	Data->Status.PenState9 = penStatus[9];
 
-free_buffer:
-	ExFreePoolWithTag(
-		controllerData,
-		TOUCH_POOL_TAG_F12
-	);
-
 exit:
 	return status;
 }
@@ -209,7 +1077,8 @@ exit:
 VOID
 RmiUpdateLocalPenCache(
 	IN RMI4_F11_DATA_REGISTERS* Data,
-	IN RMI4_PEN_CACHE* Cache
+	IN RMI4_PEN_CACHE* Cache,
+	IN ULONG64 ScanTime
 )
 /*++
 
@@ -225,6 +1094,7 @@ Arguments:
 
 	Data - A pointer to the new data returned from hardware
 	Cache - A data structure holding various current finger state info
+	ScanTime - Interrupt time the frame was sampled at
 
 Return Value:
 
@@ -344,16 +1214,16 @@ Return Value:
 	}
 
 	//
-	// Get current scan time (in 100us units)
+	// Fingers and pens of the same frame share its sample time
 	//
-	ULONG64 QpcTimeStamp;
-	Cache->ScanTime = KeQueryInterruptTimePrecise(&QpcTimeStamp) / 1000;
+	Cache->ScanTime = ScanTime;
 }
 
 VOID
 RmiUpdateLocalFingerCache(
 	IN RMI4_F11_DATA_REGISTERS *Data,
-	IN RMI4_FINGER_CACHE *Cache
+	IN RMI4_FINGER_CACHE *Cache,
+	IN ULONG64 ScanTime
 )
 /*++
 
@@ -369,6 +1239,7 @@ Arguments:
 
 	Data - A pointer to the new data returned from hardware
 	Cache - A data structure holding various current finger state info
+	ScanTime - Interrupt time the frame was sampled at
 
 Return Value:
 
@@ -444,6 +1315,8 @@ Return Value:
 	//
 	// Cache the new set of finger data reported by hardware
 	//
+	Cache->FingerSlotNew = 0;
+
 	for (i=0; i<RMI4_MAX_TOUCHES; i++)
 	{
 		//
@@ -454,6 +1327,7 @@ Return Value:
 			(Cache->FingerDownCount < RMI4_MAX_TOUCHES))
 		{
 			Cache->FingerSlotValid |= (1 << i);
+			Cache->FingerSlotNew |= (1 << i);
 			Cache->FingerDownOrder[Cache->FingerDownCount++] = i;
 		}
 
@@ -488,10 +1362,34 @@ Return Value:
 	}
 
 	//
-	// Get current scan time (in 100us units)
+	// When the contacts span several hybrid reports, the ones going down
+	// or lifting are sent in the first report of the frame. Each group
+	// keeps the order the contacts went down in
+	//
+	j = 0;
+
+	for (i=0; i<Cache->FingerDownCount; i++)
+	{
+		if ((Cache->FingerSlotNew | Cache->FingerSlotDirty) &
+			(1 << Cache->FingerDownOrder[i]))
+		{
+			Cache->FingerReportOrder[j++] = Cache->FingerDownOrder[i];
+		}
+	}
+
+	for (i=0; i<Cache->FingerDownCount; i++)
+	{
+		if (!((Cache->FingerSlotNew | Cache->FingerSlotDirty) &
+			(1 << Cache->FingerDownOrder[i])))
+		{
+			Cache->FingerReportOrder[j++] = Cache->FingerDownOrder[i];
+		}
+	}
+
+	//
+	// Fingers and pens of the same frame share its sample time
 	//
-	ULONG64 QpcTimeStamp;
-	Cache->ScanTime = KeQueryInterruptTimePrecise(&QpcTimeStamp) / 1000;
+	Cache->ScanTime = ScanTime;
 }
 
 VOID
@@ -535,9 +1433,9 @@ Return Value:
 	HidReport->ReportID = REPORTID_MULTITOUCH;
 
 	//
-	// There are only 16-bits for ScanTime, truncate it
+	// There are only 16-bits for ScanTime, in 100us units
 	//
-	HidReport->ScanTime = Cache->ScanTime & 0xFFFF;
+	HidReport->ScanTime = RMI4_HID_SCAN_TIME(Cache->ScanTime);
 
 	//
 	// No button in our context
@@ -567,7 +1465,7 @@ Return Value:
 	//
 	for (currentFingerIndex = 0; currentFingerIndex < fingersToReport; currentFingerIndex++)
 	{
-		int currentlyReporting = Cache->FingerDownOrder[*TouchesReported];
+		int currentlyReporting = Cache->FingerReportOrder[*TouchesReported];
 
 		HidReport->Contacts[currentFingerIndex].ContactID = (UCHAR)currentlyReporting;
 		SctatchX = (USHORT)Cache->FingerSlot[currentlyReporting].x;
@@ -635,9 +1533,9 @@ Return Value:
 	HidReport->ReportID = REPORTID_PEN;
 
 	//
-	// There are only 16-bits for ScanTime, truncate it
+	// There are only 16-bits for ScanTime, in 100us units
 	//
-	HidReport->ScanTime = Cache->ScanTime & 0xFFFF;
+	HidReport->ScanTime = RMI4_HID_SCAN_TIME(Cache->ScanTime);
 
 	//
 	// Only five fingers supported yet
@@ -675,6 +1573,267 @@ Return Value:
 	}
 }
 
+BOOLEAN
+RmiTouchFrameChanged(
+	IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+	IN RMI4_FINGER_CACHE* Cache
+)
+/*++
+
+Routine Description:
+
+	Compares the contacts of a new frame with the last reported ones.
+
+Arguments:
+
+	ControllerContext - Touch controller context
+	Cache - The finger cache, updated from the frame
+
+Return Value:
+
+	TRUE if the frame must be reported
+
+--*/
+{
+	RMI4_REPORT_SUPPRESSION* suppression;
+	RMI4_FINGER_INFO* reported;
+	RMI4_FINGER_INFO* slot;
+	BOOLEAN changed = FALSE;
+	int dx, dy;
+	int i;
+
+	suppression = &ControllerContext->Suppression;
+	suppression->Frames++;
+
+	if (ControllerContext->Config.ReportHeartbeat == 0 ||
+		Cache->FingerSlotValid != suppression->ReportedValid ||
+		Cache->ScanTime - suppression->LastReport >=
+			ControllerContext->Config.ReportHeartbeat * 10000ULL)
+	{
+		changed = TRUE;
+	}
+
+	for (i = 0; i < RMI4_MAX_TOUCHES && !changed; i++)
+	{
+		if (!(Cache->FingerSlotValid & (1 << i)))
+		{
+			continue;
+		}
+
+		slot = &Cache->FingerSlot[i];
+		reported = &suppression->Reported[i];
+
+		dx = slot->x - reported->x;
+		dy = slot->y - reported->y;
+
+		if (slot->fingerStatus != reported->fingerStatus ||
+			(dx < 0 ? -dx : dx) > (int) ControllerContext->Config.ReportDeadband ||
+			(dy < 0 ? -dy : dy) > (int) ControllerContext->Config.ReportDeadband)
+		{
+			changed = TRUE;
+		}
+	}
+
+	if (!changed)
+	{
+		suppression->Suppressed++;
+	}
+
+	return changed;
+}
+
+VOID
+RmiRecordReportedFrame(
+	IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+	IN RMI4_FINGER_CACHE* Cache
+)
+/*++
+
+Routine Description:
+
+	Makes the frame about to be reported the reference the next frames
+	are compared with by the unchanged frame suppression.
+
+Arguments:
+
+	ControllerContext - Touch controller context
+	Cache - The finger cache holding the frame
+
+Return Value:
+
+	None.
+
+--*/
+{
+	RMI4_REPORT_SUPPRESSION* suppression;
+
+	suppression = &ControllerContext->Suppression;
+
+	RtlCopyMemory(
+		suppression->Reported,
+		Cache->FingerSlot,
+		sizeof(suppression->Reported));
+	suppression->ReportedValid = Cache->FingerSlotValid;
+	suppression->LastReport = Cache->ScanTime;
+}
+
+BOOLEAN
+RmiRateLimitFrame(
+	IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+	IN RMI4_FINGER_CACHE* Cache
+)
+/*++
+
+Routine Description:
+
+	Decides whether a touch frame is reported now or held back by the
+	report rate limiter. A held frame stays in the finger cache, where
+	the next frame updates it with the latest positions.
+
+Arguments:
+
+	ControllerContext - Touch controller context
+	Cache - The finger cache, updated from the frame
+
+Return Value:
+
+	TRUE if the frame must be reported now
+
+--*/
+{
+	RMI4_RATE_LIMITER* limiter;
+	BOOLEAN report = TRUE;
+
+	limiter = &ControllerContext->RateLimiter;
+
+	if (ControllerContext->Config.MaxReportRate == 0)
+	{
+		goto exit;
+	}
+
+	//
+	// Contacts arriving or lifting are never held back
+	//
+	if (Cache->FingerSlotValid == limiter->ReportedValid &&
+		Cache->FingerSlotDirty == 0 &&
+		Cache->ScanTime - limiter->LastReport <
+			RMI4_RATE_PERIOD(ControllerContext->Config.MaxReportRate))
+	{
+		limiter->Held = TRUE;
+		limiter->Coalesced++;
+		report = FALSE;
+		goto exit;
+	}
+
+	limiter->Held = FALSE;
+	limiter->ReportedValid = Cache->FingerSlotValid;
+	limiter->LastReport = Cache->ScanTime;
+
+exit:
+
+	return report;
+}
+
+BOOLEAN
+RmiReleaseHeldFrame(
+	IN RMI4_CONTROLLER_CONTEXT* ControllerContext
+)
+/*++
+
+Routine Description:
+
+	Prepares the reports of the finger cache for a frame held back by the
+	report rate limiter, once its slot opened.
+
+Arguments:
+
+	ControllerContext - Touch controller context
+
+Return Value:
+
+	TRUE if the cached touches are to be reported
+
+--*/
+{
+	RMI4_RATE_LIMITER* limiter;
+	ULONG64 now;
+
+	limiter = &ControllerContext->RateLimiter;
+
+	if (!limiter->Held || ControllerContext->Config.MaxReportRate == 0)
+	{
+		return FALSE;
+	}
+
+	now = KeQueryInterruptTime();
+
+	if (now - limiter->LastReport <
+		RMI4_RATE_PERIOD(ControllerContext->Config.MaxReportRate))
+	{
+		return FALSE;
+	}
+
+	limiter->Held = FALSE;
+	limiter->LastReport = now;
+	limiter->Released++;
+
+	RmiRecordReportedFrame(ControllerContext, &ControllerContext->Cache);
+
+	ControllerContext->TouchesReported = 0;
+	ControllerContext->TouchesTotal = ControllerContext->Cache.FingerDownCount;
+
+	return ControllerContext->TouchesTotal != 0;
+}
+
+BOOLEAN
+TchGetHeldReportDelay(
+	IN VOID *ControllerContext,
+	OUT ULONG64 *Delay
+)
+/*++
+
+Routine Description:
+
+	Tells the caller when the frame held back by the report rate limiter
+	is due, so that processing runs again at that time.
+
+Arguments:
+
+	ControllerContext - Touch controller context
+	Delay - Receives the time left before the frame is due in microseconds
+
+Return Value:
+
+	TRUE if a frame is held back
+
+--*/
+{
+	RMI4_CONTROLLER_CONTEXT* controller;
+	ULONG64 due;
+	ULONG64 now;
+	BOOLEAN held;
+
+	controller = (RMI4_CONTROLLER_CONTEXT*) ControllerContext;
+
+	WdfWaitLockAcquire(controller->ProcessingLock, NULL);
+
+	held = controller->RateLimiter.Held &&
+		controller->Config.MaxReportRate != 0;
+
+	if (held)
+	{
+		due = controller->RateLimiter.LastReport +
+			RMI4_RATE_PERIOD(controller->Config.MaxReportRate);
+		now = KeQueryInterruptTime();
+
+		*Delay = (due > now) ? (due - now) / 10 : 0;
+	}
+
+	WdfWaitLockRelease(controller->ProcessingLock);
+
+	return held;
+}
+
 NTSTATUS
 RmiServiceTouchDataInterrupt(
 	IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
@@ -727,6 +1886,11 @@ Return Value:
 		//
 		RmiUpdateLocalFingerCache(
 			&data,
+			&ControllerContext->Cache,
+			ControllerContext->FrameTime);
+
+		RmiPredictContacts(
+			ControllerContext,
 			&ControllerContext->Cache);
 
 		//
@@ -744,6 +1908,22 @@ Return Value:
 			status = STATUS_NO_DATA_DETECTED;
 			goto exit;
 		}
+
+		//
+		// Resting contacts reported again with the same positions are
+		// dropped, pending requests wait for an actual change. Frames
+		// above the maximum report rate are coalesced in the cache
+		//
+		if (!RmiTouchFrameChanged(ControllerContext, &ControllerContext->Cache) ||
+			!RmiRateLimitFrame(ControllerContext, &ControllerContext->Cache))
+		{
+			ControllerContext->TouchesReported =
+				ControllerContext->TouchesTotal;
+			status = STATUS_NO_DATA_DETECTED;
+			goto exit;
+		}
+
+		RmiRecordReportedFrame(ControllerContext, &ControllerContext->Cache);
 	}
 
 	RtlZeroMemory(HidReport, sizeof(PTP_REPORT));
@@ -827,7 +2007,8 @@ Return Value:
 		//
 		RmiUpdateLocalPenCache(
 			&data,
-			&ControllerContext->PenCache);
+			&ControllerContext->PenCache,
+			ControllerContext->FrameTime);
 
 		//
 		// Prepare to report touches via HID reports
@@ -876,64 +2057,72 @@ exit:
 }
 
 NTSTATUS
-TchServiceInterrupts(
+TchCaptureInterrupts(
 	IN VOID *ControllerContext,
 	IN SPB_CONTEXT *SpbContext,
-	IN PDEV_REPORT HidReport,
-	IN UCHAR InputMode,
-	IN BOOLEAN *ServicingComplete
+	IN ULONG64 Timestamp
 )
 /*++
 
 Routine Description:
 
-	This routine is called in response to an interrupt. The driver will
-	service chip interrupts, and if data is available to report to HID,
-	fill the Request object buffer with a HID report.
+	This routine is the capture stage of interrupt servicing, called in
+	response to an interrupt. It reads the interrupt status, which
+	acknowledges the interrupt, and the raw F12 data frame, with a single
+	SPB sequence when possible, and queues the frame to the processing
+	stage. Nothing is decoded here so that the
+	interrupt line is released as soon as possible.
 
 Arguments:
 
 	ControllerContext - Touch controller context
 	SpbContext - A pointer to the current i2c context
-	HidReport - Pointer to a HID_INPUT_REPORT structure to report to the OS
-	InputMode - Specifies mouse, single-touch, or multi-touch reporting modes
-	ServicingComplete - Notifies caller if there are more reports needed to
-		complete servicing interrupts coming from the hardware.
+	Timestamp - Interrupt time at entry of the interrupt, the sample time
+		of the frame
 
 Return Value:
 
-	NTSTATUS indicating whether or not the current HidReport has been filled
+	NTSTATUS, where only success indicates a frame was queued
 
-	ServicingComplete indicates whether or not a new report buffer is required
-		to complete interrupt processing.
 --*/
 {
-	NTSTATUS status = STATUS_NO_DATA_DETECTED;
+	NTSTATUS status;
 	RMI4_CONTROLLER_CONTEXT* controller;
-	RMI4_F11_DATA_REGISTERS data;
+	RMI4_SERVICE_ACCESS order[RmiServiceAccessMax];
+	NTSTATUS dataStatus = STATUS_SUCCESS;
+	BOOLEAN frameRead = FALSE;
+	BOOLEAN statusRead = FALSE;
+	ULONG interruptStatus = 0;
+	BYTE buttons = 0;
+	ULONG accessMask;
+	ULONG pageWrites;
+	int count;
+	int i;
 
 	controller = (RMI4_CONTROLLER_CONTEXT*) ControllerContext;
 
-	NT_ASSERT(ServicingComplete != NULL);
-
 	//
 	// Grab a waitlock to ensure the ISR executes serially and is 
 	// protected against power state transitions
 	//
 	WdfWaitLockAcquire(controller->ControllerLock, NULL);
 
-	RtlZeroMemory(&data, sizeof(data));
+	pageWrites = controller->PageSelectWrites;
+	accessMask =
+		(1 << RmiServiceAccessStatus) |
+		(1 << RmiServiceAccessTouchData);
 
 	//
-	// Check the interrupt source if no interrupts are pending processing
+	// Fetch the status and the frame in one go when possible, which
+	// leaves nothing for the full path to access
 	//
-	if (controller->InterruptStatus == 0)
-	{
-		status = RmiCheckInterrupts(
-			controller,
-			SpbContext,
-			&controller->InterruptStatus);
+	status = RmiReadFrameAndStatus(
+		controller,
+		SpbContext,
+		&interruptStatus);
 
+	if (status != STATUS_NOT_SUPPORTED)
+	{
 		if (!NT_SUCCESS(status))
 		{
 			Trace(
@@ -942,87 +2131,435 @@ Return Value:
 				"Error servicing interrupts - %!STATUS!",
 				status);
 
-			*ServicingComplete = FALSE;
 			goto exit;
 		}
+
+		frameRead = TRUE;
+		accessMask = 0;
+	}
+
+	//
+	// The status read acknowledges the interrupt and comes first, the
+	// plan only decides the page selections around it
+	//
+	count = RmiGetServiceOrder(controller, accessMask, order);
+
+	for (i = 0; i < count; i++)
+	{
+		switch (order[i])
+		{
+		case RmiServiceAccessStatus:
+		{
+			status = RmiCheckInterrupts(
+				controller,
+				SpbContext,
+				&interruptStatus);
+
+			if (!NT_SUCCESS(status))
+			{
+				Trace(
+					TRACE_LEVEL_ERROR,
+					TRACE_INTERRUPT,
+					"Error servicing interrupts - %!STATUS!",
+					status);
+
+				goto exit;
+			}
+
+			statusRead = TRUE;
+			break;
+		}
+		case RmiServiceAccessTouchData:
+		{
+			//
+			// The frame is only read for the touch data announced by
+			// the status read, a button press alone does not read it
+			//
+			if (!statusRead ||
+				!(interruptStatus & controller->Interrupts.Touch))
+			{
+				break;
+			}
+
+			//
+			// Only send the read here, the button read is queued
+			// behind it and the frame is collected once both went out
+			//
+			dataStatus = RmiStartFrameRead(
+				controller,
+				SpbContext,
+				FALSE);
+
+			break;
+		}
+		default:
+		{
+			break;
+		}
+		}
 	}
 
+	Trace(
+		TRACE_LEVEL_VERBOSE,
+		TRACE_INTERRUPT,
+		"Service cycle issued %d page select writes",
+		controller->PageSelectWrites - pageWrites);
+
 	//
-	// Driver only services 0D cap button and 2D touch messages currently
+	// Driver only services device status, 0D cap button and 2D touch
+	// messages currently. Other sources are not enabled, but may be pending from before the
+	// controller was configured
 	//
-	if (controller->InterruptStatus &
-		~(RMI4_INTERRUPT_BIT_0D_CAP_BUTTON | RMI4_INTERRUPT_BIT_2D_TOUCH))
+	if (interruptStatus & ~controller->Interrupts.Serviced)
 	{
 		Trace(
 			TRACE_LEVEL_WARNING,
 			TRACE_INTERRUPT,
 			"Ignoring following interrupt flags - %!STATUS!",
-			controller->InterruptStatus &
-			~(RMI4_INTERRUPT_BIT_0D_CAP_BUTTON |
-				RMI4_INTERRUPT_BIT_2D_TOUCH));
+			interruptStatus & ~controller->Interrupts.Serviced);
 
 		//
 		// Mask away flags we don't service
 		//
-		controller->InterruptStatus &=
-			(RMI4_INTERRUPT_BIT_0D_CAP_BUTTON |
-				RMI4_INTERRUPT_BIT_2D_TOUCH);
+		interruptStatus &= controller->Interrupts.Serviced;
 	}
 
 	//
-	// RmiServiceXXX routine will change status to STATUS_SUCCESS if there
-	// is a HID report to process.
+	// The device status was handled along with the status read, only
+	// the sources carrying data go on to the processing stage
 	//
-	status = STATUS_UNSUCCESSFUL;
-
-	BOOLEAN pendingTouches = FALSE;
-	BOOLEAN pendingPens = FALSE;
+	interruptStatus &= ~controller->Interrupts.DeviceStatus;
 
-	if (controller->TouchesReported == controller->TouchesTotal ||
-		controller->PensReported == controller->PensTotal)
+	if (interruptStatus & controller->Interrupts.Buttons)
 	{
-		//
-		// See if new touch data is available
-		//
-		status = RmiGetTouchesFromController(
-			ControllerContext,
+		status = RmiReadButtons(
+			controller,
 			SpbContext,
-			&data
-		);
+			&buttons);
 
 		if (!NT_SUCCESS(status))
 		{
 			Trace(
-				TRACE_LEVEL_VERBOSE,
-				TRACE_SAMPLES,
-				"No pen data to report - %!STATUS!",
+				TRACE_LEVEL_ERROR,
+				TRACE_INTERRUPT,
+				"Error reading button data - %!STATUS!",
 				status);
 
+			interruptStatus &= ~controller->Interrupts.Buttons;
+		}
+	}
+
+	//
+	// Collect the frame when there is touch data, and in any case
+	// when its read is in flight
+	//
+	if (NT_SUCCESS(dataStatus) && !frameRead &&
+		(controller->Frames.InFlight ||
+			(interruptStatus & controller->Interrupts.Touch)))
+	{
+		dataStatus = RmiFinishFrameRead(
+			controller,
+			SpbContext);
+	}
+
+	if (!(interruptStatus & controller->Interrupts.Serviced))
+	{
+		status = STATUS_NO_DATA_DETECTED;
+		goto exit;
+	}
+
+	if ((interruptStatus & controller->Interrupts.Touch) &&
+		!NT_SUCCESS(dataStatus))
+	{
+		status = dataStatus;
+
+		Trace(
+			TRACE_LEVEL_ERROR,
+			TRACE_INTERRUPT,
+			"Error reading finger status data - %!STATUS!",
+			status);
+
+		goto exit;
+	}
+
+	status = RmiQueueFrame(
+		controller,
+		Timestamp,
+		interruptStatus,
+		buttons);
+
+	if (NT_SUCCESS(status))
+	{
+		controller->Polling.InterruptFrames++;
+		controller->Polling.InterruptCaptureTime +=
+			KeQueryInterruptTime() - Timestamp;
+	}
+
+exit:
+
+	//
+	// Follow the reporting mode decided on earlier frames
+	//
+	if (NT_SUCCESS(status))
+	{
+		RmiApplyReportingMode(controller, SpbContext);
+	}
+
+	//
+	// Feed the interrupt/polling mode decision
+	//
+	RmiTrackCapturedFrame(
+		controller,
+		Timestamp,
+		NT_SUCCESS(status) &&
+			(interruptStatus & controller->Interrupts.Touch));
+
+	WdfWaitLockRelease(controller->ControllerLock);
+
+	return status;
+}
+
+VOID
+RmiTrackScanTime(
+	IN RMI4_CONTROLLER_CONTEXT* ControllerContext,
+	IN ULONG64 Timestamp
+)
+/*++
+
+Routine Description:
+
+	Makes the sample time of a touch frame the scan time of its reports
+	and accounts the interval to the previous frame. Called with the
+	processing lock held.
+
+Arguments:
+
+	ControllerContext - Touch controller context
+	Timestamp - Interrupt time the frame was sampled at
+
+Return Value:
+
+	None.
+
+--*/
+{
+	RMI4_SCAN_TIMING* timing;
+	ULONG64 interval;
+	ULONG64 latency;
+
+	timing = &ControllerContext->Timing;
+
+	ControllerContext->FrameTime = Timestamp;
+
+	latency = KeQueryInterruptTime() - Timestamp;
+	timing->MaxLatency = max(timing->MaxLatency, latency);
+
+	//
+	// Frames are processed in sample order, the first frame of a touch
+	// session has no interval
+	//
+	interval = Timestamp - timing->LastFrame;
+	timing->LastFrame = Timestamp;
+
+	if (interval > RMI4_SCAN_MAX_INTERVAL)
+	{
+		goto exit;
+	}
+
+	if (timing->Intervals == 0)
+	{
+		timing->MinInterval = interval;
+		timing->MaxInterval = interval;
+		timing->AverageInterval = interval;
+	}
+	else
+	{
+		timing->MinInterval = min(timing->MinInterval, interval);
+		timing->MaxInterval = max(timing->MaxInterval, interval);
+		timing->AverageInterval =
+			(timing->AverageInterval * 15 + interval) / 16;
+	}
+
+	timing->Intervals++;
+
+exit:
+
+	return;
+}
+
+NTSTATUS
+TchServiceInterrupts(
+	IN VOID *ControllerContext,
+	IN PDEV_REPORT HidReport,
+	IN UCHAR InputMode,
+	IN BOOLEAN *ServicingComplete
+)
+/*++
+
+Routine Description:
+
+	This routine is the processing stage of interrupt servicing. It takes
+	the frames queued by TchCaptureInterrupts in order and, if data is
+	available to report to HID, fills a HID report.
+
+Arguments:
+
+	ControllerContext - Touch controller context
+	HidReport - Pointer to a HID_INPUT_REPORT structure to report to the OS
+	InputMode - Specifies mouse, single-touch, or multi-touch reporting modes
+	ServicingComplete - Notifies caller if there are more reports needed to
+		complete processing the captured frames.
+
+Return Value:
+
+	NTSTATUS indicating whether or not the current HidReport has been filled
+
+	ServicingComplete indicates whether or not a new report buffer is required
+		to complete frame processing.
+--*/
+{
+	NTSTATUS status = STATUS_NO_DATA_DETECTED;
+	RMI4_CONTROLLER_CONTEXT* controller;
+	RMI4_FRAME_RING_ENTRY* entry;
+
+	controller = (RMI4_CONTROLLER_CONTEXT*) ControllerContext;
+
+	NT_ASSERT(ServicingComplete != NULL);
+
+	//
+	// Frames are processed by one thread at a time, in capture order
+	//
+	WdfWaitLockAcquire(controller->ProcessingLock, NULL);
+
+	BOOLEAN pendingTouches = FALSE;
+	BOOLEAN pendingPens = FALSE;
+
+	//
+	// With no newer frame captured, a frame held back by the report rate
+	// limiter goes out from the cache once its slot opened
+	//
+	if (controller->InterruptStatus == 0 &&
+		RmiRingFront(&controller->Ring) == NULL &&
+		RmiReleaseHeldFrame(controller))
+	{
+		controller->InterruptStatus = controller->Interrupts.Touch;
+		controller->TouchReportDue = TRUE;
+	}
+
+	//
+	// Move on to the next captured frame once the previous one has been
+	// fully reported
+	//
+	if (controller->InterruptStatus == 0)
+	{
+		entry = RmiRingFront(&controller->Ring);
+
+		if (entry == NULL)
+		{
+			goto exit;
+		}
+
+		Trace(
+			TRACE_LEVEL_VERBOSE,
+			TRACE_SAMPLES,
+			"Processing frame captured %lluus ago",
+			(KeQueryInterruptTime() - entry->Timestamp) / 10);
+
+		if (entry->InterruptStatus & controller->Interrupts.Touch)
+		{
+			RmiTrackScanTime(controller, entry->Timestamp);
+		}
+
+		RtlZeroMemory(&controller->FrameData, sizeof(controller->FrameData));
+
+		status = STATUS_SUCCESS;
+
+		if (entry->InterruptStatus & controller->Interrupts.Touch)
+		{
+			status = RmiGetTouchesFromFrame(
+				ControllerContext,
+				entry->Data,
+				&controller->FrameData);
+
+			if (NT_SUCCESS(status))
+			{
+				RmiGovernReportingMode(controller, &controller->FrameData);
+			}
+		}
+
+		if (NT_SUCCESS(status))
+		{
+			controller->InterruptStatus = entry->InterruptStatus;
+			controller->Buttons = entry->Buttons;
+
+			//
+			// A touch frame carries both finger and pen objects, each
+			// gets its reports out of the same decoded data
+			//
+			controller->TouchReportDue = controller->PenReportDue =
+				(entry->InterruptStatus & controller->Interrupts.Touch) != 0;
+		}
+
+		RmiRingPop(&controller->Ring);
+
+		if (!NT_SUCCESS(status))
+		{
+			goto exit;
+		}
+	}
+
+	//
+	// RmiServiceXXX routine will change status to STATUS_SUCCESS if there
+	// is a HID report to process.
+	//
+	status = STATUS_UNSUCCESSFUL;
+
+	//
+	// Service a 0D capacitive button event if indicated by hardware,
+	// it takes a report of its own
+	//
+	if (controller->InterruptStatus & controller->Interrupts.Buttons)
+	{
+		controller->InterruptStatus &= ~controller->Interrupts.Buttons;
+
+		status = RmiServiceCapButtonInterrupt(
+			controller,
+			&(HidReport->KeypadReport));
+
+		if (NT_SUCCESS(status))
+		{
 			goto exit;
 		}
 	}
 
 	//
-	// Service a touch data event if indicated by hardware 
+	// Service a touch data event if indicated by hardware. Finger reports
+	// for the frame are sent first, the pen reports of the same frame
+	// follow back-to-back before the next frame is taken
 	//
-	if (controller->InterruptStatus & RMI4_INTERRUPT_BIT_2D_TOUCH)
+	if (controller->TouchReportDue)
 	{
 		status = RmiServiceTouchDataInterrupt(
 			ControllerContext,
-			data,
+			controller->FrameData,
 			&(HidReport->PtpReport),
 			InputMode,
 			&pendingTouches);
 
+		if (!pendingTouches)
+		{
+			controller->TouchReportDue = FALSE;
+		}
+
 		//
 		// Success indicates the report is ready to be sent, otherwise,
-		// continue to service interrupts.
+		// continue with the pen data of the frame.
 		//
 		if (NT_SUCCESS(status))
 		{
 			goto exit2D;
 		}
-		else
+		else if (status != STATUS_NO_DATA_DETECTED)
 		{
 			Trace(
 				TRACE_LEVEL_ERROR,
@@ -1035,15 +2572,20 @@ Return Value:
 	//
 	// Service a pen data event if indicated by hardware 
 	//
-	if (controller->InterruptStatus & RMI4_INTERRUPT_BIT_2D_TOUCH)
+	if (controller->PenReportDue)
 	{
 		status = RmiServicePenDataInterrupt(
 			ControllerContext,
-			data,
+			controller->FrameData,
 			&(HidReport->PenReport),
 			InputMode,
 			&pendingPens);
 
+		if (!pendingPens)
+		{
+			controller->PenReportDue = FALSE;
+		}
+
 		//
 		// Success indicates the report is ready to be sent, otherwise,
 		// continue to service interrupts.
@@ -1052,7 +2594,7 @@ Return Value:
 		{
 			goto exit2D;
 		}
-		else
+		else if (status != STATUS_NO_DATA_DETECTED)
 		{
 			Trace(
 				TRACE_LEVEL_ERROR,
@@ -1064,23 +2606,30 @@ Return Value:
 
 exit2D:
 	//
-	// If there are more touches to report, servicing is incomplete
+	// If there are more touches or pens to report from the frame,
+	// servicing is incomplete
 	//
-	if (pendingTouches == FALSE && pendingPens == FALSE)
+	if (!controller->TouchReportDue && !controller->PenReportDue)
 	{
-		controller->InterruptStatus &= ~RMI4_INTERRUPT_BIT_2D_TOUCH;
+		controller->InterruptStatus &= ~controller->Interrupts.Touch;
 	}
 
 	//
 	// Add servicing for additional touch interrupts here
 	//
 
+	//
+	// Interrupts without servicing must not hold up the next frame
+	//
+	controller->InterruptStatus &= controller->Interrupts.Touch;
+
 exit:
 
 	//
-	// Indicate whether or not we're done servicing interrupts
+	// Indicate whether or not we're done processing captured frames
 	//
-	if (controller->InterruptStatus == 0)
+	if (controller->InterruptStatus == 0 &&
+		RmiRingFront(&controller->Ring) == NULL)
 	{
 		*ServicingComplete = TRUE;
 	}
@@ -1089,7 +2638,7 @@ exit:
 		*ServicingComplete = FALSE;
 	}
 
-	WdfWaitLockRelease(controller->ControllerLock);
+	WdfWaitLockRelease(controller->ProcessingLock);
 
 	return status;
 }
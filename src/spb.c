@@ -21,6 +21,7 @@
 #include <compat.h>
 #include <internal.h>
 #include <controller.h>
+#include <spb.h>
 #include <spb.tmh>
 
 NTSTATUS
@@ -308,6 +309,644 @@ exit:
     return status;
 }
 
+NTSTATUS
+SpbAsyncReadInitialize(
+    IN SPB_CONTEXT *SpbContext,
+    OUT SPB_ASYNC_READ *Read
+    )
+/*++
+ 
+  Routine Description:
+
+    Allocates the request and transfer list used by an asynchronous
+    read, so that issuing the read never allocates.
+
+  Arguments:
+
+    SpbContext - Pointer to the current device context 
+    Read       - The asynchronous read to initialize
+
+  Return Value:
+
+    NTSTATUS Status indicating success or failure
+
+--*/
+{
+    WDF_OBJECT_ATTRIBUTES attributes;
+    NTSTATUS status;
+
+    RtlZeroMemory(Read, sizeof(SPB_ASYNC_READ));
+    SpbSequenceInitialize(&Read->Writes);
+
+    //
+    // Nothing is in flight, waiting must not block
+    //
+    KeInitializeEvent(&Read->Completed, NotificationEvent, TRUE);
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = SpbContext->SpbIoTarget;
+
+    status = WdfRequestCreate(
+        &attributes,
+        SpbContext->SpbIoTarget,
+        &Read->Request);
+
+    if (!NT_SUCCESS(status))
+    {
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_SPB,
+            "Error creating Spb read request - %!STATUS!",
+            status);
+        goto exit;
+    }
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = Read->Request;
+
+    status = WdfMemoryCreate(
+        &attributes,
+        NonPagedPoolNx,
+        TOUCH_POOL_TAG,
+        sizeof(SPB_TRANSFER_LIST_AND_ENTRIES(SPB_SEQUENCE_MAX_TRANSFERS + 2)),
+        &Read->TransferList,
+        NULL);
+
+    if (!NT_SUCCESS(status))
+    {
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_SPB,
+            "Error allocating Spb read transfer list - %!STATUS!",
+            status);
+        goto exit;
+    }
+
+exit:
+
+    if (!NT_SUCCESS(status))
+    {
+        SpbAsyncReadDeinitialize(Read);
+    }
+
+    return status;
+}
+
+VOID
+SpbAsyncReadDeinitialize(
+    IN SPB_ASYNC_READ *Read
+    )
+/*++
+ 
+  Routine Description:
+
+    Frees the request of an asynchronous read, which must not be in
+    flight anymore. The transfer list is parented to the request.
+
+  Arguments:
+
+    Read - The asynchronous read to free
+
+  Return Value:
+
+    None
+
+--*/
+{
+    NT_ASSERT(!Read->Pending);
+
+    if (Read->Request != NULL)
+    {
+        WdfObjectDelete(Read->Request);
+        Read->Request = NULL;
+        Read->TransferList = NULL;
+    }
+}
+
+VOID
+SpbAsyncReadReset(
+    IN SPB_ASYNC_READ *Read
+    )
+/*++
+ 
+  Routine Description:
+
+    Clears the writes and the leading read queued in an asynchronous
+    read, before queuing those of the next transfer.
+
+  Arguments:
+
+    Read - The asynchronous read, not in flight
+
+  Return Value:
+
+    None
+
+--*/
+{
+    NT_ASSERT(!Read->Pending);
+
+    SpbSequenceInitialize(&Read->Writes);
+
+    Read->LeadWrites = 0;
+    Read->LeadData = NULL;
+    Read->LeadLength = 0;
+}
+
+NTSTATUS
+SpbAsyncReadAddLead(
+    IN SPB_ASYNC_READ *Read,
+    OUT PVOID Data,
+    IN ULONG Length
+    )
+/*++
+ 
+  Routine Description:
+
+    Queues a read of Length bytes into Data behind the writes queued so
+    far, ahead of the writes queued afterwards and the data phase. Only
+    one leading read is supported.
+
+  Arguments:
+
+    Read   - The asynchronous read, not in flight
+    Data   - A buffer to receive the data, valid until the read completes
+    Length - The amount of data to be read
+
+  Return Value:
+
+    NTSTATUS Status indicating success or failure
+
+--*/
+{
+    if (Read->LeadLength != 0 || Length == 0)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    Read->LeadWrites = Read->Writes.TransferCount;
+    Read->LeadData = Data;
+    Read->LeadLength = Length;
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+SpbAsyncReadCompletion(
+    IN WDFREQUEST Request,
+    IN WDFIOTARGET Target,
+    IN PWDF_REQUEST_COMPLETION_PARAMS Params,
+    IN WDFCONTEXT Context
+    )
+/*++
+ 
+  Routine Description:
+
+    Records the outcome of an asynchronous read and wakes its waiter.
+
+  Arguments:
+
+    Request - The completed request
+    Target  - The Spb I/O target
+    Params  - The completion parameters
+    Context - The asynchronous read
+
+  Return Value:
+
+    None
+
+--*/
+{
+    SPB_ASYNC_READ *read;
+
+    UNREFERENCED_PARAMETER(Request);
+    UNREFERENCED_PARAMETER(Target);
+
+    read = (SPB_ASYNC_READ*) Context;
+
+    read->Status = Params->IoStatus.Status;
+
+    //
+    // Every queued write byte plus both data phases must have been
+    // transferred
+    //
+    if (NT_SUCCESS(read->Status) &&
+        Params->IoStatus.Information !=
+            read->Writes.BufferUsed + read->LeadLength + read->Length)
+    {
+        read->Status = STATUS_DEVICE_PROTOCOL_ERROR;
+    }
+
+    KeSetEvent(&read->Completed, IO_NO_INCREMENT, FALSE);
+}
+
+NTSTATUS
+SpbAsyncReadStart(
+    IN SPB_CONTEXT *SpbContext,
+    IN SPB_ASYNC_READ *Read,
+    OUT PVOID Data,
+    IN ULONG Length
+    )
+/*++
+ 
+  Routine Description:
+
+    Sends the writes queued in the read, along with its leading read if
+    any, followed by a read of Length bytes into Data, without waiting
+    for the transfer. Data must stay
+    valid until SpbAsyncReadWait returns. The Spb lock is not taken as
+    none of the shared buffers are used, the Spb target orders the
+    request with any other I/O.
+
+  Arguments:
+
+    SpbContext - Pointer to the current device context 
+    Read       - The asynchronous read, with its writes queued
+    Data       - A buffer to receive the data
+    Length     - The amount of data to be read
+
+  Return Value:
+
+    NTSTATUS Status indicating whether the read was sent. STATUS_NOT_SUPPORTED
+    means the Spb controller cannot execute sequences and the caller needs
+    to read synchronously.
+
+--*/
+{
+    SPB_TRANSFER_LIST_AND_ENTRIES(SPB_SEQUENCE_MAX_TRANSFERS + 2)* transferList;
+    SPB_SEQUENCE_TRANSFER* transfer;
+    WDF_REQUEST_REUSE_PARAMS reuseParams;
+    ULONG entry;
+    ULONG i;
+    NTSTATUS status;
+
+    NT_ASSERT(!Read->Pending);
+
+    if (Read->Unsupported || Read->Request == NULL)
+    {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    transferList = WdfMemoryGetBuffer(Read->TransferList, NULL);
+
+    SPB_TRANSFER_LIST_INIT(
+        &(transferList->List),
+        Read->Writes.TransferCount + (Read->LeadLength != 0 ? 2 : 1));
+
+    entry = 0;
+
+    for (i = 0; i < Read->Writes.TransferCount; i++)
+    {
+        if (Read->LeadLength != 0 && i == Read->LeadWrites)
+        {
+            transferList->List.Transfers[entry++] = SPB_TRANSFER_LIST_ENTRY_INIT_SIMPLE(
+                SpbTransferDirectionFromDevice,
+                0,
+                Read->LeadData,
+                Read->LeadLength);
+        }
+
+        transfer = &Read->Writes.Transfers[i];
+
+        transferList->List.Transfers[entry++] = SPB_TRANSFER_LIST_ENTRY_INIT_SIMPLE(
+            SpbTransferDirectionToDevice,
+            0,
+            &Read->Writes.Buffer[transfer->Offset],
+            transfer->Length);
+    }
+
+    //
+    // A leading read behind all the writes is continued by the data
+    // phase from the next register
+    //
+    if (Read->LeadLength != 0 && Read->LeadWrites == Read->Writes.TransferCount)
+    {
+        transferList->List.Transfers[entry++] = SPB_TRANSFER_LIST_ENTRY_INIT_SIMPLE(
+            SpbTransferDirectionFromDevice,
+            0,
+            Read->LeadData,
+            Read->LeadLength);
+    }
+
+    transferList->List.Transfers[entry] = SPB_TRANSFER_LIST_ENTRY_INIT_SIMPLE(
+        SpbTransferDirectionFromDevice,
+        0,
+        Data,
+        Length);
+
+    WDF_REQUEST_REUSE_PARAMS_INIT(
+        &reuseParams,
+        WDF_REQUEST_REUSE_NO_FLAGS,
+        STATUS_SUCCESS);
+
+    status = WdfRequestReuse(Read->Request, &reuseParams);
+
+    if (!NT_SUCCESS(status))
+    {
+        goto exit;
+    }
+
+    status = WdfIoTargetFormatRequestForIoctl(
+        SpbContext->SpbIoTarget,
+        Read->Request,
+        IOCTL_SPB_EXECUTE_SEQUENCE,
+        Read->TransferList,
+        NULL,
+        NULL,
+        NULL);
+
+    if (!NT_SUCCESS(status))
+    {
+        goto exit;
+    }
+
+    WdfRequestSetCompletionRoutine(
+        Read->Request,
+        SpbAsyncReadCompletion,
+        Read);
+
+    Read->Length = Length;
+    Read->Pending = TRUE;
+    KeClearEvent(&Read->Completed);
+
+    if (!WdfRequestSend(
+        Read->Request,
+        SpbContext->SpbIoTarget,
+        WDF_NO_SEND_OPTIONS))
+    {
+        //
+        // The completion routine does not run for requests that could
+        // not be sent
+        //
+        status = WdfRequestGetStatus(Read->Request);
+        Read->Pending = FALSE;
+        KeSetEvent(&Read->Completed, IO_NO_INCREMENT, FALSE);
+        goto exit;
+    }
+
+exit:
+
+    if (!NT_SUCCESS(status))
+    {
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_SPB,
+            "Error sending Spb read - %!STATUS!",
+            status);
+    }
+
+    return status;
+}
+
+NTSTATUS
+SpbAsyncReadWait(
+    IN SPB_ASYNC_READ *Read
+    )
+/*++
+ 
+  Routine Description:
+
+    Waits for an asynchronous read sent by SpbAsyncReadStart.
+
+  Arguments:
+
+    Read - The asynchronous read
+
+  Return Value:
+
+    NTSTATUS Status of the read. STATUS_NOT_SUPPORTED means the Spb
+    controller cannot execute sequences, later reads are then refused
+    right away.
+
+--*/
+{
+    NTSTATUS status;
+
+    if (!Read->Pending)
+    {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    KeWaitForSingleObject(
+        &Read->Completed,
+        Executive,
+        KernelMode,
+        FALSE,
+        NULL);
+
+    Read->Pending = FALSE;
+    status = Read->Status;
+
+    if (status == STATUS_NOT_SUPPORTED ||
+        status == STATUS_INVALID_DEVICE_REQUEST)
+    {
+        Trace(
+            TRACE_LEVEL_INFORMATION,
+            TRACE_SPB,
+            "Spb sequences unsupported, reads stay synchronous");
+
+        Read->Unsupported = TRUE;
+        status = STATUS_NOT_SUPPORTED;
+    }
+    else if (!NT_SUCCESS(status))
+    {
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_SPB,
+            "Error reading from Spb - %!STATUS!",
+            status);
+    }
+
+    return status;
+}
+
+VOID
+SpbSequenceInitialize(
+    OUT SPB_SEQUENCE *Sequence
+    )
+/*++
+ 
+  Routine Description:
+
+    Prepares an empty sequence of register writes.
+
+  Arguments:
+
+    Sequence - The sequence to initialize
+
+  Return Value:
+
+    None
+
+--*/
+{
+    Sequence->TransferCount = 0;
+    Sequence->BufferUsed = 0;
+}
+
+NTSTATUS
+SpbSequenceAddWrite(
+    IN SPB_SEQUENCE *Sequence,
+    IN UCHAR Address,
+    IN PVOID Data,
+    IN ULONG Length
+    )
+/*++
+ 
+  Routine Description:
+
+    Queues a register write at the end of a sequence. Nothing is sent
+    to the controller until the sequence is executed.
+
+  Arguments:
+
+    Sequence - The sequence to append to
+    Address  - The I2C register address to write to
+    Data     - The data to write at the above address
+    Length   - The amount of data to be written
+
+  Return Value:
+
+    NTSTATUS Status indicating success or failure
+
+--*/
+{
+    PUCHAR buffer;
+
+    if (Sequence->TransferCount == SPB_SEQUENCE_MAX_TRANSFERS ||
+        Length + sizeof(Address) > SPB_SEQUENCE_BUFFER_SIZE - Sequence->BufferUsed)
+    {
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_SPB,
+            "Spb sequence full, cannot queue %d byte write",
+            Length);
+
+        return STATUS_BUFFER_OVERFLOW;
+    }
+
+    buffer = &Sequence->Buffer[Sequence->BufferUsed];
+
+    //
+    // As for single writes, the address precedes the data payload
+    //
+    buffer[0] = Address;
+    RtlCopyMemory(buffer + sizeof(Address), Data, Length);
+
+    Sequence->Transfers[Sequence->TransferCount].Offset = Sequence->BufferUsed;
+    Sequence->Transfers[Sequence->TransferCount].Length = Length + sizeof(Address);
+    Sequence->TransferCount++;
+    Sequence->BufferUsed += Length + sizeof(Address);
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+SpbSequenceExecute(
+    IN SPB_CONTEXT *SpbContext,
+    IN SPB_SEQUENCE *Sequence
+    )
+/*++
+ 
+  Routine Description:
+
+    Sends every write queued in a sequence to the Spb I/O target as one
+    IOCTL_SPB_EXECUTE_SEQUENCE request, under a single acquisition of
+    the Spb lock. Controllers that do not support sequences get the
+    writes one by one, still under the same lock acquisition.
+
+  Arguments:
+
+    SpbContext - Pointer to the current device context 
+    Sequence   - The sequence to execute
+
+  Return Value:
+
+    NTSTATUS Status indicating success or failure
+
+--*/
+{
+    SPB_TRANSFER_LIST_AND_ENTRIES(SPB_SEQUENCE_MAX_TRANSFERS) transferList;
+    WDF_MEMORY_DESCRIPTOR memoryDescriptor;
+    ULONG_PTR bytesTransferred;
+    SPB_SEQUENCE_TRANSFER* transfer;
+    ULONG i;
+    NTSTATUS status;
+
+    if (Sequence->TransferCount == 0)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    SPB_TRANSFER_LIST_INIT(&(transferList.List), Sequence->TransferCount);
+
+    for (i = 0; i < Sequence->TransferCount; i++)
+    {
+        transfer = &Sequence->Transfers[i];
+
+        transferList.List.Transfers[i] = SPB_TRANSFER_LIST_ENTRY_INIT_SIMPLE(
+            SpbTransferDirectionToDevice,
+            0,
+            &Sequence->Buffer[transfer->Offset],
+            transfer->Length);
+    }
+
+    WDF_MEMORY_DESCRIPTOR_INIT_BUFFER(
+        &memoryDescriptor,
+        &transferList,
+        sizeof(transferList));
+
+    WdfWaitLockAcquire(SpbContext->SpbLock, NULL);
+
+    status = WdfIoTargetSendIoctlSynchronously(
+        SpbContext->SpbIoTarget,
+        NULL,
+        IOCTL_SPB_EXECUTE_SEQUENCE,
+        &memoryDescriptor,
+        NULL,
+        NULL,
+        &bytesTransferred);
+
+    if (status == STATUS_NOT_SUPPORTED ||
+        status == STATUS_INVALID_DEVICE_REQUEST)
+    {
+        Trace(
+            TRACE_LEVEL_VERBOSE,
+            TRACE_SPB,
+            "Spb sequences unsupported, writing %d transfers one by one",
+            Sequence->TransferCount);
+
+        for (i = 0; i < Sequence->TransferCount; i++)
+        {
+            transfer = &Sequence->Transfers[i];
+
+            status = SpbDoWriteDataSynchronously(
+                SpbContext,
+                Sequence->Buffer[transfer->Offset],
+                &Sequence->Buffer[transfer->Offset + 1],
+                transfer->Length - 1);
+
+            if (!NT_SUCCESS(status))
+            {
+                break;
+            }
+        }
+    }
+
+    WdfWaitLockRelease(SpbContext->SpbLock);
+
+    if (!NT_SUCCESS(status))
+    {
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_SPB,
+            "Error executing Spb sequence - %!STATUS!",
+            status);
+    }
+
+    return status;
+}
+
 VOID
 SpbTargetDeinitialize(
     IN WDFDEVICE FxDevice,